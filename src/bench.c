@@ -0,0 +1,722 @@
+/******************************************************************************
+Copyright (c) 2023 Guy Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cloak.h"
+#include "cloak_types.h"
+#include "secretrw.h"
+#include "threadpool.h"
+#include "erasure.h"
+#include "imgrw.h"
+#include "utils.h"
+#include "bench.h"
+
+#define BENCH_SPAN_SIZE                 65536
+
+/*
+** The largest secret file we can hide...
+*/
+#define BENCH_MAX_SIZE_MB               64
+
+/*
+** Erasure coding is timed on a typical split, losing two data shards...
+*/
+#define BENCH_DATA_SHARDS               4
+#define BENCH_PARITY_SHARDS             2
+
+/*
+** PNG images are benchmarked this wide, with as many rows as the size needs...
+*/
+#define BENCH_IMAGE_WIDTH               1024
+
+/*
+** Without a sample image, --png-tune times a synthetic one this big...
+*/
+#define TUNE_SAMPLE_SIZE_MB             16
+
+/*
+** The tuned profile is recorded in the home directory, and used by
+** later merges that don't give a --png-profile...
+*/
+#define TUNE_PROFILE_FILENAME           ".cloak_png_profile"
+#define TUNE_MAX_PROFILE_NAME_LENGTH    32
+#define TUNE_MAX_PROFILES               8
+
+typedef struct {
+    encryption_algo     algo;
+    const char *        pszName;
+}
+BENCH_ALGO;
+
+static const BENCH_ALGO _algorithms[] = {
+    {aes256,        "aes"},
+    {aes256gcm,     "aes-gcm"},
+    {chacha20,      "chacha20"}
+};
+
+static double _getMBPerSecond(uint32_t length, double seconds) {
+    if (seconds <= 0.0) {
+        return 0.0;
+    }
+
+    return ((double)length / (1024.0 * 1024.0)) / seconds;
+}
+
+/*
+** Time a full encrypt and decrypt of the secret file through the same
+** reader/writer paths used by merge and extract, minus the image...
+*/
+static int _benchmarkAlgorithm(
+                const BENCH_ALGO * algorithm, 
+                const char * pszPlainFile, 
+                const char * pszOutputFile, 
+                uint32_t length, 
+                uint8_t * key, 
+                uint32_t keyLength)
+{
+    HSECRW          hrdr;
+    HSECRW          hwrtr;
+    uint8_t *       span;
+    uint32_t        spanLength;
+    double          start;
+    double          encryptTime;
+    double          decryptTime;
+    int             rtn;
+
+    start = getTimeSeconds();
+
+    hrdr = rdr_open(pszPlainFile, algorithm->algo, compression_none, 1);
+
+    if (hrdr == NULL) {
+        return -1;
+    }
+
+    if (algorithm->algo == aes256) {
+        rtn = rdr_encrypt_aes256(hrdr, key, keyLength);
+    }
+    else {
+        rtn = rdr_encrypt_aead(hrdr, key, keyLength);
+    }
+
+    if (rtn) {
+        rdr_close(hrdr);
+        return -1;
+    }
+
+    encryptTime = getTimeSeconds() - start;
+
+    start = getTimeSeconds();
+
+    hwrtr = wrtr_open(pszOutputFile, algorithm->algo);
+
+    if (hwrtr == NULL) {
+        rdr_close(hrdr);
+        return -1;
+    }
+
+    if (algorithm->algo == aes256) {
+        rtn = wrtr_set_key_aes(hwrtr, key, keyLength);
+    }
+    else {
+        rtn = wrtr_set_key_aead(hwrtr, key, keyLength);
+    }
+
+    /*
+    ** The writer returns 1 once the whole secret has been written...
+    */
+    while (rtn == 0 && rdr_has_more_blocks(hrdr)) {
+        spanLength = rdr_read_encrypted_span(hrdr, &span, BENCH_SPAN_SIZE);
+        rtn = wrtr_write_decrypted_block(hwrtr, span, spanLength);
+    }
+
+    wrtr_close(hwrtr);
+
+    decryptTime = getTimeSeconds() - start;
+
+    rdr_close(hrdr);
+
+    if (rtn < 0) {
+        return -1;
+    }
+
+    printf(
+        "%-12s %10.1f %10.1f\n", 
+        algorithm->pszName, 
+        _getMBPerSecond(length, encryptTime), 
+        _getMBPerSecond(length, decryptTime));
+
+    return 0;
+}
+
+/*
+** Time Reed-Solomon parity generation and recovery of the data shards,
+** which is all the work --parity adds over a plain merge or extract...
+*/
+static int _benchmarkErasure(uint32_t length) {
+    uint8_t *       shards[BENCH_DATA_SHARDS + BENCH_PARITY_SHARDS];
+    boolean         isPresent[BENCH_DATA_SHARDS + BENCH_PARITY_SHARDS];
+    uint32_t        shardLength;
+    double          start;
+    double          encodeTime;
+    double          decodeTime = 0.0;
+    int             i;
+    int             rtn;
+
+    shardLength = length / BENCH_DATA_SHARDS;
+
+    for (i = 0;i < (BENCH_DATA_SHARDS + BENCH_PARITY_SHARDS);i++) {
+        shards[i] = (uint8_t *)malloc(shardLength);
+        isPresent[i] = (i >= BENCH_PARITY_SHARDS ? True : False);
+
+        if (shards[i] == NULL) {
+            fprintf(stderr, "Failed to allocate memory for erasure coding benchmark\n");
+
+            while (i-- > 0) {
+                free(shards[i]);
+            }
+
+            return -1;
+        }
+
+        memset(shards[i], i + 1, shardLength);
+    }
+
+    start = getTimeSeconds();
+    rtn = ec_encode(shards, BENCH_DATA_SHARDS, BENCH_PARITY_SHARDS, shardLength);
+    encodeTime = getTimeSeconds() - start;
+
+    if (rtn == 0) {
+        start = getTimeSeconds();
+        rtn = ec_reconstruct(shards, isPresent, BENCH_DATA_SHARDS, BENCH_PARITY_SHARDS, shardLength);
+        decodeTime = getTimeSeconds() - start;
+    }
+
+    for (i = 0;i < (BENCH_DATA_SHARDS + BENCH_PARITY_SHARDS);i++) {
+        free(shards[i]);
+    }
+
+    if (rtn) {
+        return -1;
+    }
+
+    printf(
+        "%-12s %10.1f %10.1f\n", 
+        "rs 4+2", 
+        _getMBPerSecond(shardLength * BENCH_DATA_SHARDS, encodeTime), 
+        _getMBPerSecond(shardLength * BENCH_DATA_SHARDS, decodeTime));
+
+    return 0;
+}
+
+/*
+** Decode every row of the image, as an extract of a full image does...
+*/
+static int _decodeImage(const char * pszImageFile, double * decodeTime) {
+    HIMG            himg;
+    uint8_t *       rowBuffer;
+    uint32_t        rowLength;
+    double          start;
+    int             rtn = 0;
+
+    start = getTimeSeconds();
+
+    himg = imgrdr_open(pszImageFile);
+
+    if (himg == NULL) {
+        return -1;
+    }
+
+    rowLength = imgrdr_get_row_buffer_len(himg);
+    rowBuffer = (uint8_t *)malloc(rowLength);
+
+    if (rowBuffer == NULL) {
+        imgrdr_close(himg);
+        imgrdr_destroy_handle(himg);
+        return -1;
+    }
+
+    while (rtn == 0 && imgrdr_has_more_rows(himg)) {
+        rtn = imgrdr_read_row(himg, rowBuffer, rowLength);
+    }
+
+    imgrdr_close(himg);
+    imgrdr_destroy_handle(himg);
+
+    *decodeTime = getTimeSeconds() - start;
+
+    free(rowBuffer);
+
+    return rtn;
+}
+
+/*
+** A sample carrier, a gradient with noisy low bits, much as a merged
+** image looks to zlib...
+*/
+static uint8_t * _makeSampleImage(uint32_t length, int32_t * height) {
+    uint8_t *       pixels;
+    uint32_t        rowLength;
+    uint32_t        noise = 0x9E3779B9U;
+    int32_t         x;
+    int32_t         y;
+
+    rowLength = BENCH_IMAGE_WIDTH * 3;
+    *height = (int32_t)(length / rowLength);
+
+    pixels = (uint8_t *)malloc(rowLength * *height);
+
+    if (pixels == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sample image\n");
+        return NULL;
+    }
+
+    for (y = 0;y < *height;y++) {
+        for (x = 0;x < (int32_t)rowLength;x++) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+
+            pixels[y * rowLength + x] = (uint8_t)(((x / 3 + y) & 0xFE) | (noise & 0x01));
+        }
+    }
+
+    return pixels;
+}
+
+/*
+** Write the pixels as a PNG image with the current encode options...
+*/
+static int _encodeImage(
+                const char * pszImageFile, 
+                uint8_t * pixels, 
+                int32_t width, 
+                int32_t height, 
+                double * encodeTime)
+{
+    HIMG            himg;
+    uint32_t        rowLength;
+    int32_t         y;
+    double          start;
+    int             rtn;
+
+    rowLength = (uint32_t)width * 3;
+
+    start = getTimeSeconds();
+
+    himg = imgwrtr_open(pszImageFile, img_png);
+
+    if (himg == NULL) {
+        return -1;
+    }
+
+    imgwrtr_set_size(himg, width, height);
+    rtn = imgwrtr_write_header(himg);
+
+    for (y = 0;rtn == 0 && y < height;y++) {
+        rtn = imgwrtr_write_row(himg, &pixels[y * rowLength], rowLength);
+    }
+
+    imgwrtr_close(himg);
+    imgrdr_destroy_handle(himg);
+
+    *encodeTime = getTimeSeconds() - start;
+
+    return rtn;
+}
+
+/*
+** Time writing a PNG carrier on all cores and with libpng alone, then
+** reading it back with the default and the --trusted-input decode
+** profiles...
+*/
+static int _benchmarkPNG(const char * pszImageFile, uint32_t length) {
+    uint8_t *       pixels;
+    uint32_t        dataLength;
+    int32_t         height;
+    double          encodeTime;
+    double          singleEncodeTime;
+    double          decodeTime;
+    double          trustedDecodeTime;
+    int             rtn;
+
+    pixels = _makeSampleImage(length, &height);
+
+    if (pixels == NULL) {
+        return -1;
+    }
+
+    dataLength = BENCH_IMAGE_WIDTH * 3 * height;
+
+    imgwrtr_set_png_threads(1);
+    rtn = _encodeImage(pszImageFile, pixels, BENCH_IMAGE_WIDTH, height, &singleEncodeTime);
+    imgwrtr_set_png_threads(0);
+
+    if (rtn == 0) {
+        rtn = _encodeImage(pszImageFile, pixels, BENCH_IMAGE_WIDTH, height, &encodeTime);
+    }
+
+    free(pixels);
+
+    if (rtn == 0) {
+        rtn = _decodeImage(pszImageFile, &decodeTime);
+    }
+
+    if (rtn == 0) {
+        imgrdr_set_trusted_input(True);
+        rtn = _decodeImage(pszImageFile, &trustedDecodeTime);
+        imgrdr_set_trusted_input(False);
+    }
+
+    if (rtn) {
+        return -1;
+    }
+
+    printf(
+        "%-12s %10.1f %10.1f\n", 
+        "png", 
+        _getMBPerSecond(dataLength, encodeTime), 
+        _getMBPerSecond(dataLength, decodeTime));
+
+    printf(
+        "%-12s %10.1f %10s\n", 
+        "png 1 thread", 
+        _getMBPerSecond(dataLength, singleEncodeTime), 
+        "-");
+
+    printf(
+        "%-12s %10s %10.1f\n", 
+        "png trusted", 
+        "-", 
+        _getMBPerSecond(dataLength, trustedDecodeTime));
+
+    return 0;
+}
+
+/*
+** Compare the keyed algorithms on this host, so operators can pick
+** e.g. chacha20 on machines without AES instructions...
+*/
+int benchmark(uint32_t sizeMB) {
+    char            szPlainFile[] = "/tmp/cloak_bench_XXXXXX";
+    char            szOutputFile[] = "/tmp/cloak_bench_out_XXXXXX";
+    char            szImageFile[] = "/tmp/cloak_bench_img_XXXXXX";
+    uint8_t         key[64];
+    uint32_t        keyLength;
+    uint32_t        length;
+    int             fd;
+    int             i;
+    int             rtn = 0;
+
+    if (sizeMB == 0 || sizeMB > BENCH_MAX_SIZE_MB) {
+        fprintf(stderr, "Benchmark size must be between 1 and %u MB\n", BENCH_MAX_SIZE_MB);
+        return -1;
+    }
+
+    length = sizeMB << 20;
+
+    fd = mkstemp(szPlainFile);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create benchmark file\n");
+        return -1;
+    }
+
+    close(fd);
+
+    fd = mkstemp(szOutputFile);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create benchmark output file\n");
+        unlink(szPlainFile);
+        return -1;
+    }
+
+    close(fd);
+
+    fd = mkstemp(szImageFile);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create benchmark image file\n");
+        unlink(szPlainFile);
+        unlink(szOutputFile);
+        return -1;
+    }
+
+    close(fd);
+
+    if (generateKeystreamFile(szPlainFile, length)) {
+        unlink(szPlainFile);
+        unlink(szOutputFile);
+        unlink(szImageFile);
+        return -1;
+    }
+
+    keyLength = getKey(key, sizeof(key), "benchmark");
+
+    printf("Benchmarking %u MB on %d cores\n\n", sizeMB, tp_get_num_cores());
+    printf("%-12s %10s %10s\n", "algorithm", "enc MB/s", "dec MB/s");
+
+    for (i = 0;i < (int)(sizeof(_algorithms) / sizeof(BENCH_ALGO));i++) {
+        if (_benchmarkAlgorithm(&_algorithms[i], szPlainFile, szOutputFile, length, key, keyLength)) {
+            fprintf(stderr, "Benchmark failed for algorithm '%s'\n", _algorithms[i].pszName);
+            rtn = -1;
+            break;
+        }
+    }
+
+    if (rtn == 0 && _benchmarkErasure(length)) {
+        fprintf(stderr, "Benchmark failed for erasure coding\n");
+        rtn = -1;
+    }
+
+    if (rtn == 0 && _benchmarkPNG(szImageFile, length)) {
+        fprintf(stderr, "Benchmark failed for PNG images\n");
+        rtn = -1;
+    }
+
+    unlink(szPlainFile);
+    unlink(szOutputFile);
+    unlink(szImageFile);
+
+    return rtn;
+}
+
+/*
+** Read the sample carrier's pixels, width x 3 bytes of each row, so any
+** BMP row padding is left behind...
+*/
+static uint8_t * _readSampleImage(const char * pszSampleImage, int32_t * width, int32_t * height) {
+    HIMG            himg;
+    uint8_t *       pixels;
+    uint32_t        rowLength;
+    uint32_t        pixelRowLength;
+    int32_t         y = 0;
+    int             rtn = 0;
+
+    himg = imgrdr_open(pszSampleImage);
+
+    if (himg == NULL) {
+        return NULL;
+    }
+
+    rowLength = imgrdr_get_row_buffer_len(himg);
+    pixelRowLength = imgrdr_get_width(himg) * 3;
+
+    *width = (int32_t)imgrdr_get_width(himg);
+    *height = (int32_t)(imgrdr_get_data_length(himg) / rowLength);
+
+    /*
+    ** One spare row, the last is read in place...
+    */
+    pixels = (uint8_t *)malloc(pixelRowLength * *height + rowLength);
+
+    if (pixels == NULL) {
+        fprintf(stderr, "Failed to allocate memory for sample image\n");
+        imgrdr_close(himg);
+        imgrdr_destroy_handle(himg);
+        return NULL;
+    }
+
+    while (rtn == 0 && y < *height && imgrdr_has_more_rows(himg)) {
+        rtn = imgrdr_read_row(himg, &pixels[y * pixelRowLength], rowLength);
+        y++;
+    }
+
+    imgrdr_close(himg);
+    imgrdr_destroy_handle(himg);
+
+    if (rtn) {
+        free(pixels);
+        return NULL;
+    }
+
+    return pixels;
+}
+
+static char * _getTunedProfileFilename(void) {
+    static char     szFilename[4096];
+    const char *    pszHome;
+
+    pszHome = getenv("HOME");
+
+    if (pszHome == NULL) {
+        return NULL;
+    }
+
+    snprintf(szFilename, sizeof(szFilename), "%s/%s", pszHome, TUNE_PROFILE_FILENAME);
+
+    return szFilename;
+}
+
+/*
+** The profile recorded by --png-tune on this host, NULL if it hasn't
+** been tuned...
+*/
+const char * getTunedPNGProfile(void) {
+    static char     szProfile[TUNE_MAX_PROFILE_NAME_LENGTH];
+    FILE *          fptr;
+    char *          pszFilename;
+
+    pszFilename = _getTunedProfileFilename();
+
+    if (pszFilename == NULL) {
+        return NULL;
+    }
+
+    fptr = fopen(pszFilename, "rt");
+
+    if (fptr == NULL) {
+        return NULL;
+    }
+
+    if (fgets(szProfile, sizeof(szProfile), fptr) == NULL) {
+        fclose(fptr);
+        return NULL;
+    }
+
+    fclose(fptr);
+
+    szProfile[strcspn(szProfile, "\r\n")] = 0;
+
+    return szProfile;
+}
+
+/*
+** Time each PNG encode profile on the sample image (or a synthetic one)
+** and record the one with the lowest encode time x image size, so a
+** profile twice as slow must make an image half the size...
+*/
+int tunePNG(const char * pszSampleImage) {
+    PNG_ENCODE_OPTIONS  options;
+    PNG_ENCODE_OPTIONS  balanced;
+    char                szImageFile[] = "/tmp/cloak_tune_XXXXXX";
+    const char *        pszName;
+    const char *        pszBest = NULL;
+    char *              pszFilename;
+    FILE *              fptr;
+    uint8_t *           pixels;
+    uint32_t            dataLength;
+    uint32_t            sizes[TUNE_MAX_PROFILES];
+    double              times[TUNE_MAX_PROFILES];
+    double              cost;
+    double              bestCost = 0.0;
+    int32_t             width;
+    int32_t             height;
+    int                 fd;
+    int                 i;
+    int                 rtn = 0;
+
+    if (pszSampleImage != NULL) {
+        pixels = _readSampleImage(pszSampleImage, &width, &height);
+    }
+    else {
+        width = BENCH_IMAGE_WIDTH;
+        pixels = _makeSampleImage(TUNE_SAMPLE_SIZE_MB << 20, &height);
+    }
+
+    if (pixels == NULL) {
+        return -1;
+    }
+
+    dataLength = (uint32_t)width * 3 * height;
+
+    fd = mkstemp(szImageFile);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create tuning image file\n");
+        free(pixels);
+        return -1;
+    }
+
+    close(fd);
+
+    printf("Tuning PNG encoding on a %d x %d image\n\n", width, height);
+    printf("%-12s %10s %10s %8s\n", "profile", "enc MB/s", "size KB", "ratio");
+
+    for (i = 0;(pszName = imgwrtr_get_png_profile_name(i)) != NULL && i < TUNE_MAX_PROFILES;i++) {
+        imgwrtr_get_png_profile(pszName, &options);
+        imgwrtr_set_png_options(&options);
+
+        rtn = _encodeImage(szImageFile, pixels, width, height, &times[i]);
+
+        if (rtn) {
+            fprintf(stderr, "Tuning failed for profile '%s'\n", pszName);
+            break;
+        }
+
+        sizes[i] = getFileSizeByName(szImageFile);
+
+        printf(
+            "%-12s %10.1f %10u %7.1f%%\n", 
+            pszName, 
+            _getMBPerSecond(dataLength, times[i]), 
+            sizes[i] / 1024, 
+            ((double)sizes[i] * 100.0) / (double)dataLength);
+    }
+
+    imgwrtr_get_png_profile("balanced", &balanced);
+    imgwrtr_set_png_options(&balanced);
+
+    unlink(szImageFile);
+    free(pixels);
+
+    if (rtn) {
+        return -1;
+    }
+
+    for (i = 0;(pszName = imgwrtr_get_png_profile_name(i)) != NULL && i < TUNE_MAX_PROFILES;i++) {
+        cost = times[i] * (double)sizes[i];
+
+        if (pszBest == NULL || cost < bestCost) {
+            pszBest = pszName;
+            bestCost = cost;
+        }
+    }
+
+    printf("\nBest trade-off on this host is '%s'\n", pszBest);
+
+    pszFilename = _getTunedProfileFilename();
+
+    if (pszFilename == NULL) {
+        fprintf(stderr, "No HOME directory to record the profile in\n");
+        return -1;
+    }
+
+    fptr = fopen(pszFilename, "wt");
+
+    if (fptr == NULL) {
+        fprintf(stderr, "Failed to record the profile in %s: %s\n", pszFilename, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fptr, "%s\n", pszBest);
+    fclose(fptr);
+
+    printf("Recorded in %s, used by merges without --png-profile\n", pszFilename);
+
+    return 0;
+}
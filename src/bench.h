@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+#ifndef __INCL_BENCH
+#define __INCL_BENCH
+
+int             benchmark(uint32_t sizeMB);
+int             tunePNG(const char * pszSampleImage);
+const char *    getTunedPNGProfile(void);
+
+#endif
@@ -23,6 +23,14 @@ SOFTWARE.
 #include <stdlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #include <gcrypt.h>
 
@@ -30,11 +38,22 @@ SOFTWARE.
 #include "secretrw.h"
 #include "imgrw.h"
 #include "utils.h"
+#include "erasure.h"
 #include "cloak.h"
 
 #define MAX_PASSWORD_LENGTH						255
 #define MEMID_IMAGEDATA							0x0001
 
+/*
+** Room for a frame header, see secrw_get_header_length()...
+*/
+#define FRAME_HEADER_PROBE_LENGTH				64
+
+/*
+** Secret bytes merged per block when patching an image...
+*/
+#define PATCH_BLOCK_LENGTH						65536U
+
 
 uint32_t getKey(uint8_t * keyBuffer, uint32_t keyBufferLength, const char * pwd) {
 	char		    szPassword[MAX_PASSWORD_LENGTH + 1];
@@ -98,6 +117,24 @@ uint8_t getBitMask(merge_quality quality) {
 	return mask;
 }
 
+const char * getQualityName(merge_quality quality) {
+	switch (quality) {
+		case quality_high:
+			return "high";
+
+		case quality_medium:
+			return "medium";
+
+		case quality_low:
+			return "low";
+
+		case quality_none:
+			return "none";
+	}
+
+	return "unknown";
+}
+
 int getNumImageBytesRequired(merge_quality quality) {
 	return (8 / quality);
 }
@@ -122,6 +159,93 @@ void mergeSecretByte(uint8_t * imageBytes, int numImageBytes, uint8_t secretByte
     }
 }
 
+/*
+** Each table entry holds the image byte bits for one secret byte value,
+** laid out in memory order so a whole group of image bytes can be merged
+** with a single load, mask and store...
+*/
+static void _buildSpreadTable(uint8_t * table, merge_quality quality) {
+	uint8_t			imageBytes[8];
+	int				numImageBytes;
+	int				b;
+
+	numImageBytes = getNumImageBytesRequired(quality);
+
+	for (b = 0;b < 256;b++) {
+		memset(imageBytes, 0, numImageBytes);
+		mergeSecretByte(imageBytes, numImageBytes, (uint8_t)b, quality);
+		memcpy(&table[b * numImageBytes], imageBytes, numImageBytes);
+	}
+}
+
+/*
+** Built once, by whichever thread merges first...
+*/
+static uint64_t			spreadHigh[256];
+static uint32_t			spreadMedium[256];
+static uint16_t			spreadLow[256];
+static pthread_once_t	spreadTablesOnce = PTHREAD_ONCE_INIT;
+
+static void _buildSpreadTables(void) {
+	_buildSpreadTable((uint8_t *)spreadHigh, quality_high);
+	_buildSpreadTable((uint8_t *)spreadMedium, quality_medium);
+	_buildSpreadTable((uint8_t *)spreadLow, quality_low);
+}
+
+void mergeSecretSpan(uint8_t * imageBytes, const uint8_t * secretBytes, uint32_t numSecretBytes, merge_quality quality) {
+	uint64_t			word64;
+	uint32_t			word32;
+	uint16_t			word16;
+	uint64_t			keep64;
+	uint32_t			keep32;
+	uint16_t			keep16;
+	uint32_t			i;
+
+	pthread_once(&spreadTablesOnce, _buildSpreadTables);
+
+	switch (quality) {
+		case quality_high:
+			memset(&keep64, (uint8_t)~getBitMask(quality), sizeof(keep64));
+
+			for (i = 0;i < numSecretBytes;i++) {
+				memcpy(&word64, imageBytes, sizeof(word64));
+				word64 = (word64 & keep64) | spreadHigh[secretBytes[i]];
+				memcpy(imageBytes, &word64, sizeof(word64));
+
+				imageBytes += sizeof(word64);
+			}
+			break;
+
+		case quality_medium:
+			memset(&keep32, (uint8_t)~getBitMask(quality), sizeof(keep32));
+
+			for (i = 0;i < numSecretBytes;i++) {
+				memcpy(&word32, imageBytes, sizeof(word32));
+				word32 = (word32 & keep32) | spreadMedium[secretBytes[i]];
+				memcpy(imageBytes, &word32, sizeof(word32));
+
+				imageBytes += sizeof(word32);
+			}
+			break;
+
+		case quality_low:
+			memset(&keep16, (uint8_t)~getBitMask(quality), sizeof(keep16));
+
+			for (i = 0;i < numSecretBytes;i++) {
+				memcpy(&word16, imageBytes, sizeof(word16));
+				word16 = (word16 & keep16) | spreadLow[secretBytes[i]];
+				memcpy(imageBytes, &word16, sizeof(word16));
+
+				imageBytes += sizeof(word16);
+			}
+			break;
+
+		case quality_none:
+			memcpy(imageBytes, secretBytes, numSecretBytes);
+			break;
+	}
+}
+
 uint8_t extractSecretByte(uint8_t * imageBytes, uint32_t numImageBytes, merge_quality quality) {
 	uint8_t			mask;
 	uint8_t			secretBits = 0x00;
@@ -145,6 +269,43 @@ uint8_t extractSecretByte(uint8_t * imageBytes, uint32_t numImageBytes, merge_qu
 	return secretByte;
 }
 
+void extractSecretSpan(const uint8_t * imageBytes, uint8_t * secretBytes, uint32_t numSecretBytes, merge_quality quality) {
+	int				numImageBytes;
+	uint32_t		i;
+
+	numImageBytes = getNumImageBytesRequired(quality);
+
+	switch (quality) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		case quality_high:
+			/*
+			** Gather the LSB of each of the 8 image bytes into one byte,
+			** the multiply moves bit 8n to bit 56 + n without any carries...
+			*/
+			for (i = 0;i < numSecretBytes;i++) {
+				uint64_t		word64;
+
+				memcpy(&word64, imageBytes, sizeof(word64));
+				secretBytes[i] = (uint8_t)(((word64 & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56);
+
+				imageBytes += sizeof(word64);
+			}
+			break;
+#endif
+
+		case quality_none:
+			memcpy(secretBytes, imageBytes, numSecretBytes);
+			break;
+
+		default:
+			for (i = 0;i < numSecretBytes;i++) {
+				secretBytes[i] = extractSecretByte((uint8_t *)imageBytes, numImageBytes, quality);
+				imageBytes += numImageBytes;
+			}
+			break;
+	}
+}
+
 uint32_t getImageCapacity(char * pszInputImageFile, merge_quality quality) {
 	HIMG			himgRead;
 	uint32_t		imageDataLen;
@@ -170,57 +331,250 @@ uint32_t getImageCapacity(char * pszInputImageFile, merge_quality quality) {
 	return imageCapacity;
 }
 
-int merge(
-		const char * pszInputImageFile, 
-		const char * pszSecretFile, 
-		const char * pszKeystreamFile,
-		const char * pszOutputImageFile,
-		merge_quality quality, 
+static void _encryptFrame(
+		HSECRW hsec, 
 		encryption_algo algo, 
+		const char * pszKeystreamFile, 
 		uint8_t * key, 
 		uint32_t keyLength)
 {
-	HSECRW			hsec;
-	HIMG			himgRead;
-	HIMG			himgWrite;
-	uint8_t 		secretDataBlock[SECRETRW_BLOCK_SIZE];
-	uint8_t *		imageData;
-	uint8_t			secretByte = 0x00;
-	uint32_t		secretDataBlockLen;
-	uint32_t		imageDataLen;
-	uint32_t		secretBytesRemaining = 0;
-	uint32_t		imageBytesRead;
-	uint32_t		imageDataIndex = 0U;
-    uint32_t        requiredImageLength;
-	int				numImgBytesRequired = 0;
-	int				secretBufferIndex = 0;
-	int				rtn;
-	img_type		imageType;
+	int				rtn = 0;
 
-	hsec = rdr_open(pszSecretFile, algo);
+	if (algo == aes256) {
+		rtn = rdr_encrypt_aes256(hsec, key, keyLength);
+	}
+	else if (algo == xor) {
+		rtn = rdr_encrypt_xor(hsec, pszKeystreamFile);
+	}
+	else if (secrw_is_aead_algo(algo)) {
+		rtn = rdr_encrypt_aead(hsec, key, keyLength);
+	}
 
-	if (hsec == NULL) {
-		fprintf(stderr, "Could not open input file %s: %s\n", pszSecretFile, strerror(errno));
+	if (rtn) {
 		exit(-1);
 	}
-	
-	if (algo == aes256) {
-		rtn = rdr_encrypt_aes256(hsec, key, keyLength);
+}
 
-		if (rtn) {
-			exit(-1);
+/*
+** Merge up to maxSecretBytes of the frames, back to back, into the image
+** bytes, moving on to the next frame as each one runs out. Returns the
+** number of secret bytes merged...
+*/
+static uint32_t _mergeSpans(
+		HSECRW * frames, 
+		int numFrames, 
+		int * frameIndex, 
+		uint8_t * imageBytes, 
+		uint32_t maxSecretBytes, 
+		merge_quality quality)
+{
+	uint8_t *		secretSpan;
+	uint32_t		secretSpanLength;
+	uint32_t		numSecretBytes = 0U;
+	int				numImgBytesRequired;
+
+	numImgBytesRequired = getNumImageBytesRequired(quality);
+
+	while (numSecretBytes < maxSecretBytes && *frameIndex < numFrames) {
+		if (!rdr_has_more_blocks(frames[*frameIndex])) {
+			(*frameIndex)++;
+			continue;
 		}
+
+		secretSpanLength = rdr_read_encrypted_span(
+								frames[*frameIndex], 
+								&secretSpan, 
+								maxSecretBytes - numSecretBytes);
+
+		mergeSecretSpan(
+				&imageBytes[numSecretBytes * numImgBytesRequired], 
+				secretSpan, 
+				secretSpanLength, 
+				quality);
+
+		numSecretBytes += secretSpanLength;
+	}
+
+	return numSecretBytes;
+}
+
+/*
+** Merge the frames into the image a group of rows at a time, reading each
+** group from the source and writing it to the output once merged, so only
+** two groups are ever held in memory. A group is one row, or as many as it
+** takes to hold one secret byte for very narrow images...
+*/
+static void _mergeRows(
+		HIMG himgRead, 
+		HIMG himgWrite, 
+		HSECRW * frames, 
+		int numFrames, 
+		merge_quality quality)
+{
+	uint8_t *		groupBuffer;
+	uint8_t *		previousGroup;
+	uint8_t *		swap;
+	uint8_t			straddle[8];
+	uint32_t		rowBufferLen;
+	uint32_t		groupLength;
+	uint32_t		groupIndex;
+	uint32_t		groupSpace;
+	uint32_t		maxSecretBytes;
+	uint32_t		carryLength = 0U;
+	int				numGroupRows;
+	int				numPreviousRows = 0;
+	int				rowsPerGroup;
+	int				numImgBytesRequired;
+	int				frameIndex = 0;
+	int				i;
+
+	numImgBytesRequired = getNumImageBytesRequired(quality);
+
+	rowBufferLen = imgrdr_get_row_buffer_len(himgRead);
+	rowsPerGroup = (int)((numImgBytesRequired + rowBufferLen - 1) / rowBufferLen);
+	groupLength = rowBufferLen * rowsPerGroup;
+
+	groupBuffer = (uint8_t *)malloc(groupLength);
+	previousGroup = (uint8_t *)malloc(groupLength);
+
+	if (groupBuffer == NULL || previousGroup == NULL) {
+		fprintf(stderr, "Could not allocate memory for image data\n");
+		exit(-1);
+	}
+
+	while (imgrdr_has_more_rows(himgRead)) {
+		for (numGroupRows = 0;numGroupRows < rowsPerGroup && imgrdr_has_more_rows(himgRead);numGroupRows++) {
+			if (imgrdr_read_row(himgRead, &groupBuffer[numGroupRows * rowBufferLen], rowBufferLen)) {
+				exit(-1);
+			}
+		}
+
+		groupIndex = 0U;
+
+		/*
+		** The secret byte spread over the end of the previous group and
+		** the start of this one is merged through a copy of both parts,
+		** then the previous group can be written...
+		*/
+		if (numPreviousRows > 0) {
+			if (carryLength > 0) {
+				memcpy(straddle, &previousGroup[numPreviousRows * rowBufferLen - carryLength], carryLength);
+				memcpy(&straddle[carryLength], groupBuffer, numImgBytesRequired - carryLength);
+
+				if (_mergeSpans(frames, numFrames, &frameIndex, straddle, 1U, quality) == 1U) {
+					memcpy(&previousGroup[numPreviousRows * rowBufferLen - carryLength], straddle, carryLength);
+					memcpy(groupBuffer, &straddle[carryLength], numImgBytesRequired - carryLength);
+
+					groupIndex = numImgBytesRequired - carryLength;
+				}
+			}
+
+			for (i = 0;i < numPreviousRows;i++) {
+				if (imgwrtr_write_row(himgWrite, &previousGroup[i * rowBufferLen], rowBufferLen)) {
+					exit(-1);
+				}
+			}
+		}
+
+		/*
+		** Any bytes left at the end of the group, too few for a secret
+		** byte, carry it over into the next group...
+		*/
+		groupSpace = numGroupRows * rowBufferLen - groupIndex;
+		maxSecretBytes = groupSpace / numImgBytesRequired;
+
+		if (_mergeSpans(frames, numFrames, &frameIndex, &groupBuffer[groupIndex], maxSecretBytes, quality) == maxSecretBytes) {
+			carryLength = groupSpace - maxSecretBytes * numImgBytesRequired;
+		}
+		else {
+			carryLength = 0U;
+		}
+
+		swap = previousGroup;
+		previousGroup = groupBuffer;
+		groupBuffer = swap;
+
+		numPreviousRows = numGroupRows;
 	}
-	else if (algo == xor) {
-		rtn = rdr_encrypt_xor(hsec, pszKeystreamFile);
 
-		if (rtn) {
+	for (i = 0;i < numPreviousRows;i++) {
+		if (imgwrtr_write_row(himgWrite, &previousGroup[i * rowBufferLen], rowBufferLen)) {
 			exit(-1);
 		}
 	}
 
-	secretDataBlockLen = rdr_get_block_size(hsec);
-	
+	free(groupBuffer);
+	free(previousGroup);
+}
+
+/*
+** Create an empty temporary image beside the image it is to replace,
+** with the same permissions. The name to replace is resolved, so a
+** symlink to the image is followed rather than replaced...
+*/
+static int _createTempImage(
+		const char * pszImageFile, 
+		char * pszTargetFile, 
+		char * pszTempFile, 
+		size_t tempFileLength)
+{
+#ifndef _WIN32
+	struct stat		st;
+	int				fd;
+
+	if (realpath(pszImageFile, pszTargetFile) == NULL || stat(pszTargetFile, &st)) {
+		fprintf(stderr, "Could not find image file %s: %s\n", pszImageFile, strerror(errno));
+		return -1;
+	}
+
+	snprintf(pszTempFile, tempFileLength, "%s.XXXXXX", pszTargetFile);
+
+	fd = mkstemp(pszTempFile);
+
+	if (fd < 0) {
+		fprintf(stderr, "Could not create a temporary image beside %s: %s\n", pszTargetFile, strerror(errno));
+		return -1;
+	}
+
+	fchmod(fd, st.st_mode & 07777);
+	close(fd);
+
+	return 0;
+#else
+	fprintf(stderr, "Cannot merge into the source image %s on this platform\n", pszImageFile);
+	return -1;
+#endif
+}
+
+/*
+** Merge one or more encrypted frames, back to back, into the image...
+*/
+static int _mergeFrames(
+		const char * pszInputImageFile, 
+		const char * pszOutputImageFile,
+		HSECRW * frames, 
+		int numFrames, 
+		merge_quality quality, 
+		const char * pszSecretName)
+{
+	HIMG			himgRead;
+	HIMG			himgWrite;
+	uint8_t *		sourceData;
+	uint8_t *		imageData;
+	boolean			isInPlace;
+	boolean			isTempImage = False;
+	char			szTargetFile[PATH_MAX];
+	char			szTempFile[PATH_MAX + 8];
+	uint32_t		imageDataLen;
+	uint32_t		patchLength;
+	uint32_t		patchOffset;
+	uint32_t		blockLength;
+	uint64_t		requiredLength = 0U;
+	int				numImgBytesRequired = 0;
+	int				frameIndex = 0;
+	int				i;
+	img_type		imageType;
+
 	himgRead = imgrdr_open(pszInputImageFile);
 
 	if (himgRead == NULL) {
@@ -231,216 +585,1087 @@ int merge(
 	imageDataLen = imgrdr_get_data_length(himgRead);
 	
 	numImgBytesRequired = getNumImageBytesRequired(quality);
-	
-	requiredImageLength = 
-		rdr_get_data_length(hsec) * 
-		getNumImageBytesRequired(quality);
+
+	for (i = 0;i < numFrames;i++) {
+		requiredLength += rdr_get_data_length(frames[i]);
+	}
 	
 	/*
 	** Check the image capacity, will our file fit...?
 	*/
-	if (imageDataLen < requiredImageLength) {
+	if ((uint64_t)imageDataLen < requiredLength * numImgBytesRequired) {
 		fprintf(
 			stderr, 
-			"The image %s is not large enough to store the file %s\n", 
+			"The image %s is not large enough to store %s\n", 
 			pszInputImageFile, 
-			pszSecretFile);
+			pszSecretName);
 		fprintf(
 			stderr, 
-			"The file %s requires %u of image data, image %s has a max capacity of %u bytes.\n", 
-			pszSecretFile, 
-			rdr_get_data_length(hsec), 
+			"%s requires %" PRIu64 " bytes of image data, image %s has a max capacity of %u bytes.\n", 
+			pszSecretName, 
+			requiredLength, 
 			pszInputImageFile, 
 			(imageDataLen / numImgBytesRequired));
 		fprintf(
 			stderr, 
-			"Consider compressing the file, or using a lower quality setting.\n");
-
-		rdr_close(hsec);
-		imgrdr_close(himgRead);
-		exit(-1);
-	}
-
-	imageData = (uint8_t *)malloc(imageDataLen);
+			"Consider using --compress, or a lower quality setting.\n");
 
-	if (imageData == NULL) {
-		fprintf(stderr, "Could not allocate memory for image data\n");
-		rdr_close(hsec);
 		imgrdr_close(himgRead);
 		exit(-1);
 	}
 
-	imageBytesRead = imgrdr_read(himgRead, imageData, imageDataLen);
+	imageType = imgrdr_get_type(himgRead);
+	patchLength = (uint32_t)(requiredLength * numImgBytesRequired);
 
 	/*
-	** Only check if we have enough image bytes for PNG images,
-	** this check fails for BMP images, and I haven't worked out
-	** why yet...
+	** Merging only changes the image bytes the frames are spread over, so
+	** where the image can be patched (BMP) just those bytes are written,
+	** to the source itself or to a clone of it, a block at a time. The
+	** output is the source however it is named, through another path or
+	** a link, and must never be truncated while it is being read...
 	*/
-	if (imgrdr_get_type(himgRead) == img_png) {
-		if (imageBytesRead < imageDataLen) {
-			fprintf(stderr, "Expected %u bytes of image data, but got %u bytes\n", imageDataLen, imageBytesRead);
-			rdr_close(hsec);
+	isInPlace = isSameFile(pszInputImageFile, pszOutputImageFile);
+
+	himgWrite = imgwrtr_open_patch(himgRead, pszOutputImageFile, isInPlace);
+
+	if (himgWrite != NULL) {
+		imageData = (uint8_t *)malloc(PATCH_BLOCK_LENGTH * numImgBytesRequired);
+
+		if (imageData == NULL) {
+			fprintf(stderr, "Could not allocate memory for image data\n");
 			imgrdr_close(himgRead);
 			exit(-1);
 		}
-	}
 
-	while (rdr_has_more_blocks(hsec)) {
-		secretBytesRemaining = rdr_read_encrypted_block(hsec, secretDataBlock, secretDataBlockLen);
+		for (patchOffset = 0U;patchOffset < patchLength;patchOffset += blockLength) {
+			blockLength = patchLength - patchOffset;
+
+			if (blockLength > PATCH_BLOCK_LENGTH * numImgBytesRequired) {
+				blockLength = PATCH_BLOCK_LENGTH * numImgBytesRequired;
+			}
 
-		for(secretBufferIndex = 0;secretBufferIndex < secretBytesRemaining;secretBufferIndex++) {
-			secretByte = secretDataBlock[secretBufferIndex];
+			if (imgwrtr_read_patch(himgWrite, patchOffset, imageData, blockLength)) {
+				exit(-1);
+			}
 
-			mergeSecretByte(
-					&imageData[imageDataIndex], 
-					numImgBytesRequired, 
-					secretByte, 
-					quality);
+			_mergeSpans(frames, numFrames, &frameIndex, imageData, blockLength / numImgBytesRequired, quality);
 
-			imageDataIndex += (uint32_t)numImgBytesRequired;
+			if (imgwrtr_write_patch(himgWrite, patchOffset, imageData, blockLength)) {
+				exit(-1);
+			}
 		}
+
+		free(imageData);
 	}
+	else {
+		/*
+		** The source is streamed through to the new image, so a new image
+		** replacing the source is written beside it and renamed over it
+		** once it is complete...
+		*/
+		if (isInPlace) {
+			if (_createTempImage(pszOutputImageFile, szTargetFile, szTempFile, sizeof(szTempFile))) {
+				imgrdr_close(himgRead);
+				exit(-1);
+			}
 
-	imageType = imgrdr_get_type(himgRead);
+			isTempImage = True;
+		}
+
+		himgWrite = imgwrtr_open(isTempImage ? szTempFile : pszOutputImageFile, imageType);
+
+		if (himgWrite == NULL) {
+			if (isTempImage) {
+				unlink(szTempFile);
+			}
+
+			imgrdr_close(himgRead);
+			exit(-1);
+		}
+
+		imgrdr_copy_header(himgWrite, himgRead);
+		imgwrtr_write_header(himgWrite);
+
+		/*
+		** Where both images can be mapped (BMP), the pixels are copied from
+		** the input mapping to the output mapping once and merged in place
+		** there, otherwise the image is streamed through a row at a time...
+		*/
+		sourceData = imgrdr_map(himgRead);
+		imageData = (sourceData != NULL ? imgwrtr_map(himgWrite, imageDataLen) : NULL);
 
-	himgWrite = imgwrtr_open(pszOutputImageFile, imageType);
+		if (imageData != NULL) {
+			memcpy(imageData, sourceData, imageDataLen);
 
-	imgrdr_copy_header(himgWrite, himgRead);
+			_mergeSpans(frames, numFrames, &frameIndex, imageData, (uint32_t)requiredLength, quality);
+		}
+		else {
+			_mergeRows(himgRead, himgWrite, frames, numFrames, quality);
+		}
+	}
 
 	imgrdr_close(himgRead);
 	imgrdr_destroy_handle(himgRead);
 
-	imgwrtr_write_header(himgWrite);
-	imgwrtr_write(himgWrite, imageData, imageDataLen);
 	imgwrtr_close(himgWrite);
-
 	imgrdr_destroy_handle(himgWrite);
 
-	free(imageData);
-
-	rdr_close(hsec);
+	if (isTempImage && rename(szTempFile, szTargetFile)) {
+		fprintf(stderr, "Could not replace %s with the merged image: %s\n", szTargetFile, strerror(errno));
+		unlink(szTempFile);
+		exit(-1);
+	}
 
 	return 0;
 }
 
-int extract(
+int merge(
 		const char * pszInputImageFile, 
-		const char * pszKeystreamFile,
 		const char * pszSecretFile, 
+		const char * pszKeystreamFile,
+		const char * pszOutputImageFile,
 		merge_quality quality, 
 		encryption_algo algo, 
+		compression_algo compression, 
 		uint8_t * key, 
 		uint32_t keyLength)
 {
 	HSECRW			hsec;
-	HIMG			himgRead;
-	uint8_t 		secretDataBlock[SECRETRW_BLOCK_SIZE];
-	uint8_t *		imageData;
-	uint8_t			secretByte = 0x00;
-	uint32_t		secretDataBlockLen;
-	uint32_t		imageDataLen;
-	uint32_t		imageBytesRead;
-	uint32_t		imageDataIndex = 0U;
-	int				numImgBytesRequired = 0;
-	int				secretBufferIndex = 0;
-	int				rtn;
 
-	himgRead = imgrdr_open(pszInputImageFile);
+	hsec = rdr_open(pszSecretFile, algo, compression, (uint8_t)quality);
 
-	if (himgRead == NULL) {
-		fprintf(stderr, "Could not open source image file %s: %s\n", pszInputImageFile, strerror(errno));
+	if (hsec == NULL) {
+		fprintf(stderr, "Could not open input file %s: %s\n", pszSecretFile, strerror(errno));
 		exit(-1);
 	}
 
-	imageDataLen = imgrdr_get_data_length(himgRead);
+	_encryptFrame(hsec, algo, pszKeystreamFile, key, keyLength);
 
-	imageData = (uint8_t *)malloc(imageDataLen);
+	_mergeFrames(pszInputImageFile, pszOutputImageFile, &hsec, 1, quality, pszSecretFile);
 
-	if (imageData == NULL) {
-		fprintf(stderr, "Could not allocate memory for image data\n");
-		imgrdr_close(himgRead);
-		exit(-1);
-	}
+	rdr_close(hsec);
+
+	return 0;
+}
 
-	imageBytesRead = imgrdr_read(himgRead, imageData, imageDataLen);
+/*
+** Merge several files as an archive, a table of contents frame followed
+** by a frame for each file, so each member can be listed and extracted
+** without decrypting the others...
+*/
+int mergeArchive(
+		const char * pszInputImageFile, 
+		char ** secretFiles, 
+		int numSecretFiles, 
+		const char * pszKeystreamFile,
+		const char * pszOutputImageFile,
+		merge_quality quality, 
+		encryption_algo algo, 
+		compression_algo compression, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	SECRW_ARCHIVE_MEMBER *	members;
+	HSECRW *				frames;
+	const char *			pszName;
+	uint64_t				frameOffset = 0U;
+	int						i;
+	int						j;
 
 	/*
-	** Only check if we have enough image bytes for PNG images,
-	** this check fails for BMP images, and I haven't worked out
-	** why yet...
+	** Each frame starts at the beginning of a plain keystream, so only
+	** a pad pool gives each member its own part of the pad...
 	*/
-	if (imgrdr_get_type(himgRead) == img_png) {
-		if (imageBytesRead < imageDataLen) {
-			fprintf(stderr, "Expected %u bytes of image data, but got %u bytes\n", imageDataLen, imageBytesRead);
-			imgrdr_close(himgRead);
-			exit(-1);
-		}
+	if (algo == xor && !secrw_is_pad_pool(pszKeystreamFile)) {
+		fprintf(stderr, "Archives encrypted with 'xor' must use a pad pool (--pad-pool)\n");
+		exit(-1);
 	}
 
-	imgrdr_close(himgRead);
-
-	imgrdr_destroy_handle(himgRead);
-
-	hsec = wrtr_open(pszSecretFile, algo);
+	members = (SECRW_ARCHIVE_MEMBER *)calloc(numSecretFiles, sizeof(SECRW_ARCHIVE_MEMBER));
+	frames = (HSECRW *)calloc(numSecretFiles + 1, sizeof(HSECRW));
 
-	if (hsec == NULL) {
-		fprintf(stderr, "Failed to open output file %s\n", pszSecretFile);
-		free(imageData);
+	if (members == NULL || frames == NULL) {
+		fprintf(stderr, "Could not allocate memory for archive members\n");
 		exit(-1);
 	}
 
-	secretDataBlockLen = wrtr_get_block_size(hsec);
+	for (i = 0;i < numSecretFiles;i++) {
+		pszName = strrchr(secretFiles[i], '/');
+		pszName = (pszName != NULL ? pszName + 1 : secretFiles[i]);
 
-	if (algo == aes256) {
-		if (wrtr_set_key_aes(hsec, key, keyLength)) {
-			fprintf(stderr, "Failed to set AES key\n");
-			free(imageData);
-			wrtr_close(hsec);
+		if (strlen(pszName) > SECRW_MAX_MEMBER_NAME_LENGTH) {
+			fprintf(stderr, "Archive member name %s is too long\n", pszName);
 			exit(-1);
 		}
-	}
-	else if (algo == xor) {
-		wrtr_set_keystream_file(hsec, pszKeystreamFile);
-	}
 
-	numImgBytesRequired = getNumImageBytesRequired(quality);
+		strcpy(members[i].szName, pszName);
 
-	secretBufferIndex = 0;
+		for (j = 0;j < i;j++) {
+			if (strcmp(members[i].szName, members[j].szName) == 0) {
+				fprintf(stderr, "Archive member name %s is used more than once\n", pszName);
+				exit(-1);
+			}
+		}
 
-	for (
-		imageDataIndex = 0;
-		imageDataIndex < imageDataLen;
-		imageDataIndex += numImgBytesRequired)
-	{
-		secretByte = extractSecretByte(&imageData[imageDataIndex], numImgBytesRequired, quality);
+		frames[i + 1] = rdr_open(secretFiles[i], algo, compression, (uint8_t)quality);
 
-		secretDataBlock[secretBufferIndex++] = secretByte;
+		if (frames[i + 1] == NULL) {
+			fprintf(stderr, "Could not open input file %s: %s\n", secretFiles[i], strerror(errno));
+			exit(-1);
+		}
 
-		if (secretBufferIndex == secretDataBlockLen) {
-			rtn = wrtr_write_decrypted_block(hsec, secretDataBlock, secretDataBlockLen);
+		_encryptFrame(frames[i + 1], algo, pszKeystreamFile, key, keyLength);
 
-			if (rtn < 0) {
-				fprintf(stderr, "Error writing secret block\n");
-				free(imageData);
-				wrtr_close(hsec);
+		members[i].fileLength = getFileSizeByName(secretFiles[i]);
+		members[i].frameOffset = frameOffset;
+		members[i].frameLength = rdr_get_data_length(frames[i + 1]);
 
-				exit(-1);
+		frameOffset += members[i].frameLength;
+	}
+
+	frames[0] = rdr_open_archive_toc(members, (uint32_t)numSecretFiles, algo, (uint8_t)quality);
+
+	if (frames[0] == NULL) {
+		exit(-1);
+	}
+
+	_encryptFrame(frames[0], algo, pszKeystreamFile, key, keyLength);
+
+	_mergeFrames(pszInputImageFile, pszOutputImageFile, frames, numSecretFiles + 1, quality, "the archive");
+
+	for (i = 0;i <= numSecretFiles;i++) {
+		rdr_close(frames[i]);
+	}
+
+	free(frames);
+	free(members);
+
+	return 0;
+}
+
+/*
+** Stream the frame starting frameOffset bytes into the merged data out
+** of the image a row at a time into the writer, returns 1 when the whole
+** frame has been read, 0 if we ran out of image first, or -1 if the
+** writer failed...
+*/
+static int _extractFrame(HIMG himgRead, HSECRW hsec, merge_quality quality, uint64_t frameOffset) {
+	uint8_t *		rowBuffer;
+	uint8_t *		secretData;
+	uint32_t		rowBufferLen;
+	uint32_t		imageBytesAvailable;
+	uint32_t		numSecretBytes;
+	uint32_t		carryLength = 0U;
+	uint32_t		frameSkipLength;
+	uint64_t		skipLength;
+	uint64_t		rowsToSkip;
+	int				numImgBytesRequired = 0;
+	int				rtn = 0;
+
+	numImgBytesRequired = getNumImageBytesRequired(quality);
+
+	skipLength = frameOffset * numImgBytesRequired;
+
+	/*
+	** The image is decoded a row at a time, any image bytes left over
+	** at the end of a row are carried over to the start of the next...
+	*/
+	rowBufferLen = imgrdr_get_row_buffer_len(himgRead);
+
+	rowBuffer = (uint8_t *)malloc(rowBufferLen + numImgBytesRequired);
+	secretData = (uint8_t *)malloc(rowBufferLen / numImgBytesRequired + 1);
+
+	if (rowBuffer == NULL || secretData == NULL) {
+		fprintf(stderr, "Could not allocate memory for image data\n");
+		free(rowBuffer);
+		free(secretData);
+		return -1;
+	}
+
+	while (imgrdr_has_more_rows(himgRead)) {
+		/*
+		** Whole rows before the frame are skipped without extracting
+		** anything, a BMP seeks past them but a PNG is one deflate
+		** stream so they are still inflated...
+		*/
+		if (skipLength >= rowBufferLen) {
+			rowsToSkip = skipLength / rowBufferLen;
+
+			if (rowsToSkip > UINT32_MAX) {
+				rowsToSkip = UINT32_MAX;
 			}
-			else if (rtn > 0) {
-				/*
-				** We've finished...
-				*/
+
+			if (imgrdr_skip_rows(himgRead, (uint32_t)rowsToSkip)) {
 				break;
 			}
 
-			secretBufferIndex = 0;
+			skipLength -= rowsToSkip * rowBufferLen;
+			continue;
+		}
+
+		if (imgrdr_read_row(himgRead, &rowBuffer[carryLength], rowBufferLen)) {
+			break;
+		}
+
+		imageBytesAvailable = carryLength + rowBufferLen - (uint32_t)skipLength;
+
+		if (skipLength > 0) {
+			memmove(rowBuffer, &rowBuffer[skipLength], imageBytesAvailable);
+			skipLength = 0;
+		}
+		numSecretBytes = imageBytesAvailable / numImgBytesRequired;
+
+		extractSecretSpan(rowBuffer, secretData, numSecretBytes, quality);
+
+		carryLength = imageBytesAvailable - (numSecretBytes * numImgBytesRequired);
+		memmove(rowBuffer, &rowBuffer[numSecretBytes * numImgBytesRequired], carryLength);
+
+		rtn = wrtr_write_decrypted_block(hsec, secretData, numSecretBytes);
+
+		if (rtn != 0) {
+			/*
+			** We've finished, or failed...
+			*/
+			break;
+		}
+
+		/*
+		** A range writer doesn't need the frame before the range, the
+		** image bytes for it are skipped rather than extracted...
+		*/
+		frameSkipLength = wrtr_get_skip_length(hsec);
+
+		if (frameSkipLength > 0) {
+			skipLength = (uint64_t)frameSkipLength * numImgBytesRequired - carryLength;
+			carryLength = 0U;
+
+			wrtr_skip(hsec, frameSkipLength);
 		}
 	}
 
+	free(rowBuffer);
+	free(secretData);
+
+	return rtn;
+}
+
+/*
+** Look for a version 2 frame header in the first image bytes, trying each
+** merge quality in turn. Returns 0 and sets quality & info if one is found,
+** 1 if not...
+*/
+int findFrameHeader(const uint8_t * imageBytes, uint32_t numImageBytes, merge_quality * quality, SECRW_FRAME_INFO * info) {
+	merge_quality		qualities[3] = {quality_high, quality_medium, quality_low};
+	uint8_t				header[FRAME_HEADER_PROBE_LENGTH];
+	uint32_t			headerLength;
+	int					i;
+
+	headerLength = secrw_get_header_length();
+
+	if (headerLength > FRAME_HEADER_PROBE_LENGTH) {
+		return 1;
+	}
+
+	for (i = 0;i < 3;i++) {
+		if (numImageBytes < headerLength * getNumImageBytesRequired(qualities[i])) {
+			continue;
+		}
+
+		extractSecretSpan(imageBytes, header, headerLength, qualities[i]);
+
+		if (secrw_read_frame_info(header, headerLength, info) == 0 && info->quality == (uint8_t)qualities[i]) {
+			*quality = qualities[i];
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+** Read only the first rows of the image and look for a version 2 frame
+** header, returns 0 and sets quality & algo if one is found, 1 if not...
+*/
+int detectFrame(const char * pszInputImageFile, merge_quality * quality, encryption_algo * algo) {
+	SECRW_FRAME_INFO	info;
+	uint8_t				imageData[FRAME_HEADER_PROBE_LENGTH * 8];
+	int					imageBytesRead;
+
+	imageBytesRead = imgrdr_read_head(pszInputImageFile, imageData, sizeof(imageData));
+
+	if (imageBytesRead < 0) {
+		return -1;
+	}
+
+	if (findFrameHeader(imageData, (uint32_t)imageBytesRead, quality, &info)) {
+		return 1;
+	}
+
+	*algo = info.algo;
+
+	return 0;
+}
+
+/*
+** Set up the writer's key, then stream the frame at frameOffset out of
+** the image into it. Returns 0 once the whole frame has been written,
+** or -1 on failure, leaving the writer for the caller to discard...
+*/
+static int _readFrameToWriter(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		HSECRW hsec, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength, 
+		uint64_t frameOffset)
+{
+	HIMG			himgRead;
+	int				rtn = 0;
+
+	if (algo == aes256) {
+		if (wrtr_set_key_aes(hsec, key, keyLength)) {
+			fprintf(stderr, "Failed to set AES key\n");
+			return -1;
+		}
+	}
+	else if (algo == xor) {
+		wrtr_set_keystream_file(hsec, pszKeystreamFile);
+	}
+	else if (secrw_is_aead_algo(algo)) {
+		if (wrtr_set_key_aead(hsec, key, keyLength)) {
+			fprintf(stderr, "Failed to set AEAD key\n");
+			return -1;
+		}
+	}
+
+	himgRead = imgrdr_open(pszInputImageFile);
+
+	if (himgRead == NULL) {
+		fprintf(stderr, "Could not open source image file %s: %s\n", pszInputImageFile, strerror(errno));
+		return -1;
+	}
+
+	rtn = _extractFrame(himgRead, hsec, quality, frameOffset);
+
+	imgrdr_close(himgRead);
+	imgrdr_destroy_handle(himgRead);
+
+	if (rtn < 0) {
+		fprintf(stderr, "Error writing secret block, extraction aborted\n");
+		return -1;
+	}
+	else if (rtn == 0) {
+		fprintf(stderr, "Reached the end of image %s before the end of the secret data\n", pszInputImageFile);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** As _readFrameToWriter(), but on failure the writer is discarded and
+** we exit...
+*/
+static void _extractToWriter(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		HSECRW hsec, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength, 
+		uint64_t frameOffset)
+{
+	if (_readFrameToWriter(pszInputImageFile, pszKeystreamFile, hsec, quality, algo, key, keyLength, frameOffset)) {
+		wrtr_discard(hsec);
+		exit(-1);
+	}
+}
+
+int extract(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		const char * pszSecretFile, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	HSECRW			hsec;
+
+	hsec = wrtr_open(pszSecretFile, algo);
+
+	if (hsec == NULL) {
+		fprintf(stderr, "Failed to open output file %s\n", pszSecretFile);
+		exit(-1);
+	}
+
+	_extractToWriter(pszInputImageFile, pszKeystreamFile, hsec, quality, algo, key, keyLength, 0U);
+
+	wrtr_close(hsec);
+
+	return 0;
+}
+
+/*
+** Extract rangeLength bytes of the secret file starting at rangeOffset,
+** only the cipher units covering the range are decrypted and no image
+** rows are decoded past the end of it...
+*/
+int extractRange(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		const char * pszSecretFile, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength, 
+		uint64_t rangeOffset, 
+		uint64_t rangeLength)
+{
+	HSECRW			hsec;
+
+	hsec = wrtr_open(pszSecretFile, algo);
+
+	if (hsec == NULL) {
+		fprintf(stderr, "Failed to open output file %s\n", pszSecretFile);
+		exit(-1);
+	}
+
+	if (wrtr_set_range(hsec, rangeOffset, rangeLength)) {
+		wrtr_discard(hsec);
+		exit(-1);
+	}
+
+	_extractToWriter(pszInputImageFile, pszKeystreamFile, hsec, quality, algo, key, keyLength, 0U);
+
 	wrtr_close(hsec);
 
-	free(imageData);
+	return 0;
+}
+
+/*
+** Extract just the table of contents frame from the start of the image,
+** the member frame offsets are relative to the end of it...
+*/
+static SECRW_ARCHIVE_MEMBER * _readArchiveTOC(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength, 
+		uint32_t * numMembers, 
+		uint64_t * tocFrameLength)
+{
+	HSECRW					hsec;
+	SECRW_ARCHIVE_MEMBER *	members;
+
+	hsec = wrtr_open_archive_toc(algo);
+
+	if (hsec == NULL) {
+		exit(-1);
+	}
+
+	_extractToWriter(pszInputImageFile, pszKeystreamFile, hsec, quality, algo, key, keyLength, 0U);
+
+	members = wrtr_get_archive_members(hsec, numMembers);
+	*tocFrameLength = wrtr_get_data_length(hsec);
+
+	wrtr_close(hsec);
+
+	if (members == NULL) {
+		exit(-1);
+	}
+
+	return members;
+}
+
+int listArchive(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	SECRW_ARCHIVE_MEMBER *	members;
+	uint64_t				tocFrameLength;
+	uint64_t				totalLength = 0U;
+	uint32_t				numMembers;
+	uint32_t				i;
+
+	members = _readArchiveTOC(
+					pszInputImageFile, 
+					pszKeystreamFile, 
+					quality, 
+					algo, 
+					key, 
+					keyLength, 
+					&numMembers, 
+					&tocFrameLength);
+
+	for (i = 0;i < numMembers;i++) {
+		printf("%12" PRIu64 "  %s\n", members[i].fileLength, members[i].szName);
+		totalLength += members[i].fileLength;
+	}
+
+	printf("%12" PRIu64 "  %u files\n", totalLength, numMembers);
+
+	free(members);
 
 	return 0;
 }
+
+/*
+** Extract one member of an archive, only the table of contents frame and
+** the member's own frame are decrypted, and no image rows are decoded
+** past the end of the member...
+*/
+int extractMember(
+		const char * pszInputImageFile, 
+		const char * pszKeystreamFile,
+		const char * pszMemberName, 
+		const char * pszSecretFile, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	SECRW_ARCHIVE_MEMBER *	members;
+	HSECRW					hsec;
+	uint64_t				tocFrameLength;
+	uint32_t				numMembers;
+	uint32_t				i;
+
+	members = _readArchiveTOC(
+					pszInputImageFile, 
+					pszKeystreamFile, 
+					quality, 
+					algo, 
+					key, 
+					keyLength, 
+					&numMembers, 
+					&tocFrameLength);
+
+	for (i = 0;i < numMembers;i++) {
+		if (strcmp(members[i].szName, pszMemberName) == 0) {
+			break;
+		}
+	}
+
+	if (i == numMembers) {
+		fprintf(stderr, "Archive in %s has no member named %s\n", pszInputImageFile, pszMemberName);
+		free(members);
+		exit(-1);
+	}
+
+	hsec = wrtr_open(pszSecretFile, algo);
+
+	if (hsec == NULL) {
+		fprintf(stderr, "Failed to open output file %s\n", pszSecretFile);
+		free(members);
+		exit(-1);
+	}
+
+	_extractToWriter(
+			pszInputImageFile, 
+			pszKeystreamFile, 
+			hsec, 
+			quality, 
+			algo, 
+			key, 
+			keyLength, 
+			tocFrameLength + members[i].frameOffset);
+
+	if (wrtr_get_data_length(hsec) != members[i].frameLength) {
+		fprintf(stderr, "Archive member %s does not match the table of contents\n", pszMemberName);
+		wrtr_discard(hsec);
+		free(members);
+		exit(-1);
+	}
+
+	wrtr_close(hsec);
+	free(members);
+
+	return 0;
+}
+
+/*
+** Shard n of a set merged into out.png is written to out.n.png, or
+** out.n.bmp if its carrier is a BMP image...
+*/
+static char * _getShardOutputName(const char * pszOutputImageFile, const char * pszCarrierFile, int index) {
+	const char *	pszBaseName;
+	const char *	pszExtension;
+	const char *	pszCarrierExtension;
+	char *			pszShardOutputFile;
+	size_t			stemLength;
+
+	pszBaseName = strrchr(pszOutputImageFile, '/');
+	pszExtension = strrchr(pszOutputImageFile, '.');
+	pszCarrierExtension = strrchr(pszCarrierFile, '.');
+
+	if (pszExtension == NULL || (pszBaseName != NULL && pszExtension < pszBaseName)) {
+		stemLength = strlen(pszOutputImageFile);
+	}
+	else {
+		stemLength = (size_t)(pszExtension - pszOutputImageFile);
+	}
+
+	if (pszCarrierExtension == NULL || strchr(pszCarrierExtension, '/') != NULL) {
+		pszCarrierExtension = "";
+	}
+
+	pszShardOutputFile = (char *)malloc(stemLength + strlen(pszCarrierExtension) + 16);
+
+	if (pszShardOutputFile == NULL) {
+		fprintf(stderr, "Could not allocate memory for output file name\n");
+		exit(-1);
+	}
+
+	sprintf(pszShardOutputFile, "%.*s.%d%s", (int)stemLength, pszOutputImageFile, index, pszCarrierExtension);
+
+	return pszShardOutputFile;
+}
+
+/*
+** Split the file into numCarriers - numParityShards data shards, add the
+** Reed-Solomon parity shards and merge each shard into its own carrier
+** image. Any numCarriers - numParityShards of the images recover the file...
+*/
+int mergeShards(
+		char ** carrierFiles, 
+		int numCarriers, 
+		int numParityShards, 
+		const char * pszSecretFile, 
+		const char * pszKeystreamFile,
+		const char * pszOutputImageFile,
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	SECRW_SHARD			shard;
+	HSECRW				hsec;
+	FILE *				fptrSecret;
+	uint8_t **			shards;
+	char *				pszShardOutputFile;
+	uint64_t			fileLength;
+	uint64_t			offset;
+	uint32_t			length;
+	int					numDataShards;
+	int					i;
+
+	numDataShards = numCarriers - numParityShards;
+
+	if (numParityShards < 1 || numDataShards < 1 || numCarriers > EC_MAX_SHARDS) {
+		fprintf(
+			stderr, 
+			"%d parity shards need between %d and %d carrier images, %d were given\n", 
+			numParityShards, 
+			numParityShards + 1, 
+			EC_MAX_SHARDS, 
+			numCarriers);
+		exit(-1);
+	}
+
+	/*
+	** As with archives, only a pad pool gives each shard its own part
+	** of the pad...
+	*/
+	if (algo == xor && !secrw_is_pad_pool(pszKeystreamFile)) {
+		fprintf(stderr, "Shards encrypted with 'xor' must use a pad pool (--pad-pool)\n");
+		exit(-1);
+	}
+
+	fptrSecret = fopen(pszSecretFile, "rb");
+
+	if (fptrSecret == NULL) {
+		fprintf(stderr, "Could not open input file %s: %s\n", pszSecretFile, strerror(errno));
+		exit(-1);
+	}
+
+	fileLength = getFileSize(fptrSecret);
+
+	memset(&shard, 0, sizeof(SECRW_SHARD));
+
+	shard.numDataShards = (uint8_t)numDataShards;
+	shard.numParityShards = (uint8_t)numParityShards;
+	shard.fileLength = fileLength;
+	shard.shardLength = (uint32_t)((fileLength + numDataShards - 1) / numDataShards);
+
+	gcry_create_nonce(shard.setID, SECRW_SHARD_SET_ID_LENGTH);
+
+	shards = (uint8_t **)calloc(numCarriers, sizeof(uint8_t *));
+
+	if (shards == NULL) {
+		fprintf(stderr, "Could not allocate memory for shards\n");
+		exit(-1);
+	}
+
+	/*
+	** The last data shard is padded with zeros...
+	*/
+	for (i = 0;i < numCarriers;i++) {
+		shards[i] = (uint8_t *)calloc(shard.shardLength + 1, 1);
+
+		if (shards[i] == NULL) {
+			fprintf(stderr, "Could not allocate memory for shards\n");
+			exit(-1);
+		}
+
+		offset = (uint64_t)i * shard.shardLength;
+
+		if (i < numDataShards && offset < fileLength) {
+			length = (uint32_t)((fileLength - offset) < shard.shardLength ? (fileLength - offset) : shard.shardLength);
+
+			if (fread(shards[i], 1, length, fptrSecret) < length) {
+				fprintf(stderr, "Failed to read file %s\n", pszSecretFile);
+				exit(-1);
+			}
+		}
+	}
+
+	fclose(fptrSecret);
+
+	if (ec_encode(shards, numDataShards, numParityShards, shard.shardLength)) {
+		exit(-1);
+	}
+
+	for (i = 0;i < numCarriers;i++) {
+		shard.index = (uint8_t)i;
+
+		hsec = rdr_open_shard(&shard, shards[i], algo, (uint8_t)quality);
+
+		if (hsec == NULL) {
+			exit(-1);
+		}
+
+		_encryptFrame(hsec, algo, pszKeystreamFile, key, keyLength);
+
+		pszShardOutputFile = _getShardOutputName(pszOutputImageFile, carrierFiles[i], i + 1);
+
+		_mergeFrames(carrierFiles[i], pszShardOutputFile, &hsec, 1, quality, pszSecretFile);
+
+		printf(
+			"Merged %s shard %d of %d into %s\n", 
+			(i < numDataShards ? "data" : "parity"), 
+			i + 1, 
+			numCarriers, 
+			pszShardOutputFile);
+
+		rdr_close(hsec);
+		free(pszShardOutputFile);
+	}
+
+	for (i = 0;i < numCarriers;i++) {
+		secureFree(shards[i], shard.shardLength + 1);
+	}
+
+	free(shards);
+
+	return 0;
+}
+
+/*
+** Extract the shards from the carrier images, stopping once we have
+** enough to recover the file. Images that are missing, damaged or hold
+** a shard from another set are skipped...
+*/
+int extractShards(
+		char ** carrierFiles, 
+		int numCarriers, 
+		const char * pszKeystreamFile,
+		const char * pszSecretFile, 
+		merge_quality quality, 
+		encryption_algo algo, 
+		uint8_t * key, 
+		uint32_t keyLength)
+{
+	SECRW_SHARD			set;
+	SECRW_SHARD			shard;
+	HSECRW				hsec;
+	FILE *				fptrSecret;
+	uint8_t *			shards[EC_MAX_SHARDS];
+	uint8_t *			shardData;
+	boolean				isPresent[EC_MAX_SHARDS];
+	merge_quality		carrierQuality;
+	encryption_algo		carrierAlgo;
+	uint64_t			bytesLeft;
+	uint32_t			length;
+	int					numFound = 0;
+	int					numShards = 0;
+	int					i;
+
+	memset(shards, 0, sizeof(shards));
+	memset(isPresent, 0, sizeof(isPresent));
+	memset(&set, 0, sizeof(SECRW_SHARD));
+
+	for (i = 0;i < numCarriers && (numFound == 0 || numFound < set.numDataShards);i++) {
+		carrierQuality = quality;
+		carrierAlgo = algo;
+
+		if (detectFrame(carrierFiles[i], &carrierQuality, &carrierAlgo) < 0) {
+			fprintf(stderr, "Skipping %s, the image could not be read\n", carrierFiles[i]);
+			continue;
+		}
+
+		hsec = wrtr_open_shard(carrierAlgo);
+
+		if (hsec == NULL) {
+			exit(-1);
+		}
+
+		if (_readFrameToWriter(carrierFiles[i], pszKeystreamFile, hsec, carrierQuality, carrierAlgo, key, keyLength, 0U)) {
+			fprintf(stderr, "Skipping %s\n", carrierFiles[i]);
+			wrtr_close(hsec);
+			continue;
+		}
+
+		shardData = wrtr_get_shard(hsec, &shard);
+
+		wrtr_close(hsec);
+
+		if (shardData == NULL) {
+			fprintf(stderr, "Skipping %s\n", carrierFiles[i]);
+			continue;
+		}
+
+		if (numFound == 0) {
+			set = shard;
+			numShards = set.numDataShards + set.numParityShards;
+		}
+		else if (
+			memcmp(shard.setID, set.setID, SECRW_SHARD_SET_ID_LENGTH) != 0 || 
+			shard.numDataShards != set.numDataShards || 
+			shard.numParityShards != set.numParityShards || 
+			shard.fileLength != set.fileLength || 
+			shard.shardLength != set.shardLength)
+		{
+			fprintf(stderr, "Skipping %s, its shard is from a different set\n", carrierFiles[i]);
+			secureFree(shardData, shard.shardLength + 1);
+			continue;
+		}
+
+		if (isPresent[shard.index]) {
+			fprintf(stderr, "Skipping %s, shard %d has been found already\n", carrierFiles[i], shard.index + 1);
+			secureFree(shardData, shard.shardLength + 1);
+			continue;
+		}
+
+		printf("Found shard %d of %d in %s\n", shard.index + 1, numShards, carrierFiles[i]);
+
+		shards[shard.index] = shardData;
+		isPresent[shard.index] = True;
+		numFound++;
+	}
+
+	if (numFound == 0) {
+		fprintf(stderr, "None of the images hold a shard\n");
+		exit(-1);
+	}
+	else if (numFound < set.numDataShards) {
+		fprintf(
+			stderr, 
+			"Found %d shards, at least %d are needed to recover the file\n", 
+			numFound, 
+			set.numDataShards);
+		exit(-1);
+	}
+
+	for (i = 0;i < set.numDataShards;i++) {
+		if (!isPresent[i]) {
+			shards[i] = (uint8_t *)calloc(set.shardLength + 1, 1);
+
+			if (shards[i] == NULL) {
+				fprintf(stderr, "Could not allocate memory for shards\n");
+				exit(-1);
+			}
+		}
+	}
+
+	if (ec_reconstruct(shards, isPresent, set.numDataShards, set.numParityShards, set.shardLength)) {
+		exit(-1);
+	}
+
+	fptrSecret = fopen(pszSecretFile, "wb");
+
+	if (fptrSecret == NULL) {
+		fprintf(stderr, "Failed to open output file %s: %s\n", pszSecretFile, strerror(errno));
+		exit(-1);
+	}
+
+	bytesLeft = set.fileLength;
+
+	for (i = 0;i < set.numDataShards && bytesLeft > 0;i++) {
+		length = (uint32_t)(bytesLeft < set.shardLength ? bytesLeft : set.shardLength);
+
+		if (fwrite(shards[i], 1, length, fptrSecret) < length) {
+			fprintf(stderr, "Failed to write output file %s\n", pszSecretFile);
+			fclose(fptrSecret);
+			exit(-1);
+		}
+
+		bytesLeft -= length;
+	}
+
+	fclose(fptrSecret);
+
+	for (i = 0;i < numShards;i++) {
+		if (shards[i] != NULL) {
+			secureFree(shards[i], set.shardLength + 1);
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Check the frame in the image against its CRC without decrypting
+** anything, returns 0 if the image is intact...
+*/
+int verify(const char * pszInputImageFile, merge_quality quality, encryption_algo algo) {
+	HSECRW			hsec;
+	HIMG			himgRead;
+	int				rtn = 0;
+
+	himgRead = imgrdr_open(pszInputImageFile);
+
+	if (himgRead == NULL) {
+		fprintf(stderr, "Could not open source image file %s: %s\n", pszInputImageFile, strerror(errno));
+		return -1;
+	}
+
+	hsec = wrtr_open_verify(algo);
+
+	if (hsec == NULL) {
+		imgrdr_close(himgRead);
+		imgrdr_destroy_handle(himgRead);
+		return -1;
+	}
+
+	rtn = _extractFrame(himgRead, hsec, quality, 0);
+
+	imgrdr_close(himgRead);
+	imgrdr_destroy_handle(himgRead);
+
+	if (rtn > 0 && wrtr_is_verified(hsec)) {
+		printf("%s: OK\n", pszInputImageFile);
+		rtn = 0;
+	}
+	else if (rtn > 0) {
+		printf("%s: no CRC, the image was made by an older version of cloak\n", pszInputImageFile);
+		rtn = -1;
+	}
+	else {
+		printf("%s: DAMAGED\n", pszInputImageFile);
+		rtn = -1;
+	}
+
+	wrtr_close(hsec);
+
+	return rtn;
+}
@@ -19,16 +19,27 @@ merge_quality;
 
 uint32_t    getKey(uint8_t * keyBuffer, uint32_t keyBufferLength, const char * pwd);
 uint8_t     getBitMask(merge_quality quality);
+const char * getQualityName(merge_quality quality);
 int         getNumImageBytesRequired(merge_quality quality);
 void        mergeSecretByte(
                     uint8_t * imageBytes, 
                     int numImageBytes, 
                     uint8_t secretByte, 
                     merge_quality quality);
+void        mergeSecretSpan(
+                    uint8_t * imageBytes, 
+                    const uint8_t * secretBytes, 
+                    uint32_t numSecretBytes, 
+                    merge_quality quality);
 uint8_t     extractSecretByte(
                     uint8_t * imageBytes, 
                     uint32_t numImageBytes, 
                     merge_quality quality);
+void        extractSecretSpan(
+                    const uint8_t * imageBytes, 
+                    uint8_t * secretBytes, 
+                    uint32_t numSecretBytes, 
+                    merge_quality quality);
 uint32_t    getImageCapacity(char * pszInputImageFile, merge_quality quality);
 int         merge(
                 const char * pszInputImageFile, 
@@ -37,6 +48,18 @@ int         merge(
                 const char * pszOutputImageFile,
                 merge_quality quality, 
                 encryption_algo algo, 
+                compression_algo compression, 
+                uint8_t * key, 
+                uint32_t keyLength);
+int         mergeArchive(
+                const char * pszInputImageFile, 
+                char ** secretFiles, 
+                int numSecretFiles, 
+                const char * pszKeystreamFile,
+                const char * pszOutputImageFile,
+                merge_quality quality, 
+                encryption_algo algo, 
+                compression_algo compression, 
                 uint8_t * key, 
                 uint32_t keyLength);
 int         extract(
@@ -47,5 +70,64 @@ int         extract(
                 encryption_algo algo, 
                 uint8_t * key, 
                 uint32_t keyLength);
+int         listArchive(
+                const char * pszInputImageFile, 
+                const char * pszKeystreamFile,
+                merge_quality quality, 
+                encryption_algo algo, 
+                uint8_t * key, 
+                uint32_t keyLength);
+int         extractMember(
+                const char * pszInputImageFile, 
+                const char * pszKeystreamFile,
+                const char * pszMemberName, 
+                const char * pszSecretFile, 
+                merge_quality quality, 
+                encryption_algo algo, 
+                uint8_t * key, 
+                uint32_t keyLength);
+int         extractRange(
+                const char * pszInputImageFile, 
+                const char * pszKeystreamFile,
+                const char * pszSecretFile, 
+                merge_quality quality, 
+                encryption_algo algo, 
+                uint8_t * key, 
+                uint32_t keyLength, 
+                uint64_t rangeOffset, 
+                uint64_t rangeLength);
+int         mergeShards(
+                char ** carrierFiles, 
+                int numCarriers, 
+                int numParityShards, 
+                const char * pszSecretFile, 
+                const char * pszKeystreamFile,
+                const char * pszOutputImageFile,
+                merge_quality quality, 
+                encryption_algo algo, 
+                uint8_t * key, 
+                uint32_t keyLength);
+int         extractShards(
+                char ** carrierFiles, 
+                int numCarriers, 
+                const char * pszKeystreamFile,
+                const char * pszSecretFile, 
+                merge_quality quality, 
+                encryption_algo algo, 
+                uint8_t * key, 
+                uint32_t keyLength);
+int         findFrameHeader(
+                const uint8_t * imageBytes, 
+                uint32_t numImageBytes, 
+                merge_quality * quality, 
+                SECRW_FRAME_INFO * info);
+int         detectFrame(
+                const char * pszInputImageFile, 
+                merge_quality * quality, 
+                encryption_algo * algo);
+int         verify(
+                const char * pszInputImageFile, 
+                merge_quality quality, 
+                encryption_algo algo);
 
 #endif
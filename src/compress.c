@@ -0,0 +1,517 @@
+/******************************************************************************
+Copyright (c) 2023 Guy Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "cloak_types.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "compress.h"
+
+/*
+** Large inputs are compressed in blocks on the thread pool. Like pigz,
+** each zlib block is primed with the last 32K of the block before it
+** and sync flushed, so the blocks join up into a single raw deflate
+** stream that decompresses in one pass...
+*/
+#define COMPRESS_BLOCK_SIZE             1048576
+#define COMPRESS_DICT_SIZE              32768
+#define COMPRESS_ZLIB_LEVEL             6
+#define COMPRESS_ZLIB_WINDOW_BITS       -15
+#define COMPRESS_ZLIB_MEM_LEVEL         8
+#define COMPRESS_ZSTD_LEVEL             3
+
+#define DECOMPRESS_BUFFER_SIZE          262144
+
+typedef struct {
+    compression_algo    algo;
+    const uint8_t *     in;
+    uint32_t            inLength;
+    const uint8_t *     dict;
+    uint32_t            dictLength;
+    boolean             isFinal;
+    uint8_t *           out;
+    uint32_t            outLength;
+    int                 err;
+}
+COMPRESS_BLOCK;
+
+struct _decompressor {
+    compression_algo    algo;
+    FILE *              fptrOutput;
+    uint8_t *           buffer;
+    uint64_t            outputLength;
+    uint64_t            maxOutputLength;
+    boolean             isStreamEnd;
+
+    z_stream            zstrm;
+
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *         zstdContext;
+#endif
+};
+
+boolean cmp_is_available(compression_algo c) {
+    switch (c) {
+        case compression_none:
+        case compression_zlib:
+            return True;
+
+        case compression_zstd:
+#ifdef HAVE_ZSTD
+            return True;
+#else
+            return False;
+#endif
+    }
+
+    return False;
+}
+
+const char * cmp_get_name(compression_algo c) {
+    switch (c) {
+        case compression_none:
+            return "none";
+
+        case compression_zlib:
+            return "zlib";
+
+        case compression_zstd:
+            return "zstd";
+    }
+
+    return "unknown";
+}
+
+/*
+** Shannon entropy of the data in bits per byte, already compressed
+** or encrypted data comes out close to 8...
+*/
+double cmp_get_entropy(const uint8_t * data, uint32_t length) {
+    uint32_t        histogram[256];
+    double          entropy = 0.0;
+    double          p;
+    uint32_t        i;
+
+    if (length == 0) {
+        return 0.0;
+    }
+
+    memset(histogram, 0, sizeof(histogram));
+
+    for (i = 0;i < length;i++) {
+        histogram[data[i]]++;
+    }
+
+    for (i = 0;i < 256;i++) {
+        if (histogram[i] > 0) {
+            p = (double)histogram[i] / (double)length;
+            entropy -= p * log2(p);
+        }
+    }
+
+    return entropy;
+}
+
+static uint32_t _getBlockBound(compression_algo c, uint32_t length) {
+#ifdef HAVE_ZSTD
+    if (c == compression_zstd) {
+        return (uint32_t)ZSTD_compressBound(length);
+    }
+#endif
+
+    /*
+    ** Allow for the sync flush marker after the block...
+    */
+    return (uint32_t)compressBound(length) + 16;
+}
+
+static void _compressBlockZlib(COMPRESS_BLOCK * block) {
+    block->err = deflateWithDictionary(
+                        block->in, 
+                        block->inLength, 
+                        block->dict, 
+                        block->dictLength, 
+                        block->out, 
+                        _getBlockBound(block->algo, block->inLength), 
+                        COMPRESS_ZLIB_LEVEL, 
+                        COMPRESS_ZLIB_MEM_LEVEL, 
+                        Z_DEFAULT_STRATEGY, 
+                        block->isFinal, 
+                        &block->outLength);
+}
+
+#ifdef HAVE_ZSTD
+static void _compressBlockZstd(COMPRESS_BLOCK * block) {
+    size_t          rtn;
+
+    /*
+    ** Each block is a complete zstd frame, the decoder
+    ** reads concatenated frames as a single stream...
+    */
+    rtn = ZSTD_compress(
+                block->out, 
+                _getBlockBound(block->algo, block->inLength), 
+                block->in, 
+                block->inLength, 
+                COMPRESS_ZSTD_LEVEL);
+
+    if (ZSTD_isError(rtn)) {
+        block->err = -1;
+    }
+    else {
+        block->outLength = (uint32_t)rtn;
+        block->err = 0;
+    }
+}
+#endif
+
+static void _compressBlock(void * p) {
+    COMPRESS_BLOCK *        block = (COMPRESS_BLOCK *)p;
+
+#ifdef HAVE_ZSTD
+    if (block->algo == compression_zstd) {
+        _compressBlockZstd(block);
+        return;
+    }
+#endif
+
+    _compressBlockZlib(block);
+}
+
+/*
+** Compress the input into a newly allocated buffer, the first
+** reserveLength bytes of the output are left for the caller's header
+** and are included in the output length...
+*/
+int cmp_compress(
+            compression_algo c, 
+            const uint8_t * in, 
+            uint32_t inLength, 
+            uint32_t reserveLength, 
+            uint8_t ** out, 
+            uint32_t * outLength)
+{
+    HTHREADPOOL         hpool = NULL;
+    COMPRESS_BLOCK *    blocks;
+    uint8_t *           output;
+    uint32_t            numBlocks;
+    uint32_t            offset;
+    uint32_t            i;
+
+    if (!cmp_is_available(c) || c == compression_none) {
+        fprintf(stderr, "Compression algorithm '%s' is not available\n", cmp_get_name(c));
+        return -1;
+    }
+
+    numBlocks = (inLength + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+
+    if (numBlocks == 0) {
+        numBlocks = 1;
+    }
+
+    blocks = (COMPRESS_BLOCK *)malloc(numBlocks * sizeof(COMPRESS_BLOCK));
+
+    if (blocks == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %u compression blocks\n", numBlocks);
+        return -1;
+    }
+
+    for (i = 0;i < numBlocks;i++) {
+        offset = i * COMPRESS_BLOCK_SIZE;
+
+        blocks[i].algo = c;
+        blocks[i].in = &in[offset];
+        blocks[i].inLength = ((inLength - offset) < COMPRESS_BLOCK_SIZE ? (inLength - offset) : COMPRESS_BLOCK_SIZE);
+        blocks[i].dict = (i > 0 ? &in[offset - COMPRESS_DICT_SIZE] : NULL);
+        blocks[i].dictLength = (i > 0 ? COMPRESS_DICT_SIZE : 0);
+        blocks[i].isFinal = (i == (numBlocks - 1) ? True : False);
+        blocks[i].outLength = 0;
+        blocks[i].err = 0;
+        blocks[i].out = (uint8_t *)malloc(_getBlockBound(c, blocks[i].inLength));
+
+        if (blocks[i].out == NULL) {
+            fprintf(stderr, "Failed to allocate memory for compression block\n");
+
+            while (i > 0) {
+                free(blocks[--i].out);
+            }
+
+            free(blocks);
+            return -1;
+        }
+    }
+
+    if (numBlocks > 1) {
+        hpool = tp_create(0);
+    }
+
+    for (i = 0;i < numBlocks;i++) {
+        if (hpool == NULL || tp_submit(hpool, _compressBlock, &blocks[i])) {
+            _compressBlock(&blocks[i]);
+        }
+    }
+
+    if (hpool != NULL) {
+        tp_wait(hpool);
+        tp_destroy(hpool);
+    }
+
+    *outLength = reserveLength;
+
+    for (i = 0;i < numBlocks;i++) {
+        if (blocks[i].err) {
+            fprintf(stderr, "Failed to compress block %u with %s\n", i, cmp_get_name(c));
+
+            for (i = 0;i < numBlocks;i++) {
+                free(blocks[i].out);
+            }
+
+            free(blocks);
+            return -1;
+        }
+
+        *outLength += blocks[i].outLength;
+    }
+
+    output = (uint8_t *)malloc(*outLength);
+
+    if (output != NULL) {
+        offset = reserveLength;
+
+        for (i = 0;i < numBlocks;i++) {
+            memcpy(&output[offset], blocks[i].out, blocks[i].outLength);
+            offset += blocks[i].outLength;
+        }
+    }
+    else {
+        fprintf(stderr, "Failed to allocate %u bytes for compressed data\n", *outLength);
+    }
+
+    for (i = 0;i < numBlocks;i++) {
+        free(blocks[i].out);
+    }
+
+    free(blocks);
+
+    if (output == NULL) {
+        return -1;
+    }
+
+    *out = output;
+
+    return 0;
+}
+
+/*
+** Open a streaming decompressor writing to fptrOutput, it fails
+** rather than write more than maxOutputLength bytes...
+*/
+HDECOMPRESS dcmp_open(compression_algo c, FILE * fptrOutput, uint64_t maxOutputLength) {
+    HDECOMPRESS         hdcmp;
+
+    if (!cmp_is_available(c) || c == compression_none) {
+        fprintf(stderr, "Compression algorithm '%s' is not available\n", cmp_get_name(c));
+        return NULL;
+    }
+
+    hdcmp = (HDECOMPRESS)malloc(sizeof(struct _decompressor));
+
+    if (hdcmp == NULL) {
+        fprintf(stderr, "Failed to allocate memory for decompressor\n");
+        return NULL;
+    }
+
+    memset(hdcmp, 0, sizeof(struct _decompressor));
+
+    hdcmp->algo = c;
+    hdcmp->fptrOutput = fptrOutput;
+    hdcmp->maxOutputLength = maxOutputLength;
+
+    hdcmp->buffer = (uint8_t *)malloc(DECOMPRESS_BUFFER_SIZE);
+
+    if (hdcmp->buffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for decompressor\n");
+        free(hdcmp);
+        return NULL;
+    }
+
+#ifdef HAVE_ZSTD
+    if (c == compression_zstd) {
+        hdcmp->zstdContext = ZSTD_createDCtx();
+
+        if (hdcmp->zstdContext == NULL) {
+            fprintf(stderr, "Failed to create zstd decompression context\n");
+            free(hdcmp->buffer);
+            free(hdcmp);
+            return NULL;
+        }
+
+        return hdcmp;
+    }
+#endif
+
+    if (inflateInit2(&hdcmp->zstrm, COMPRESS_ZLIB_WINDOW_BITS) != Z_OK) {
+        fprintf(stderr, "Failed to initialise zlib decompression\n");
+        free(hdcmp->buffer);
+        free(hdcmp);
+        return NULL;
+    }
+
+    return hdcmp;
+}
+
+static int _dcmp_write_output(HDECOMPRESS hdcmp, uint32_t length) {
+    if ((hdcmp->outputLength + length) > hdcmp->maxOutputLength) {
+        fprintf(stderr, "Decompressed data is longer than expected, the image is damaged\n");
+        return -1;
+    }
+
+    if (fwrite(hdcmp->buffer, 1, length, hdcmp->fptrOutput) < length) {
+        fprintf(stderr, "Failed to write secret file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    hdcmp->outputLength += length;
+
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int _dcmp_write_zstd(HDECOMPRESS hdcmp, const uint8_t * in, uint32_t length) {
+    ZSTD_inBuffer       input = {in, length, 0};
+    ZSTD_outBuffer      output;
+    size_t              rtn;
+
+    do {
+        output.dst = hdcmp->buffer;
+        output.size = DECOMPRESS_BUFFER_SIZE;
+        output.pos = 0;
+
+        rtn = ZSTD_decompressStream(hdcmp->zstdContext, &output, &input);
+
+        if (ZSTD_isError(rtn)) {
+            fprintf(stderr, "Failed to decompress data: %s\n", ZSTD_getErrorName(rtn));
+            return -1;
+        }
+
+        if (_dcmp_write_output(hdcmp, (uint32_t)output.pos)) {
+            return -1;
+        }
+
+        /*
+        ** A return of 0 means we're at the end of a frame...
+        */
+        hdcmp->isStreamEnd = (rtn == 0 ? True : False);
+    }
+    while (input.pos < input.size || output.pos == output.size);
+
+    return 0;
+}
+#endif
+
+int dcmp_write(HDECOMPRESS hdcmp, const uint8_t * in, uint32_t length) {
+    int             rtn;
+
+#ifdef HAVE_ZSTD
+    if (hdcmp->algo == compression_zstd) {
+        return _dcmp_write_zstd(hdcmp, in, length);
+    }
+#endif
+
+    hdcmp->zstrm.next_in = (uint8_t *)in;
+    hdcmp->zstrm.avail_in = length;
+
+    /*
+    ** Keep going while there's input, or inflate filled the
+    ** output buffer and may have more pending...
+    */
+    do {
+        hdcmp->zstrm.next_out = hdcmp->buffer;
+        hdcmp->zstrm.avail_out = DECOMPRESS_BUFFER_SIZE;
+
+        rtn = inflate(&hdcmp->zstrm, Z_NO_FLUSH);
+
+        if (rtn != Z_OK && rtn != Z_STREAM_END) {
+            fprintf(stderr, "Failed to decompress data: %s\n", (hdcmp->zstrm.msg != NULL ? hdcmp->zstrm.msg : "zlib error"));
+            return -1;
+        }
+
+        if (_dcmp_write_output(hdcmp, DECOMPRESS_BUFFER_SIZE - hdcmp->zstrm.avail_out)) {
+            return -1;
+        }
+
+        if (rtn == Z_STREAM_END) {
+            hdcmp->isStreamEnd = True;
+        }
+    }
+    while ((hdcmp->zstrm.avail_in > 0 || hdcmp->zstrm.avail_out == 0) && !hdcmp->isStreamEnd);
+
+    if (hdcmp->zstrm.avail_in > 0) {
+        fprintf(stderr, "Unexpected data after the end of the compressed stream\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+** Check the compressed stream ended cleanly...
+*/
+int dcmp_finish(HDECOMPRESS hdcmp) {
+    if (!hdcmp->isStreamEnd) {
+        fprintf(stderr, "Compressed data is truncated, the image is damaged\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+uint64_t dcmp_get_output_length(HDECOMPRESS hdcmp) {
+    return hdcmp->outputLength;
+}
+
+void dcmp_close(HDECOMPRESS hdcmp) {
+#ifdef HAVE_ZSTD
+    if (hdcmp->zstdContext != NULL) {
+        ZSTD_freeDCtx(hdcmp->zstdContext);
+    }
+    else {
+        inflateEnd(&hdcmp->zstrm);
+    }
+#else
+    inflateEnd(&hdcmp->zstrm);
+#endif
+
+    free(hdcmp->buffer);
+    free(hdcmp);
+}
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "cloak_types.h"
+
+#ifndef __INCL_COMPRESS
+#define __INCL_COMPRESS
+
+typedef enum {
+    compression_none = 0,
+    compression_zlib = 1,
+    compression_zstd = 2
+}
+compression_algo;
+
+struct _decompressor;
+typedef struct _decompressor *  HDECOMPRESS;
+
+boolean         cmp_is_available(compression_algo c);
+const char *    cmp_get_name(compression_algo c);
+double          cmp_get_entropy(const uint8_t * data, uint32_t length);
+int             cmp_compress(
+                    compression_algo c, 
+                    const uint8_t * in, 
+                    uint32_t inLength, 
+                    uint32_t reserveLength, 
+                    uint8_t ** out, 
+                    uint32_t * outLength);
+
+HDECOMPRESS     dcmp_open(compression_algo c, FILE * fptrOutput, uint64_t maxOutputLength);
+int             dcmp_write(HDECOMPRESS hdcmp, const uint8_t * in, uint32_t length);
+int             dcmp_finish(HDECOMPRESS hdcmp);
+uint64_t        dcmp_get_output_length(HDECOMPRESS hdcmp);
+void            dcmp_close(HDECOMPRESS hdcmp);
+
+#endif
@@ -0,0 +1,491 @@
+/******************************************************************************
+Copyright (c) 2023 Guy Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "cloak_types.h"
+#include "threadpool.h"
+#include "erasure.h"
+
+/*
+** Reed-Solomon erasure coding over GF(256). The code is systematic, the
+** data shards are stored as they are and each parity shard is a row of a
+** Cauchy matrix times the data shards. Every square submatrix of a Cauchy
+** matrix is invertible, so any k of the k + m shards recover the data...
+*/
+#define GF_POLYNOMIAL                   0x11D
+#define EC_SLICE_SIZE                   65536
+
+typedef struct {
+    const uint8_t *     matrix;
+    uint8_t **          inputs;
+    int                 numInputs;
+    uint8_t **          outputs;
+    int                 numOutputs;
+    size_t              offset;
+    size_t              length;
+}
+EC_SLICE;
+
+static uint8_t          gfExp[512];
+static uint8_t          gfLog[256];
+static pthread_once_t   gfTablesOnce = PTHREAD_ONCE_INIT;
+
+static void _gfBuildTables(void) {
+    uint32_t        x = 1;
+    int             i;
+
+    for (i = 0;i < 255;i++) {
+        gfExp[i] = (uint8_t)x;
+        gfLog[x] = (uint8_t)i;
+
+        x <<= 1;
+
+        if (x & 0x100) {
+            x ^= GF_POLYNOMIAL;
+        }
+    }
+
+    /*
+    ** Doubled up so the sum of two logs needs no modulo...
+    */
+    for (i = 255;i < 512;i++) {
+        gfExp[i] = gfExp[i - 255];
+    }
+
+    gfLog[0] = 0;
+}
+
+static uint8_t _gfMul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static uint8_t _gfInv(uint8_t a) {
+    return gfExp[255 - gfLog[a]];
+}
+
+#if defined(__x86_64__)
+/*
+** Multiply 16 bytes at a time by looking up the product of each nibble
+** with PSHUFB, then XOR the two halves together. Compiled for SSSE3 or
+** AVX2 whatever the build flags, they are only called if the CPU has them...
+*/
+__attribute__((target("ssse3")))
+static size_t _gfMulRegionXorSSSE3(uint8_t * target, const uint8_t * source, const uint8_t * lowTable, const uint8_t * highTable, size_t length) {
+    __m128i         low = _mm_loadu_si128((const __m128i *)lowTable);
+    __m128i         high = _mm_loadu_si128((const __m128i *)highTable);
+    __m128i         mask = _mm_set1_epi8(0x0F);
+    size_t          i;
+
+    for (i = 0;(i + 16) <= length;i += 16) {
+        __m128i     s = _mm_loadu_si128((const __m128i *)&source[i]);
+        __m128i     t = _mm_loadu_si128((const __m128i *)&target[i]);
+        __m128i     p;
+
+        p = _mm_xor_si128(
+                _mm_shuffle_epi8(low, _mm_and_si128(s, mask)), 
+                _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+
+        _mm_storeu_si128((__m128i *)&target[i], _mm_xor_si128(t, p));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _gfMulRegionXorAVX2(uint8_t * target, const uint8_t * source, const uint8_t * lowTable, const uint8_t * highTable, size_t length) {
+    __m256i         low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lowTable));
+    __m256i         high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)highTable));
+    __m256i         mask = _mm256_set1_epi8(0x0F);
+    size_t          i;
+
+    for (i = 0;(i + 32) <= length;i += 32) {
+        __m256i     s = _mm256_loadu_si256((const __m256i *)&source[i]);
+        __m256i     t = _mm256_loadu_si256((const __m256i *)&target[i]);
+        __m256i     p;
+
+        p = _mm256_xor_si256(
+                _mm256_shuffle_epi8(low, _mm256_and_si256(s, mask)), 
+                _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+
+        _mm256_storeu_si256((__m256i *)&target[i], _mm256_xor_si256(t, p));
+    }
+
+    return i;
+}
+#elif defined(__aarch64__)
+static size_t _gfMulRegionXorNEON(uint8_t * target, const uint8_t * source, const uint8_t * lowTable, const uint8_t * highTable, size_t length) {
+    uint8x16_t      low = vld1q_u8(lowTable);
+    uint8x16_t      high = vld1q_u8(highTable);
+    uint8x16_t      mask = vdupq_n_u8(0x0F);
+    size_t          i;
+
+    for (i = 0;(i + 16) <= length;i += 16) {
+        uint8x16_t  s = vld1q_u8(&source[i]);
+        uint8x16_t  p;
+
+        p = veorq_u8(
+                vqtbl1q_u8(low, vandq_u8(s, mask)), 
+                vqtbl1q_u8(high, vshrq_n_u8(s, 4)));
+
+        vst1q_u8(&target[i], veorq_u8(vld1q_u8(&target[i]), p));
+    }
+
+    return i;
+}
+#endif
+
+/*
+** target ^= c * source, a byte at a time through the nibble tables for
+** anything the vector kernels leave over...
+*/
+void gf_mul_region_xor(uint8_t * target, const uint8_t * source, uint8_t c, size_t length) {
+    uint8_t         lowTable[16];
+    uint8_t         highTable[16];
+    size_t          i = 0;
+    int             n;
+
+    if (c == 0) {
+        return;
+    }
+
+    pthread_once(&gfTablesOnce, _gfBuildTables);
+
+    for (n = 0;n < 16;n++) {
+        lowTable[n] = _gfMul(c, (uint8_t)n);
+        highTable[n] = _gfMul(c, (uint8_t)(n << 4));
+    }
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        i = _gfMulRegionXorAVX2(target, source, lowTable, highTable, length);
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        i = _gfMulRegionXorSSSE3(target, source, lowTable, highTable, length);
+    }
+#elif defined(__aarch64__)
+    i = _gfMulRegionXorNEON(target, source, lowTable, highTable, length);
+#endif
+
+    for (;i < length;i++) {
+        target[i] ^= lowTable[source[i] & 0x0F] ^ highTable[source[i] >> 4];
+    }
+}
+
+static void _ecMultiplySlice(void * p) {
+    EC_SLICE *      slice = (EC_SLICE *)p;
+    int             i;
+    int             j;
+
+    for (i = 0;i < slice->numOutputs;i++) {
+        memset(&slice->outputs[i][slice->offset], 0, slice->length);
+
+        for (j = 0;j < slice->numInputs;j++) {
+            gf_mul_region_xor(
+                    &slice->outputs[i][slice->offset], 
+                    &slice->inputs[j][slice->offset], 
+                    slice->matrix[(i * slice->numInputs) + j], 
+                    slice->length);
+        }
+    }
+}
+
+/*
+** outputs = matrix x inputs, where the matrix is numOutputs rows by
+** numInputs columns. The shards are cut into slices small enough for
+** the outputs to stay in cache, which are run on the thread pool...
+*/
+static int _ecMultiply(const uint8_t * matrix, uint8_t ** inputs, int numInputs, uint8_t ** outputs, int numOutputs, size_t shardLength) {
+    HTHREADPOOL     hpool;
+    EC_SLICE *      slices;
+    size_t          numSlices;
+    size_t          i;
+
+    numSlices = (shardLength + EC_SLICE_SIZE - 1) / EC_SLICE_SIZE;
+
+    if (numSlices == 0 || numOutputs == 0) {
+        return 0;
+    }
+
+    slices = (EC_SLICE *)malloc(numSlices * sizeof(EC_SLICE));
+
+    if (slices == NULL) {
+        fprintf(stderr, "Failed to allocate memory for erasure coding\n");
+        return -1;
+    }
+
+    for (i = 0;i < numSlices;i++) {
+        slices[i].matrix = matrix;
+        slices[i].inputs = inputs;
+        slices[i].numInputs = numInputs;
+        slices[i].outputs = outputs;
+        slices[i].numOutputs = numOutputs;
+        slices[i].offset = i * EC_SLICE_SIZE;
+        slices[i].length = ((shardLength - slices[i].offset) < EC_SLICE_SIZE ? (shardLength - slices[i].offset) : EC_SLICE_SIZE);
+    }
+
+    hpool = (numSlices > 1 ? tp_create(0) : NULL);
+
+    if (hpool == NULL) {
+        for (i = 0;i < numSlices;i++) {
+            _ecMultiplySlice(&slices[i]);
+        }
+    }
+    else {
+        for (i = 0;i < numSlices;i++) {
+            if (tp_submit(hpool, _ecMultiplySlice, &slices[i])) {
+                _ecMultiplySlice(&slices[i]);
+            }
+        }
+
+        tp_wait(hpool);
+        tp_destroy(hpool);
+    }
+
+    free(slices);
+
+    return 0;
+}
+
+static uint8_t _ecCauchy(int numDataShards, int parityIndex, int dataIndex) {
+    return _gfInv((uint8_t)((numDataShards + parityIndex) ^ dataIndex));
+}
+
+/*
+** Invert the n x n matrix in place by Gauss-Jordan elimination...
+*/
+static int _ecInvert(uint8_t * matrix, int n) {
+    uint8_t *       inverse;
+    uint8_t         swap;
+    uint8_t         factor;
+    int             row;
+    int             pivot;
+    int             i;
+    int             j;
+
+    inverse = (uint8_t *)calloc(n * n, 1);
+
+    if (inverse == NULL) {
+        fprintf(stderr, "Failed to allocate memory for erasure coding\n");
+        return -1;
+    }
+
+    for (i = 0;i < n;i++) {
+        inverse[(i * n) + i] = 1;
+    }
+
+    for (i = 0;i < n;i++) {
+        for (pivot = i;pivot < n && matrix[(pivot * n) + i] == 0;pivot++);
+
+        if (pivot == n) {
+            fprintf(stderr, "Erasure coding matrix is singular\n");
+            free(inverse);
+            return -1;
+        }
+
+        if (pivot != i) {
+            for (j = 0;j < n;j++) {
+                swap = matrix[(i * n) + j];
+                matrix[(i * n) + j] = matrix[(pivot * n) + j];
+                matrix[(pivot * n) + j] = swap;
+
+                swap = inverse[(i * n) + j];
+                inverse[(i * n) + j] = inverse[(pivot * n) + j];
+                inverse[(pivot * n) + j] = swap;
+            }
+        }
+
+        factor = _gfInv(matrix[(i * n) + i]);
+
+        for (j = 0;j < n;j++) {
+            matrix[(i * n) + j] = _gfMul(matrix[(i * n) + j], factor);
+            inverse[(i * n) + j] = _gfMul(inverse[(i * n) + j], factor);
+        }
+
+        for (row = 0;row < n;row++) {
+            if (row == i || matrix[(row * n) + i] == 0) {
+                continue;
+            }
+
+            factor = matrix[(row * n) + i];
+
+            for (j = 0;j < n;j++) {
+                matrix[(row * n) + j] ^= _gfMul(matrix[(i * n) + j], factor);
+                inverse[(row * n) + j] ^= _gfMul(inverse[(i * n) + j], factor);
+            }
+        }
+    }
+
+    memcpy(matrix, inverse, n * n);
+    free(inverse);
+
+    return 0;
+}
+
+static int _ecCheckShardCounts(int numDataShards, int numParityShards) {
+    if (numDataShards < 1 || numParityShards < 0 || (numDataShards + numParityShards) > EC_MAX_SHARDS) {
+        fprintf(
+            stderr, 
+            "Invalid erasure coding of %d data and %d parity shards, at most %d shards are allowed\n", 
+            numDataShards, 
+            numParityShards, 
+            EC_MAX_SHARDS);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+** Fill in the parity shards, shards[k] to shards[k + m - 1], from the
+** data shards, shards[0] to shards[k - 1]...
+*/
+int ec_encode(uint8_t ** shards, int numDataShards, int numParityShards, size_t shardLength) {
+    uint8_t *       matrix;
+    int             i;
+    int             j;
+    int             rtn;
+
+    if (_ecCheckShardCounts(numDataShards, numParityShards)) {
+        return -1;
+    }
+
+    pthread_once(&gfTablesOnce, _gfBuildTables);
+
+    matrix = (uint8_t *)malloc(numParityShards * numDataShards + 1);
+
+    if (matrix == NULL) {
+        fprintf(stderr, "Failed to allocate memory for erasure coding\n");
+        return -1;
+    }
+
+    for (i = 0;i < numParityShards;i++) {
+        for (j = 0;j < numDataShards;j++) {
+            matrix[(i * numDataShards) + j] = _ecCauchy(numDataShards, i, j);
+        }
+    }
+
+    rtn = _ecMultiply(matrix, shards, numDataShards, &shards[numDataShards], numParityShards, shardLength);
+
+    free(matrix);
+
+    return rtn;
+}
+
+/*
+** Rebuild the missing data shards from any k of the shards present, the
+** buffers for the missing data shards must be allocated by the caller.
+** Missing parity shards are not rebuilt...
+*/
+int ec_reconstruct(uint8_t ** shards, const boolean * isPresent, int numDataShards, int numParityShards, size_t shardLength) {
+    uint8_t *       matrix;
+    uint8_t *       decodeMatrix;
+    uint8_t **      inputs;
+    uint8_t **      outputs;
+    int             numInputs = 0;
+    int             numOutputs = 0;
+    int             shardIndex;
+    int             i;
+    int             j;
+    int             rtn;
+
+    if (_ecCheckShardCounts(numDataShards, numParityShards)) {
+        return -1;
+    }
+
+    pthread_once(&gfTablesOnce, _gfBuildTables);
+
+    matrix = (uint8_t *)calloc(numDataShards * numDataShards, 1);
+    decodeMatrix = (uint8_t *)malloc(numDataShards * numDataShards);
+    inputs = (uint8_t **)malloc(numDataShards * sizeof(uint8_t *));
+    outputs = (uint8_t **)malloc(numDataShards * sizeof(uint8_t *));
+
+    if (matrix == NULL || decodeMatrix == NULL || inputs == NULL || outputs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for erasure coding\n");
+        free(matrix);
+        free(decodeMatrix);
+        free(inputs);
+        free(outputs);
+        return -1;
+    }
+
+    /*
+    ** The first k shards present, data shards first, give the rows of
+    ** the encoding matrix that we invert...
+    */
+    for (shardIndex = 0;shardIndex < (numDataShards + numParityShards) && numInputs < numDataShards;shardIndex++) {
+        if (!isPresent[shardIndex]) {
+            continue;
+        }
+
+        for (j = 0;j < numDataShards;j++) {
+            if (shardIndex < numDataShards) {
+                matrix[(numInputs * numDataShards) + j] = (j == shardIndex ? 1 : 0);
+            }
+            else {
+                matrix[(numInputs * numDataShards) + j] = _ecCauchy(numDataShards, shardIndex - numDataShards, j);
+            }
+        }
+
+        inputs[numInputs++] = shards[shardIndex];
+    }
+
+    if (numInputs < numDataShards) {
+        fprintf(stderr, "Need %d shards to recover the data, only %d are present\n", numDataShards, numInputs);
+        rtn = -1;
+    }
+    else {
+        rtn = _ecInvert(matrix, numDataShards);
+    }
+
+    if (rtn == 0) {
+        for (i = 0;i < numDataShards;i++) {
+            if (!isPresent[i]) {
+                memcpy(&decodeMatrix[numOutputs * numDataShards], &matrix[i * numDataShards], numDataShards);
+                outputs[numOutputs++] = shards[i];
+            }
+        }
+
+        rtn = _ecMultiply(decodeMatrix, inputs, numDataShards, outputs, numOutputs, shardLength);
+    }
+
+    free(matrix);
+    free(decodeMatrix);
+    free(inputs);
+    free(outputs);
+
+    return rtn;
+}
@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cloak_types.h"
+
+#ifndef __INCL_ERASURE
+#define __INCL_ERASURE
+
+#define EC_MAX_SHARDS                   255
+
+void        gf_mul_region_xor(uint8_t * target, const uint8_t * source, uint8_t c, size_t length);
+int         ec_encode(uint8_t ** shards, int numDataShards, int numParityShards, size_t shardLength);
+int         ec_reconstruct(
+                uint8_t ** shards, 
+                const boolean * isPresent, 
+                int numDataShards, 
+                int numParityShards, 
+                size_t shardLength);
+
+#endif
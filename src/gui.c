@@ -461,6 +461,7 @@ static void handleGoButtonClick(GtkWidget * widget, gpointer data) {
             szOutputImage, 
             _cloakInfo.quality, 
             _cloakInfo.algo,
+            compression_none,
             key,
             keyLength);
 
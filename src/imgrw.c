@@ -18,15 +18,36 @@ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
 LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
-******************************************************************************/#include <stdio.h>
+******************************************************************************/
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <setjmp.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <png.h>
+#include <zlib.h>
 
 #include "imgrw.h"
+#include "threadpool.h"
+#include "utils.h"
 #include "cloak_types.h"
 
 #define __BMP_WIN32_HEADER_SIZE                     40
@@ -34,7 +55,29 @@ SOFTWARE.
 
 #define HEADER_LOOKAHEAD_BUFFER_LEN                 18
 
-#define HANDLE_POOL_SIZE                            8
+#define IMG_IO_BUFFER_SIZE                          (1024 * 1024)
+#define IMG_MAP_THRESHOLD                           (1024 * 1024)
+
+/*
+** PNG images are compressed on the thread pool much as cmp_compress()
+** does. The rows are split into segments of about PNG_SEGMENT_SIZE
+** filtered bytes, each filtered and deflated on its own core primed
+** with the last 32K of filtered rows before it, and sync flushed so the
+** pieces join up into the single zlib stream of the IDAT chunks...
+*/
+#define PNG_SEGMENT_SIZE                            131072
+#define PNG_SEGMENTS_PER_THREAD                     2
+#define PNG_DICT_SIZE                               32768
+#define PNG_ZLIB_HEADER_LENGTH                      2
+#define PNG_ZLIB_TRAILER_LENGTH                     4
+#define PNG_BYTES_PER_PIXEL                         3
+
+/*
+** With --optimize each row group is filtered every way and deflated with
+** every strategy, at zlib's highest settings, and the smallest kept...
+*/
+#define PNG_OPTIMIZE_LEVEL                          9
+#define PNG_OPTIMIZE_MEM_LEVEL                      9
 
 typedef struct __attribute__((__packed__)) {
     char            bm[2];
@@ -65,93 +108,304 @@ typedef struct  {
 }
 IMG_GEOMETRY;
 
+struct _png_encoder;
+
+/*
+** Handles are allocated on the heap and share nothing, so any number of
+** images can be open at once, on any number of threads...
+*/
 struct _img_handle {
     /*
     ** Common attributes...
     */
-    uint16_t        _id;
     img_type        type;
 
     FILE *          fptr;
     IMG_GEOMETRY    geometry;
 
     /*
-    ** PNG specific attributes...
+    ** An image being read is opened once, the type is sniffed and the
+    ** image decoded from the same file. Large files are mapped, small
+    ** ones are read through stdio as mapping them costs more than it
+    ** saves. Images being written, and large files that can't be mapped,
+    ** go through a large stdio buffer...
+    */
+    uint8_t *       map;
+    size_t          mapLength;
+    size_t          mapPosition;
+    uint8_t *       ioBuffer;
+
+    /*
+    ** PNG specific attributes, libpng errors jump back to the handle's
+    ** own jump buffer, set by each function that calls into libpng...
     */
     png_structp     png_ptr;
 	png_infop	    info_ptr;
+    jmp_buf         jmpbuf;
 
     int             colourType;
     int             bitDepth;
     uint32_t        rowCounter;
 
+    /*
+    ** Set when the rows are compressed on the thread pool rather
+    ** than by libpng...
+    */
+    struct _png_encoder *   pEncoder;
+
     /*
     ** BMP specific attributes...
     */
     BMP_HEADER *    pHeader;
 };
 
-struct _img_handle      _imageHandlePool[HANDLE_POOL_SIZE];
-uint16_t                _nextId = 0x0000;
+/*
+** PNG images we merged ourselves can be decoded without libpng checking
+** every chunk CRC and the zlib Adler-32, see imgrdr_set_trusted_input()...
+*/
+static boolean _isTrustedInput = False;
+
+typedef struct {
+    const char *        pszName;
+    PNG_ENCODE_OPTIONS  options;
+}
+PNG_PROFILE;
+
+/*
+** The low bits of a merged image are noise, which no filter predicts, so
+** trying every filter on each row mostly buys time rather than size. The
+** fast profile sticks to the cheap Sub filter and just Huffman codes the
+** rows, small searches everything at the highest level. Balanced is how
+** images have always been written...
+*/
+static const PNG_PROFILE _pngProfiles[] = {
+    {"fast",        {1, PNG_FILTER_SUB, Z_HUFFMAN_ONLY, 8, 65536}},
+    {"balanced",    {5, PNG_ALL_FILTERS, Z_FILTERED, 8, 8192}},
+    {"small",       {9, PNG_ALL_FILTERS, Z_FILTERED, 9, 65536}},
+    {NULL,          {0, 0, 0, 0, 0}}
+};
+
+static PNG_ENCODE_OPTIONS _pngOptions = {5, PNG_ALL_FILTERS, Z_FILTERED, 8, 8192};
+
+/*
+** Threads compressing each PNG image, 0 for all cores and 1 for libpng's
+** own encoder, see imgwrtr_set_png_threads()...
+*/
+static int _numPNGThreads = 0;
+
+/*
+** Search for the smallest PNG encoding for up to this long per image,
+** 0 for as long as it takes, see imgwrtr_set_png_optimize()...
+*/
+static boolean _isPNGOptimize = False;
+static double _pngOptimizeSeconds = 0.0;
+
+/*
+** The candidates tried on each row group, filters first as they change
+** the rows every later group is primed with, then zlib strategies on
+** the rows chosen...
+*/
+static const int _optimizeFilters[] = {
+    PNG_ALL_FILTERS,
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVG,
+    PNG_FILTER_PAETH
+};
 
-// Global
-jmp_buf		    jmpbuf;
+static const int _optimizeStrategies[] = {
+    Z_FILTERED,
+    Z_DEFAULT_STRATEGY,
+    Z_RLE,
+    Z_HUFFMAN_ONLY
+};
+
+#define PNG_NUM_OPTIMIZE_FILTERS        (sizeof(_optimizeFilters) / sizeof(int))
+#define PNG_NUM_OPTIMIZE_STRATEGIES     (sizeof(_optimizeStrategies) / sizeof(int))
+#define PNG_NUM_OPTIMIZE_CANDIDATES     PNG_NUM_OPTIMIZE_FILTERS
+
+typedef struct {
+    const uint8_t *             raw;
+    const uint8_t *             prevRow;
+    uint32_t                    numRows;
+    uint32_t                    rowLength;
+    uint8_t *                   filtered;
+    uint8_t *                   scratch;
+    const uint8_t *             dict;
+    uint32_t                    dictLength;
+    const PNG_ENCODE_OPTIONS *  options;
+    boolean                     isFinal;
+    uint8_t *                   out;
+    uint32_t                    outBound;
+    uint32_t                    outOffset;
+    uint32_t                    outLength;
+    uLong                       adler;
+    int                         err;
+}
+PNG_SEGMENT;
+
+struct _png_encoder {
+    HTHREADPOOL         hpool;
+    PNG_ENCODE_OPTIONS  options;
+    PNG_SEGMENT *       segments;
+    uint32_t            numSegments;
+    uint32_t            rowsPerSegment;
+    uint32_t            rowLength;
+    uint32_t            numRows;
+    uint32_t            outBound;
+
+    /*
+    ** The raw rows of the batch follow the last row of the batch
+    ** before, the filtered rows follow the last 32K of filtered rows
+    ** before, as the dictionary of the first segment...
+    */
+    uint8_t *           raw;
+    uint8_t *           filtered;
+    uint8_t *           scratch;
+    uint8_t *           out;
+    uint32_t            dictLength;
+
+    uLong               adler;
+    boolean             isStarted;
+    boolean             isFinished;
+
+    /*
+    ** The --optimize search, a trial per candidate per segment, each
+    ** filter candidate filtering into its own copy of the batch...
+    */
+    boolean             isOptimize;
+    double              optimizeDeadline;
+    PNG_ENCODE_OPTIONS  candidates[PNG_NUM_OPTIMIZE_CANDIDATES];
+    PNG_SEGMENT *       trials;
+    uint8_t *           trialFiltered;
+    uint32_t            trialFilteredLength;
+    uint8_t *           trialScratch;
+    uint8_t *           trialOut;
+};
 
 static HIMG _allocateHandle(void) {
-    HIMG        himg = NULL;
-    int         i;
+    return (HIMG)calloc(1, sizeof(struct _img_handle));
+}
 
-    if (_nextId == 0x0000) {
-        for (i = 0;i < HANDLE_POOL_SIZE;i++) {
-            _imageHandlePool[i]._id = 0x0000;
-        }
+static void _freeHandle(HIMG himg) {
+    if (himg != NULL) {
+        free(himg->pHeader);
+        free(himg->ioBuffer);
+        free(himg);
+    }
+}
 
-        _nextId++;
+static void _setBuffer(HIMG himg) {
+    himg->ioBuffer = (uint8_t *)malloc(IMG_IO_BUFFER_SIZE);
+
+    if (himg->ioBuffer != NULL) {
+        setvbuf(himg->fptr, (char *)himg->ioBuffer, _IOFBF, IMG_IO_BUFFER_SIZE);
     }
+}
 
-    for (i = 0;i < HANDLE_POOL_SIZE;i++) {
-        if (_imageHandlePool[i]._id == 0x0000) {
-            himg = &_imageHandlePool[i];
-            himg->_id = _nextId++;
-            break;
+static int _openFile(HIMG himg, const char * pszImageName) {
+#ifndef _WIN32
+    struct stat         st;
+    void *              map;
+#endif
+
+    himg->fptr = fopen(pszImageName, "rb");
+
+    if (himg->fptr == NULL) {
+        return -1;
+    }
+
+#ifndef _WIN32
+    if (fstat(fileno(himg->fptr), &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size < IMG_MAP_THRESHOLD) {
+            return 0;
+        }
+
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(himg->fptr), 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+            himg->map = (uint8_t *)map;
+            himg->mapLength = (size_t)st.st_size;
+            himg->mapPosition = 0;
+
+            return 0;
         }
     }
+#endif
 
-    return himg;
+    _setBuffer(himg);
+
+    return 0;
 }
 
-static void _freeHandle(HIMG himg) {
-    int         i;
+static void _closeFile(HIMG himg) {
+#ifndef _WIN32
+    if (himg->map != NULL) {
+        munmap(himg->map, himg->mapLength);
+        himg->map = NULL;
+    }
+#endif
 
-    for (i = 0;i < HANDLE_POOL_SIZE;i++) {
-        if (himg->_id == _imageHandlePool[i]._id) {
-            himg->_id = 0x0000;
+    fclose(himg->fptr);
+    himg->fptr = NULL;
+}
+
+static size_t _readFile(HIMG himg, void * buffer, size_t length) {
+    if (himg->map != NULL) {
+        if (length > himg->mapLength - himg->mapPosition) {
+            length = himg->mapLength - himg->mapPosition;
         }
+
+        memcpy(buffer, &himg->map[himg->mapPosition], length);
+        himg->mapPosition += length;
+
+        return length;
     }
+
+    return fread(buffer, 1, length, himg->fptr);
 }
 
-static img_type _getImageType(const char * pszImageName) {
-    FILE *          fptr_input;
-    img_type        type;
-    uint8_t         header[HEADER_LOOKAHEAD_BUFFER_LEN];
-    uint32_t        dibSize;
-    uint32_t        bytesRead;
+static int _seekFile(HIMG himg, size_t offset) {
+    if (himg->map != NULL) {
+        if (offset > himg->mapLength) {
+            return -1;
+        }
 
-    fptr_input = fopen(pszImageName, "rb");
-    
-    if (fptr_input == NULL) {
-        fprintf(stderr, "Could not open input image file %s: %s\n", pszImageName, strerror(errno));
-        exit(-1);
+        himg->mapPosition = offset;
+
+        return 0;
     }
 
-    bytesRead = fread(header, 1, HEADER_LOOKAHEAD_BUFFER_LEN, fptr_input);
-    
-    if (bytesRead < HEADER_LOOKAHEAD_BUFFER_LEN) {
-        fprintf(stderr, "Failed to read image header from %s\n", pszImageName);
-        exit(-1);
+    return fseek(himg->fptr, (long)offset, SEEK_SET);
+}
+
+/*
+** Allocate a handle and open the image for reading...
+*/
+static HIMG _openReader(const char * pszImageName) {
+    HIMG            himg;
+
+    himg = _allocateHandle();
+
+    if (himg == NULL) {
+        fprintf(stderr, "Failed to allocate memory for HIMG handle\n");
+        return NULL;
+    }
+
+    if (_openFile(himg, pszImageName)) {
+        fprintf(stderr, "Could not open input image file %s: %s\n", pszImageName, strerror(errno));
+        _freeHandle(himg);
+        return NULL;
     }
-    
-    fclose(fptr_input);
+
+    return himg;
+}
+
+static img_type _getImageType(const uint8_t * header) {
+    uint32_t        dibSize;
 
     /*
     ** Get the size of the header...
@@ -160,27 +414,200 @@ static img_type _getImageType(const char * pszImageName) {
 
     if (header[0] == 'B' && header[1] == 'M') {
         if (dibSize == __BMP_WIN32_HEADER_SIZE) {
-            type = img_win32bitmap;
-        }
-        else {
-            type = img_unknown;
+            return img_win32bitmap;
         }
     }
-    else if (header[1] == 'P' && header[2] == 'N' && header[3] == 'G') {
-        type = img_png;
+    else if (png_sig_cmp(header, 0, 8) == 0) {
+        return img_png;
     }
-    else {
-        type = img_unknown;
+
+    return img_unknown;
+}
+
+/*
+** libpng reads from and writes to the handle's file through these...
+*/
+static void _pngReadData(png_structp png_ptr, png_bytep data, png_size_t length) {
+    if (_readFile((HIMG)png_get_io_ptr(png_ptr), data, length) < length) {
+        png_error(png_ptr, "Unexpected end of file");
+    }
+}
+
+static void _pngWriteData(png_structp png_ptr, png_bytep data, png_size_t length) {
+    HIMG            himg = (HIMG)png_get_io_ptr(png_ptr);
+
+    if (fwrite(data, 1, length, himg->fptr) < length) {
+        png_error(png_ptr, "Failed to write file");
     }
+}
 
-    return type;
+static void _pngFlushData(png_structp png_ptr) {
+    fflush(((HIMG)png_get_io_ptr(png_ptr))->fptr);
 }
 
+static HIMG _pngrdr_start(HIMG himg);
+static HIMG _bmprdr_start(HIMG himg, const char * pszImageName);
+
 static void _readwrite_error_handler(png_structp png_ptr, png_const_charp msg) {
-    fprintf(stderr, "writepng libpng error: %s\n", msg);
+    HIMG            himg = (HIMG)png_get_error_ptr(png_ptr);
+
+    fprintf(stderr, "libpng error: %s\n", msg);
     fflush(stderr);
 
-    longjmp(jmpbuf, 1);
+    longjmp(himg->jmpbuf, 1);
+}
+
+/*
+** Choose the PNG decode profile for images opened from now on, trusted
+** input skips the CRC and Adler-32 checks. Set once, before any images
+** are opened...
+*/
+void imgrdr_set_trusted_input(boolean isTrusted) {
+    _isTrustedInput = isTrusted;
+}
+
+/*
+** Look up the named encode profile, returns -1 for an unknown name...
+*/
+int imgwrtr_get_png_profile(const char * pszProfile, PNG_ENCODE_OPTIONS * options) {
+    int             i;
+
+    for (i = 0;_pngProfiles[i].pszName != NULL;i++) {
+        if (strcmp(pszProfile, _pngProfiles[i].pszName) == 0) {
+            memcpy(options, &_pngProfiles[i].options, sizeof(PNG_ENCODE_OPTIONS));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+** Name of the index'th profile, NULL past the last one...
+*/
+const char * imgwrtr_get_png_profile_name(int index) {
+    if (index < 0 || index >= (int)(sizeof(_pngProfiles) / sizeof(PNG_PROFILE)) - 1) {
+        return NULL;
+    }
+
+    return _pngProfiles[index].pszName;
+}
+
+/*
+** Set how many threads compress each PNG image written from now on,
+** 0 for all cores...
+*/
+void imgwrtr_set_png_threads(int numThreads) {
+    _numPNGThreads = numThreads;
+}
+
+/*
+** Search for the smallest encoding of each PNG image written from now
+** on, for up to budgetSeconds per image or without limit if 0...
+*/
+void imgwrtr_set_png_optimize(boolean isOptimize, double budgetSeconds) {
+    _isPNGOptimize = isOptimize;
+    _pngOptimizeSeconds = budgetSeconds;
+}
+
+/*
+** Set how PNG images opened for writing from now on are compressed...
+*/
+void imgwrtr_set_png_options(const PNG_ENCODE_OPTIONS * options) {
+    memcpy(&_pngOptions, options, sizeof(PNG_ENCODE_OPTIONS));
+}
+
+/*
+** Parse a comma separated list of filters, e.g. 'sub,up', or 'all',
+** returns the PNG filter mask or -1 if a name isn't recognised...
+*/
+int imgwrtr_parse_png_filters(const char * pszFilters) {
+    const char *    pszName = pszFilters;
+    size_t          length;
+    int             filters = 0;
+
+    while (*pszName) {
+        length = strcspn(pszName, ",");
+
+        if (length == 4 && strncmp(pszName, "none", 4) == 0) {
+            filters |= PNG_FILTER_NONE;
+        }
+        else if (length == 3 && strncmp(pszName, "sub", 3) == 0) {
+            filters |= PNG_FILTER_SUB;
+        }
+        else if (length == 2 && strncmp(pszName, "up", 2) == 0) {
+            filters |= PNG_FILTER_UP;
+        }
+        else if (length == 3 && strncmp(pszName, "avg", 3) == 0) {
+            filters |= PNG_FILTER_AVG;
+        }
+        else if (length == 5 && strncmp(pszName, "paeth", 5) == 0) {
+            filters |= PNG_FILTER_PAETH;
+        }
+        else if (length == 3 && strncmp(pszName, "all", 3) == 0) {
+            filters |= PNG_ALL_FILTERS;
+        }
+        else {
+            return -1;
+        }
+
+        pszName += length;
+
+        if (*pszName == ',') {
+            pszName++;
+        }
+    }
+
+    return (filters == 0) ? -1 : filters;
+}
+
+/*
+** Parse a zlib strategy name, returns -1 if it isn't recognised...
+*/
+int imgwrtr_parse_png_strategy(const char * pszStrategy) {
+    if (strcmp(pszStrategy, "default") == 0) {
+        return Z_DEFAULT_STRATEGY;
+    }
+    else if (strcmp(pszStrategy, "filtered") == 0) {
+        return Z_FILTERED;
+    }
+    else if (strcmp(pszStrategy, "huffman") == 0) {
+        return Z_HUFFMAN_ONLY;
+    }
+    else if (strcmp(pszStrategy, "rle") == 0) {
+        return Z_RLE;
+    }
+    else if (strcmp(pszStrategy, "fixed") == 0) {
+        return Z_FIXED;
+    }
+
+    return -1;
+}
+
+/*
+** Give an image being written from scratch, rather than copied from a
+** source with imgrdr_copy_header(), its size...
+*/
+void imgwrtr_set_size(HIMG himg, int32_t width, int32_t height) {
+    himg->geometry.width = width;
+    himg->geometry.height = height;
+    himg->geometry.channels = 3;
+    himg->geometry.bitsPerPixel = 24;
+
+    if (himg->type == img_win32bitmap) {
+        memset(himg->pHeader, 0, sizeof(BMP_HEADER));
+
+        himg->pHeader->bm[0] = 'B';
+        himg->pHeader->bm[1] = 'M';
+        himg->pHeader->dataOffset = sizeof(BMP_HEADER);
+        himg->pHeader->dibSize = __BMP_WIN32_HEADER_SIZE;
+        himg->pHeader->width = width;
+        himg->pHeader->height = height;
+        himg->pHeader->colourPlanes = 1;
+        himg->pHeader->bitsPerPixel = 24;
+        himg->pHeader->rawDataLength = bmprdr_get_data_length(himg);
+        himg->pHeader->fileSize = sizeof(BMP_HEADER) + himg->pHeader->rawDataLength;
+    }
 }
 
 void imgrdr_copy_header(HIMG target, HIMG source) {
@@ -190,6 +617,13 @@ void imgrdr_copy_header(HIMG target, HIMG source) {
     else if (source->type == img_win32bitmap) {
         memcpy(&target->geometry, &source->geometry, sizeof(IMG_GEOMETRY));
         memcpy(target->pHeader, source->pHeader, sizeof(BMP_HEADER));
+
+        /*
+        ** The rows are written straight after the header, whatever gap
+        ** the source has before its pixel data...
+        */
+        target->pHeader->dataOffset = sizeof(BMP_HEADER);
+        target->pHeader->fileSize = sizeof(BMP_HEADER) + bmprdr_get_data_length(source);
     }
 }
 
@@ -197,19 +631,40 @@ img_type imgrdr_get_type(HIMG himg) {
     return himg->type;
 }
 
+uint32_t imgrdr_get_width(HIMG himg) {
+    return (uint32_t)himg->geometry.width;
+}
+
 HIMG imgrdr_open(const char * pszImageName) {
+    HIMG                himg;
     img_type            type;
+    uint8_t             header[HEADER_LOOKAHEAD_BUFFER_LEN];
 
-    type = _getImageType(pszImageName);
+    himg = _openReader(pszImageName);
+
+    if (himg == NULL) {
+        return NULL;
+    }
+
+    if (_readFile(himg, header, HEADER_LOOKAHEAD_BUFFER_LEN) < HEADER_LOOKAHEAD_BUFFER_LEN || _seekFile(himg, 0)) {
+        fprintf(stderr, "Failed to read image header from %s\n", pszImageName);
+        _closeFile(himg);
+        _freeHandle(himg);
+        return NULL;
+    }
+
+    type = _getImageType(header);
 
     if (type == img_png) {
-        return pngrdr_open(pszImageName);
+        return _pngrdr_start(himg);
     }
     else if (type == img_win32bitmap) {
-        return bmprdr_open(pszImageName);
+        return _bmprdr_start(himg, pszImageName);
     }
     else {
         fprintf(stderr, "Cannot open %s: Unsupported image type\n", pszImageName);
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
 }
@@ -258,17 +713,47 @@ uint32_t imgrdr_get_data_length(HIMG himg) {
     return 0;
 }
 
-uint32_t imgrdr_read(HIMG himg, uint8_t * data, uint32_t bufferLength) {
+uint32_t imgrdr_get_row_buffer_len(HIMG himg) {
     if (himg->type == img_png) {
-        return pngrdr_read(himg, data, bufferLength);
+        return pngrdr_get_row_buffer_len(himg);
     }
     else if (himg->type == img_win32bitmap) {
-        return bmprdr_read(himg, data, bufferLength);
+        return bmprdr_get_row_buffer_len(himg);
     }
 
     return 0;
 }
 
+boolean imgrdr_has_more_rows(HIMG himg) {
+    return ((himg->rowCounter < himg->geometry.height) ? True : False);
+}
+
+int imgrdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
+    if (himg->type == img_png) {
+        return pngrdr_read_row(himg, rowBuffer, bufferLength);
+    }
+    else if (himg->type == img_win32bitmap) {
+        return bmprdr_read_row(himg, rowBuffer, bufferLength);
+    }
+
+    return -1;
+}
+
+/*
+** Move past rows without returning them, a BMP seeks straight past
+** them but a PNG still has to inflate them...
+*/
+int imgrdr_skip_rows(HIMG himg, uint32_t numRows) {
+    if (himg->type == img_png) {
+        return pngrdr_skip_rows(himg, numRows);
+    }
+    else if (himg->type == img_win32bitmap) {
+        return bmprdr_skip_rows(himg, numRows);
+    }
+
+    return -1;
+}
+
 int imgwrtr_write_header(HIMG himg) {
     if (himg->type == img_png) {
         return pngwrtr_write_header(himg);
@@ -280,34 +765,251 @@ int imgwrtr_write_header(HIMG himg) {
     return 0;
 }
 
-uint32_t imgwrtr_write(HIMG himg, uint8_t * data, uint32_t bufferLength) {
+int imgwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
     if (himg->type == img_png) {
-        return pngwrtr_write(himg, data, bufferLength);
+        return pngwrtr_write_row(himg, rowBuffer, bufferLength);
     }
     else if (himg->type == img_win32bitmap) {
-        return bmpwrtr_write(himg, data, bufferLength);
+        return bmpwrtr_write_row(himg, rowBuffer, bufferLength);
     }
 
-    return 0;
+    return -1;
 }
 
-HIMG pngrdr_open(const char * pszImageName) {
+/*
+** Open an image to be patched in place rather than rewritten, either the
+** source itself or a clone of it, returns NULL if the image can't be
+** patched (only BMP images can) or the clone isn't cheap to make...
+*/
+HIMG imgwrtr_open_patch(HIMG source, const char * pszImageName, boolean isInPlace) {
+    if (source->type == img_win32bitmap) {
+        return bmpwrtr_open_patch(source, pszImageName, isInPlace);
+    }
+
+    return NULL;
+}
+
+int imgwrtr_read_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length) {
+    if (himg->type == img_win32bitmap) {
+        return bmpwrtr_read_patch(himg, offset, data, length);
+    }
+
+    return -1;
+}
+
+int imgwrtr_write_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length) {
+    if (himg->type == img_win32bitmap) {
+        return bmpwrtr_write_patch(himg, offset, data, length);
+    }
+
+    return -1;
+}
+
+/*
+** Map the image data read-only, returns NULL if the image can't be
+** mapped (only BMP images can), in which case use imgrdr_read()...
+*/
+uint8_t * imgrdr_map(HIMG himg) {
+    if (himg->type == img_win32bitmap) {
+        return bmprdr_map(himg);
+    }
+
+    return NULL;
+}
+
+/*
+** Once the header has been written, size the output for dataLength bytes
+** of image data and map it read-write. Returns NULL if the image can't
+** be mapped, in which case use imgwrtr_write()...
+*/
+uint8_t * imgwrtr_map(HIMG himg, uint32_t dataLength) {
+    if (himg->type == img_win32bitmap) {
+        return bmpwrtr_map(himg, dataLength);
+    }
+
+    return NULL;
+}
+
+static void _quiet_error_handler(png_structp png_ptr, png_const_charp msg) {
+    png_longjmp(png_ptr, 1);
+}
+
+static void _quiet_warning_handler(png_structp png_ptr, png_const_charp msg) {
+}
+
+/*
+** Decode just enough PNG rows to fill the buffer, quietly, without
+** opening a handle...
+*/
+static int _pngReadHead(HIMG himg, uint8_t * buffer, uint32_t length) {
+    png_structp             png_ptr;
+    png_infop               info_ptr = NULL;
+    uint8_t * volatile      rowBuffer = NULL;
+    volatile uint32_t       bytesRead = 0;
+    uint32_t                rowLength;
+    uint32_t                height;
+    uint32_t                row;
+    int                     bitDepth;
+    int                     colourType;
+
+    png_ptr = png_create_read_struct(
+                                PNG_LIBPNG_VER_STRING, 
+                                NULL, 
+                                _quiet_error_handler, 
+                                _quiet_warning_handler);
+
+    if (png_ptr == NULL) {
+        return -1;
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+
+    if (info_ptr == NULL) {
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(rowBuffer);
+        return -1;
+    }
+
+    png_set_read_fn(png_ptr, himg, _pngReadData);
+    png_read_info(png_ptr, info_ptr);
+
+    height =        png_get_image_height(png_ptr, info_ptr);
+    bitDepth =      png_get_bit_depth(png_ptr, info_ptr);
+    colourType =    png_get_color_type(png_ptr, info_ptr);
+
+    /*
+    ** The same transforms as pngrdr_open(), so we see the same bytes...
+    */
+    if (bitDepth == 16) {
+        png_set_strip_16(png_ptr);
+    }
+
+    if (colourType == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png_ptr);
+    }
+
+    if (colourType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    }
+
+    if (colourType == PNG_COLOR_TYPE_GRAY || colourType == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(png_ptr);
+    }
+
+    png_read_update_info(png_ptr, info_ptr);
+
+    if (png_get_channels(png_ptr, info_ptr) != 3 || png_get_bit_depth(png_ptr, info_ptr) != 8) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return -1;
+    }
+
+    rowLength = (uint32_t)png_get_rowbytes(png_ptr, info_ptr);
+    rowBuffer = (uint8_t *)malloc(rowLength);
+
+    if (rowBuffer == NULL) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        return -1;
+    }
+
+    for (row = 0;row < height && bytesRead < length;row++) {
+        png_read_row(png_ptr, rowBuffer, NULL);
+
+        if (rowLength > (length - bytesRead)) {
+            memcpy(&buffer[bytesRead], rowBuffer, length - bytesRead);
+            bytesRead = length;
+        }
+        else {
+            memcpy(&buffer[bytesRead], rowBuffer, rowLength);
+            bytesRead += rowLength;
+        }
+    }
+
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(rowBuffer);
+
+    return (int)bytesRead;
+}
+
+static int _bmpReadHead(HIMG himg, uint8_t * buffer, uint32_t length) {
+    BMP_HEADER          header;
+
+    if (_readFile(himg, &header, sizeof(BMP_HEADER)) < sizeof(BMP_HEADER)) {
+        return -1;
+    }
+
+    if (header.bitsPerPixel != 24 || header.compressionMethod != 0 || header.numPaletteColours != 0) {
+        return -1;
+    }
+
+    if (_seekFile(himg, header.dataOffset)) {
+        return -1;
+    }
+
+    return (int)_readFile(himg, buffer, length);
+}
+
+/*
+** Read the first length bytes of image data, in the same order as the
+** row reader delivers them, without opening a full image handle. Quietly
+** returns -1 for anything that isn't a supported image, otherwise the
+** number of bytes read (less than length for tiny images)...
+*/
+int imgrdr_read_head(const char * pszImageName, uint8_t * buffer, uint32_t length) {
     HIMG            himg;
+    uint8_t         signature[HEADER_LOOKAHEAD_BUFFER_LEN];
+    img_type        type;
+    int             bytesRead = -1;
 
     himg = _allocateHandle();
 
     if (himg == NULL) {
-        fprintf(stderr, "Failed to allocate memory for HIMG handle\n");
-        return NULL;
+        return -1;
     }
 
-    himg->fptr = fopen(pszImageName, "rb");
-    
-    if (himg->fptr == NULL) {
-        fprintf(stderr, "Could not open input image file %s: %s\n", pszImageName, strerror(errno));
-        exit(-1);
+    if (_openFile(himg, pszImageName)) {
+        _freeHandle(himg);
+        return -1;
     }
 
+    if (_readFile(himg, signature, HEADER_LOOKAHEAD_BUFFER_LEN) == HEADER_LOOKAHEAD_BUFFER_LEN && _seekFile(himg, 0) == 0) {
+        type = _getImageType(signature);
+
+        if (type == img_win32bitmap) {
+            bytesRead = _bmpReadHead(himg, buffer, length);
+        }
+        else if (type == img_png) {
+            bytesRead = _pngReadHead(himg, buffer, length);
+        }
+    }
+
+    _closeFile(himg);
+    _freeHandle(himg);
+
+    return bytesRead;
+}
+
+HIMG pngrdr_open(const char * pszImageName) {
+    HIMG            himg;
+
+    himg = _openReader(pszImageName);
+
+    if (himg == NULL) {
+        return NULL;
+    }
+
+    return _pngrdr_start(himg);
+}
+
+/*
+** Start decoding a PNG from an open reader, the handle is freed if it
+** fails...
+*/
+static HIMG _pngrdr_start(HIMG himg) {
 	himg->png_ptr = png_create_read_struct(
                                     PNG_LIBPNG_VER_STRING,
                                     himg, 
@@ -315,7 +1017,9 @@ HIMG pngrdr_open(const char * pszImageName) {
                                     NULL);
 
 	if (himg->png_ptr == NULL) {
-        fprintf(stderr, "Failed to create PNG write struct\n");
+        fprintf(stderr, "Failed to create PNG read struct\n");
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
 	}
 
@@ -324,66 +1028,686 @@ HIMG pngrdr_open(const char * pszImageName) {
 	
     if (himg->info_ptr == NULL) {
 	  png_destroy_read_struct(&himg->png_ptr, NULL, NULL);
+      _closeFile(himg);
+      _freeHandle(himg);
 	  return NULL;
 	}
 
-	/* Set error handling if you are using the setjmp/longjmp method (this is
-	* the normal method of doing things with libpng).  REQUIRED unless you
-	* set up your own error handlers in the png_create_read_struct() earlier.
-	*/
-
-	if (setjmp(jmpbuf)) {
+	if (setjmp(himg->jmpbuf)) {
 	  /* Free all of the memory associated with the png_ptr_read and info_ptr_read */
 	  png_destroy_read_struct(&himg->png_ptr, &himg->info_ptr, NULL);
+      _closeFile(himg);
+      _freeHandle(himg);
 
 	  /* If we get here, we had a problem reading the file */
 	  return NULL;
 	}
 
-	/* Set up the input control if you are using standard C streams */
-	png_init_io(himg->png_ptr, himg->fptr);
+	/* Read through the handle, from the mapping if the file has one */
+	png_set_read_fn(himg->png_ptr, himg, _pngReadData);
+
+    if (_isTrustedInput) {
+        png_set_crc_action(himg->png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+
+#if defined(PNG_SET_OPTION_SUPPORTED) && defined(PNG_IGNORE_ADLER32)
+        png_set_option(himg->png_ptr, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+    }
 	
 	png_read_info(himg->png_ptr, himg->info_ptr);
 
-	himg->geometry.width =      png_get_image_width(himg->png_ptr, himg->info_ptr);
-	himg->geometry.height =     png_get_image_height(himg->png_ptr, himg->info_ptr);
-    himg->geometry.channels =   png_get_channels(himg->png_ptr, himg->info_ptr);
-    himg->bitDepth =            png_get_bit_depth(himg->png_ptr, himg->info_ptr);
-	himg->colourType =          png_get_color_type(himg->png_ptr, himg->info_ptr);
+	himg->geometry.width =      png_get_image_width(himg->png_ptr, himg->info_ptr);
+	himg->geometry.height =     png_get_image_height(himg->png_ptr, himg->info_ptr);
+    himg->geometry.channels =   png_get_channels(himg->png_ptr, himg->info_ptr);
+    himg->bitDepth =            png_get_bit_depth(himg->png_ptr, himg->info_ptr);
+	himg->colourType =          png_get_color_type(himg->png_ptr, himg->info_ptr);
+
+    himg->geometry.bitsPerPixel = himg->bitDepth * himg->geometry.channels;
+
+    himg->type = img_png;
+
+    if(himg->bitDepth == 16) {
+        png_set_strip_16(himg->png_ptr);
+    }
+
+    if(himg->colourType == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(himg->png_ptr);
+    }
+
+    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+    if(himg->colourType == PNG_COLOR_TYPE_GRAY && himg->bitDepth < 8) {
+        png_set_expand_gray_1_2_4_to_8(himg->png_ptr);
+    }
+
+    if( himg->colourType == PNG_COLOR_TYPE_GRAY ||
+        himg->colourType == PNG_COLOR_TYPE_GRAY_ALPHA)
+    {
+        png_set_gray_to_rgb(himg->png_ptr);
+    }
+
+    png_read_update_info(himg->png_ptr, himg->info_ptr);
+
+    if (himg->geometry.bitsPerPixel != 24) {
+        fprintf(stderr, "PNG image must be 24-bit RGB\n");
+        png_destroy_read_struct(&himg->png_ptr, &himg->info_ptr, NULL);
+        _closeFile(himg);
+        _freeHandle(himg);
+        return NULL;
+    }
+    
+    himg->rowCounter = 0;
+
+    return himg;
+}
+
+#define _FILTER_BYTE(expr)                          \
+    v = (uint8_t)(expr);                            \
+    out[i] = v;                                     \
+    sum += (v < 128 ? v : 256 - v)
+
+/*
+** Filter a row with one PNG filter type into out, returns the sum of
+** the filtered bytes taken as signed, libpng's measure of how well a
+** row will compress. Like libpng it gives up once the sum passes the
+** best so far...
+*/
+static uint32_t _filterRow(
+                uint8_t * out, 
+                const uint8_t * row, 
+                const uint8_t * prev, 
+                uint32_t rowLength, 
+                int filterType, 
+                uint32_t maxSum)
+{
+    const uint32_t  bpp = PNG_BYTES_PER_PIXEL;
+    uint32_t        sum = 0;
+    uint32_t        i;
+    uint8_t         v;
+    int             p;
+    int             pa;
+    int             pb;
+    int             pc;
+
+    *out++ = (uint8_t)filterType;
+
+    switch (filterType) {
+        case PNG_FILTER_VALUE_SUB:
+            for (i = 0;i < bpp;i++) {
+                _FILTER_BYTE(row[i]);
+            }
+            for (;i < rowLength && sum <= maxSum;i++) {
+                _FILTER_BYTE(row[i] - row[i - bpp]);
+            }
+            break;
+
+        case PNG_FILTER_VALUE_UP:
+            for (i = 0;i < rowLength && sum <= maxSum;i++) {
+                _FILTER_BYTE(row[i] - prev[i]);
+            }
+            break;
+
+        case PNG_FILTER_VALUE_AVG:
+            for (i = 0;i < bpp;i++) {
+                _FILTER_BYTE(row[i] - (prev[i] >> 1));
+            }
+            for (;i < rowLength && sum <= maxSum;i++) {
+                _FILTER_BYTE(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+            }
+            break;
+
+        case PNG_FILTER_VALUE_PAETH:
+            for (i = 0;i < bpp;i++) {
+                _FILTER_BYTE(row[i] - prev[i]);
+            }
+            for (;i < rowLength && sum <= maxSum;i++) {
+                p = row[i - bpp] + prev[i] - prev[i - bpp];
+                pa = abs(p - row[i - bpp]);
+                pb = abs(p - prev[i]);
+                pc = abs(p - prev[i - bpp]);
+
+                if (pa <= pb && pa <= pc) {
+                    _FILTER_BYTE(row[i] - row[i - bpp]);
+                }
+                else if (pb <= pc) {
+                    _FILTER_BYTE(row[i] - prev[i]);
+                }
+                else {
+                    _FILTER_BYTE(row[i] - prev[i - bpp]);
+                }
+            }
+            break;
+
+        default:
+            for (i = 0;i < rowLength && sum <= maxSum;i++) {
+                _FILTER_BYTE(row[i]);
+            }
+            break;
+    }
+
+    return (i < rowLength ? UINT32_MAX : sum);
+}
+
+/*
+** Filter the segment's rows, with more than one filter allowed each row
+** takes the one with the lowest sum as libpng does...
+*/
+static void _filterSegment(void * p) {
+    PNG_SEGMENT *   segment = (PNG_SEGMENT *)p;
+    const uint8_t * row;
+    const uint8_t * prev;
+    uint8_t *       out;
+    uint32_t        filteredRowLength;
+    uint32_t        sum;
+    uint32_t        bestSum;
+    uint32_t        r;
+    int             filterType;
+
+    filteredRowLength = segment->rowLength + 1;
+
+    for (r = 0;r < segment->numRows;r++) {
+        row = &segment->raw[r * segment->rowLength];
+        prev = (r == 0 ? segment->prevRow : row - segment->rowLength);
+        out = &segment->filtered[r * filteredRowLength];
+
+        bestSum = UINT32_MAX;
+
+        for (filterType = PNG_FILTER_VALUE_NONE;filterType < PNG_FILTER_VALUE_LAST;filterType++) {
+            if ((segment->options->filters & (PNG_FILTER_NONE << filterType)) == 0) {
+                continue;
+            }
+
+            if (bestSum == UINT32_MAX) {
+                bestSum = _filterRow(out, row, prev, segment->rowLength, filterType, UINT32_MAX);
+            }
+            else {
+                sum = _filterRow(segment->scratch, row, prev, segment->rowLength, filterType, bestSum);
+
+                if (sum < bestSum) {
+                    bestSum = sum;
+                    memcpy(out, segment->scratch, filteredRowLength);
+                }
+            }
+        }
+    }
+}
+
+static void _deflateSegment(void * p) {
+    PNG_SEGMENT *   segment = (PNG_SEGMENT *)p;
+    uint32_t        inLength;
+
+    inLength = segment->numRows * (segment->rowLength + 1);
+
+    segment->adler = adler32(adler32(0L, Z_NULL, 0), segment->filtered, inLength);
+
+    segment->err = deflateWithDictionary(
+                        segment->filtered, 
+                        inLength, 
+                        segment->dict, 
+                        segment->dictLength, 
+                        &segment->out[segment->outOffset], 
+                        segment->outBound - segment->outOffset - PNG_ZLIB_TRAILER_LENGTH, 
+                        segment->options->level, 
+                        segment->options->memLevel, 
+                        segment->options->strategy, 
+                        segment->isFinal, 
+                        &segment->outLength);
+
+    if (segment->err == 0) {
+        segment->outLength += segment->outOffset;
+    }
+}
+
+static void _destroyEncoder(struct _png_encoder * pEncoder) {
+    if (pEncoder != NULL) {
+        if (pEncoder->hpool != NULL) {
+            tp_destroy(pEncoder->hpool);
+        }
+
+        free(pEncoder->segments);
+        free(pEncoder->raw);
+        free(pEncoder->filtered);
+        free(pEncoder->scratch);
+        free(pEncoder->out);
+        free(pEncoder->trials);
+        free(pEncoder->trialFiltered);
+        free(pEncoder->trialScratch);
+        free(pEncoder->trialOut);
+        free(pEncoder);
+    }
+}
+
+/*
+** Set up the threaded encoder for the image if it is worth it, returns
+** NULL for libpng to compress the image itself...
+*/
+static struct _png_encoder * _createEncoder(HIMG himg) {
+    struct _png_encoder *   pEncoder;
+    uint32_t                filteredRowLength;
+    uint32_t                segmentLength;
+    uint32_t                numImageSegments;
+    int                     numThreads;
+
+    numThreads = (_numPNGThreads < 1 ? tp_get_num_cores() : _numPNGThreads);
+
+    if (numThreads > THREADPOOL_MAX_THREADS) {
+        numThreads = THREADPOOL_MAX_THREADS;
+    }
+
+    filteredRowLength = (uint32_t)himg->geometry.width * PNG_BYTES_PER_PIXEL + 1;
+
+    /*
+    ** Only our encoder can search for the smallest image, on any
+    ** number of threads...
+    */
+    if (!_isPNGOptimize && 
+        (numThreads < 2 || (uint64_t)filteredRowLength * himg->geometry.height <= PNG_SEGMENT_SIZE))
+    {
+        return NULL;
+    }
+
+    pEncoder = (struct _png_encoder *)calloc(1, sizeof(struct _png_encoder));
+
+    if (pEncoder == NULL) {
+        return NULL;
+    }
+
+    memcpy(&pEncoder->options, &_pngOptions, sizeof(PNG_ENCODE_OPTIONS));
+
+    pEncoder->isOptimize = _isPNGOptimize;
+
+    pEncoder->rowLength = filteredRowLength - 1;
+    pEncoder->rowsPerSegment = PNG_SEGMENT_SIZE / filteredRowLength;
+
+    if (pEncoder->rowsPerSegment == 0) {
+        pEncoder->rowsPerSegment = 1;
+    }
+
+    numImageSegments = 
+        ((uint32_t)himg->geometry.height + pEncoder->rowsPerSegment - 1) / pEncoder->rowsPerSegment;
+
+    /*
+    ** A search already has a trial per candidate for each segment to
+    ** keep the threads busy...
+    */
+    pEncoder->numSegments = (uint32_t)numThreads * (pEncoder->isOptimize ? 1 : PNG_SEGMENTS_PER_THREAD);
+
+    if (pEncoder->numSegments > numImageSegments) {
+        pEncoder->numSegments = numImageSegments;
+    }
+
+    /*
+    ** deflateBound()'s bound for settings other than zlib's defaults,
+    ** plus the sync flush marker...
+    */
+    segmentLength = pEncoder->rowsPerSegment * filteredRowLength;
+
+    pEncoder->outBound = 
+        segmentLength + ((segmentLength + 7) >> 3) + ((segmentLength + 63) >> 6) + 5 + 16 + 
+        PNG_ZLIB_HEADER_LENGTH + PNG_ZLIB_TRAILER_LENGTH;
+
+    pEncoder->segments = (PNG_SEGMENT *)calloc(pEncoder->numSegments, sizeof(PNG_SEGMENT));
+
+    /*
+    ** The first raw row is the row before the image, all zero...
+    */
+    pEncoder->raw = (uint8_t *)calloc(
+                            1 + pEncoder->numSegments * pEncoder->rowsPerSegment, 
+                            pEncoder->rowLength);
+
+    pEncoder->filtered = (uint8_t *)malloc(
+                            PNG_DICT_SIZE + 
+                            pEncoder->numSegments * pEncoder->rowsPerSegment * filteredRowLength);
+
+    pEncoder->scratch = (uint8_t *)malloc(pEncoder->numSegments * filteredRowLength);
+    pEncoder->out = (uint8_t *)malloc(pEncoder->numSegments * pEncoder->outBound);
+
+    pEncoder->hpool = tp_create(numThreads);
+
+    if (pEncoder->isOptimize) {
+        pEncoder->trialFilteredLength = 
+            PNG_DICT_SIZE + pEncoder->numSegments * pEncoder->rowsPerSegment * filteredRowLength;
+
+        pEncoder->trials = (PNG_SEGMENT *)calloc(
+                                PNG_NUM_OPTIMIZE_CANDIDATES * pEncoder->numSegments, 
+                                sizeof(PNG_SEGMENT));
+
+        pEncoder->trialFiltered = (uint8_t *)malloc(
+                                PNG_NUM_OPTIMIZE_FILTERS * pEncoder->trialFilteredLength);
+
+        pEncoder->trialScratch = (uint8_t *)malloc(
+                                PNG_NUM_OPTIMIZE_FILTERS * pEncoder->numSegments * filteredRowLength);
+
+        pEncoder->trialOut = (uint8_t *)malloc(
+                                PNG_NUM_OPTIMIZE_CANDIDATES * pEncoder->numSegments * pEncoder->outBound);
+
+        if (pEncoder->trials == NULL || 
+            pEncoder->trialFiltered == NULL || 
+            pEncoder->trialScratch == NULL || 
+            pEncoder->trialOut == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory to optimize PNG image\n");
+            _destroyEncoder(pEncoder);
+            return NULL;
+        }
+
+        if (_pngOptimizeSeconds > 0.0) {
+            pEncoder->optimizeDeadline = getTimeSeconds() + _pngOptimizeSeconds;
+        }
+    }
+
+    if (pEncoder->segments == NULL || 
+        pEncoder->raw == NULL || 
+        pEncoder->filtered == NULL || 
+        pEncoder->scratch == NULL || 
+        pEncoder->out == NULL || 
+        pEncoder->hpool == NULL)
+    {
+        _destroyEncoder(pEncoder);
+        return NULL;
+    }
+
+    pEncoder->adler = adler32(0L, Z_NULL, 0);
+
+    return pEncoder;
+}
+
+/*
+** The zlib stream header deflate itself would write, for a 32K window
+** and the compression level...
+*/
+static void _getZlibHeader(const PNG_ENCODE_OPTIONS * options, uint8_t * header) {
+    uint32_t        value;
+    uint32_t        levelFlags;
+
+    if (options->strategy >= Z_HUFFMAN_ONLY || options->level < 2) {
+        levelFlags = 0;
+    }
+    else if (options->level < 6) {
+        levelFlags = 1;
+    }
+    else if (options->level == 6) {
+        levelFlags = 2;
+    }
+    else {
+        levelFlags = 3;
+    }
+
+    value = (0x78 << 8) | (levelFlags << 6);
+    value += 31 - (value % 31);
+
+    header[0] = (uint8_t)(value >> 8);
+    header[1] = (uint8_t)(value & 0xFF);
+}
+
+static void _runSegments(HTHREADPOOL hpool, PNG_SEGMENT * segments, uint32_t numSegments, tp_job job) {
+    uint32_t        i;
+
+    for (i = 0;i < numSegments;i++) {
+        if (tp_submit(hpool, job, &segments[i])) {
+            job(&segments[i]);
+        }
+    }
+
+    tp_wait(hpool);
+}
+
+/*
+** Try each filter on each segment, deflating it primed with the same
+** filter's rows before it, and keep the rows that deflated smallest.
+** Then deflate the rows kept with each strategy, primed with the rows
+** really before them, and keep the smallest output...
+*/
+static int _searchSegments(struct _png_encoder * pEncoder, uint32_t numSegments) {
+    PNG_SEGMENT *   segment;
+    PNG_SEGMENT *   trial;
+    PNG_SEGMENT *   best;
+    uint8_t *       filtered;
+    uint32_t        filteredRowLength;
+    uint32_t        segmentStart;
+    uint32_t        c;
+    uint32_t        i;
+
+    filteredRowLength = pEncoder->rowLength + 1;
+
+    for (c = 0;c < PNG_NUM_OPTIMIZE_FILTERS;c++) {
+        memcpy(&pEncoder->candidates[c], &pEncoder->options, sizeof(PNG_ENCODE_OPTIONS));
+        pEncoder->candidates[c].level = PNG_OPTIMIZE_LEVEL;
+        pEncoder->candidates[c].memLevel = PNG_OPTIMIZE_MEM_LEVEL;
+        pEncoder->candidates[c].filters = _optimizeFilters[c];
+
+        filtered = &pEncoder->trialFiltered[c * pEncoder->trialFilteredLength];
+
+        memcpy(
+            &filtered[PNG_DICT_SIZE - pEncoder->dictLength], 
+            &pEncoder->filtered[PNG_DICT_SIZE - pEncoder->dictLength], 
+            pEncoder->dictLength);
+
+        for (i = 0;i < numSegments;i++) {
+            segment = &pEncoder->segments[i];
+            trial = &pEncoder->trials[c * numSegments + i];
+
+            segmentStart = (uint32_t)(segment->filtered - &pEncoder->filtered[PNG_DICT_SIZE]);
+
+            memcpy(trial, segment, sizeof(PNG_SEGMENT));
+
+            trial->filtered = &filtered[PNG_DICT_SIZE + segmentStart];
+            trial->dict = trial->filtered - trial->dictLength;
+            trial->scratch = &pEncoder->trialScratch[(c * numSegments + i) * filteredRowLength];
+            trial->options = &pEncoder->candidates[c];
+            trial->out = &pEncoder->trialOut[(c * numSegments + i) * pEncoder->outBound];
+        }
+    }
+
+    _runSegments(pEncoder->hpool, pEncoder->trials, PNG_NUM_OPTIMIZE_FILTERS * numSegments, _filterSegment);
+    _runSegments(pEncoder->hpool, pEncoder->trials, PNG_NUM_OPTIMIZE_FILTERS * numSegments, _deflateSegment);
+
+    for (i = 0;i < numSegments;i++) {
+        best = NULL;
+
+        for (c = 0;c < PNG_NUM_OPTIMIZE_FILTERS;c++) {
+            trial = &pEncoder->trials[c * numSegments + i];
+
+            if (trial->err) {
+                fprintf(stderr, "Failed to compress PNG rows, zlib error %d\n", trial->err);
+                return -1;
+            }
+
+            if (best == NULL || trial->outLength < best->outLength) {
+                best = trial;
+            }
+        }
+
+        segment = &pEncoder->segments[i];
+
+        memcpy(segment->filtered, best->filtered, segment->numRows * filteredRowLength);
+    }
+
+    for (c = 0;c < PNG_NUM_OPTIMIZE_STRATEGIES;c++) {
+        memcpy(&pEncoder->candidates[c], &pEncoder->options, sizeof(PNG_ENCODE_OPTIONS));
+        pEncoder->candidates[c].level = PNG_OPTIMIZE_LEVEL;
+        pEncoder->candidates[c].memLevel = PNG_OPTIMIZE_MEM_LEVEL;
+        pEncoder->candidates[c].strategy = _optimizeStrategies[c];
+
+        for (i = 0;i < numSegments;i++) {
+            trial = &pEncoder->trials[c * numSegments + i];
+
+            memcpy(trial, &pEncoder->segments[i], sizeof(PNG_SEGMENT));
+
+            trial->options = &pEncoder->candidates[c];
+            trial->out = &pEncoder->trialOut[(c * numSegments + i) * pEncoder->outBound];
+        }
+    }
+
+    _runSegments(pEncoder->hpool, pEncoder->trials, PNG_NUM_OPTIMIZE_STRATEGIES * numSegments, _deflateSegment);
+
+    for (i = 0;i < numSegments;i++) {
+        best = NULL;
+
+        for (c = 0;c < PNG_NUM_OPTIMIZE_STRATEGIES;c++) {
+            trial = &pEncoder->trials[c * numSegments + i];
+
+            if (trial->err) {
+                fprintf(stderr, "Failed to compress PNG rows, zlib error %d\n", trial->err);
+                return -1;
+            }
+
+            if (best == NULL || trial->outLength < best->outLength) {
+                best = trial;
+            }
+        }
+
+        memcpy(&pEncoder->segments[i], best, sizeof(PNG_SEGMENT));
+    }
+
+    return 0;
+}
+
+/*
+** Compress the batch of rows on the thread pool and write them as IDAT
+** chunks, called within the caller's setjmp()...
+*/
+static int _pngwrtr_flush(HIMG himg, boolean isFinal) {
+    struct _png_encoder *   pEncoder = himg->pEncoder;
+    PNG_SEGMENT *           segment;
+    uint32_t                filteredRowLength;
+    uint32_t                numSegments;
+    uint32_t                segmentStart;
+    uint32_t                batchLength;
+    uint32_t                keepLength;
+    uint32_t                offset;
+    uint32_t                chunkLength;
+    uint32_t                i;
+
+    filteredRowLength = pEncoder->rowLength + 1;
+
+    numSegments = (pEncoder->numRows + pEncoder->rowsPerSegment - 1) / pEncoder->rowsPerSegment;
+
+    /*
+    ** An image closed before all its rows were written still
+    ** needs the end of the zlib stream...
+    */
+    if (numSegments == 0) {
+        numSegments = 1;
+    }
+
+    for (i = 0;i < numSegments;i++) {
+        segment = &pEncoder->segments[i];
+        segmentStart = i * pEncoder->rowsPerSegment;
+
+        segment->raw = &pEncoder->raw[(1 + segmentStart) * pEncoder->rowLength];
+        segment->prevRow = segment->raw - pEncoder->rowLength;
+        segment->rowLength = pEncoder->rowLength;
+        segment->numRows = pEncoder->numRows - segmentStart;
+
+        if (segment->numRows > pEncoder->rowsPerSegment) {
+            segment->numRows = pEncoder->rowsPerSegment;
+        }
+
+        if (pEncoder->numRows < segmentStart) {
+            segment->numRows = 0;
+        }
+
+        segment->filtered = &pEncoder->filtered[PNG_DICT_SIZE + segmentStart * filteredRowLength];
+        segment->scratch = &pEncoder->scratch[i * filteredRowLength];
+
+        segment->dictLength = pEncoder->dictLength + segmentStart * filteredRowLength;
+
+        if (segment->dictLength > PNG_DICT_SIZE) {
+            segment->dictLength = PNG_DICT_SIZE;
+        }
+
+        segment->dict = segment->filtered - segment->dictLength;
+
+        segment->options = &pEncoder->options;
+        segment->isFinal = (isFinal && i == (numSegments - 1)) ? True : False;
+        segment->out = &pEncoder->out[i * pEncoder->outBound];
+        segment->outBound = pEncoder->outBound;
+        segment->outOffset = (!pEncoder->isStarted && i == 0) ? PNG_ZLIB_HEADER_LENGTH : 0;
+        segment->outLength = 0;
+        segment->err = 0;
+    }
+
+    /*
+    ** Each segment is primed with the filtered rows before it, so all
+    ** the rows are filtered before any are deflated...
+    */
+    if (pEncoder->isOptimize && 
+        (pEncoder->optimizeDeadline == 0.0 || getTimeSeconds() < pEncoder->optimizeDeadline))
+    {
+        if (_searchSegments(pEncoder, numSegments)) {
+            return -1;
+        }
+    }
+    else {
+        _runSegments(pEncoder->hpool, pEncoder->segments, numSegments, _filterSegment);
+        _runSegments(pEncoder->hpool, pEncoder->segments, numSegments, _deflateSegment);
+    }
+
+    for (i = 0;i < numSegments;i++) {
+        segment = &pEncoder->segments[i];
+
+        if (segment->err) {
+            fprintf(stderr, "Failed to compress PNG rows, zlib error %d\n", segment->err);
+            return -1;
+        }
+
+        if (segment->outOffset > 0) {
+            _getZlibHeader(segment->options, segment->out);
+        }
+
+        pEncoder->adler = adler32_combine(
+                                pEncoder->adler, 
+                                segment->adler, 
+                                segment->numRows * filteredRowLength);
+
+        if (segment->isFinal) {
+            segment->out[segment->outLength++] = (uint8_t)(pEncoder->adler >> 24);
+            segment->out[segment->outLength++] = (uint8_t)(pEncoder->adler >> 16);
+            segment->out[segment->outLength++] = (uint8_t)(pEncoder->adler >> 8);
+            segment->out[segment->outLength++] = (uint8_t)(pEncoder->adler);
+        }
 
-    himg->geometry.bitsPerPixel = himg->bitDepth * himg->geometry.channels;
+        for (offset = 0;offset < segment->outLength;offset += chunkLength) {
+            chunkLength = segment->outLength - offset;
 
-    himg->type = img_png;
+            if (chunkLength > pEncoder->options.bufferSize) {
+                chunkLength = pEncoder->options.bufferSize;
+            }
 
-    if(himg->bitDepth == 16) {
-        png_set_strip_16(himg->png_ptr);
+            png_write_chunk(himg->png_ptr, (png_const_bytep)"IDAT", &segment->out[offset], chunkLength);
+        }
     }
 
-    if(himg->colourType == PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(himg->png_ptr);
-    }
+    /*
+    ** Keep the last 32K of filtered rows and the last raw row for the
+    ** next batch...
+    */
+    batchLength = pEncoder->numRows * filteredRowLength;
+    keepLength = pEncoder->dictLength + batchLength;
 
-    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-    if(himg->colourType == PNG_COLOR_TYPE_GRAY && himg->bitDepth < 8) {
-        png_set_expand_gray_1_2_4_to_8(himg->png_ptr);
+    if (keepLength > PNG_DICT_SIZE) {
+        keepLength = PNG_DICT_SIZE;
     }
 
-    if( himg->colourType == PNG_COLOR_TYPE_GRAY ||
-        himg->colourType == PNG_COLOR_TYPE_GRAY_ALPHA)
-    {
-        png_set_gray_to_rgb(himg->png_ptr);
-    }
+    memmove(
+        &pEncoder->filtered[PNG_DICT_SIZE - keepLength], 
+        &pEncoder->filtered[PNG_DICT_SIZE + batchLength - keepLength], 
+        keepLength);
 
-    png_read_update_info(himg->png_ptr, himg->info_ptr);
+    pEncoder->dictLength = keepLength;
 
-    if (himg->geometry.bitsPerPixel != 24) {
-        fprintf(stderr, "PNG image must be 24-bit RGB\n");
-        exit(-1);
+    if (pEncoder->numRows > 0) {
+        memcpy(
+            pEncoder->raw, 
+            &pEncoder->raw[pEncoder->numRows * pEncoder->rowLength], 
+            pEncoder->rowLength);
     }
-    
-    himg->rowCounter = 0;
 
-    return himg;
+    pEncoder->numRows = 0;
+    pEncoder->isStarted = True;
+    pEncoder->isFinished = isFinal;
+
+    return 0;
 }
 
 HIMG pngwrtr_open(const char * pszImageName) {
@@ -400,7 +1724,8 @@ HIMG pngwrtr_open(const char * pszImageName) {
     
     if (himg->fptr == NULL) {
         fprintf(stderr, "Could not open output image file %s: %s\n", pszImageName, strerror(errno));
-        NULL;
+        _freeHandle(himg);
+        return NULL;
     }
 
     himg->png_ptr = png_create_write_struct(
@@ -411,6 +1736,8 @@ HIMG pngwrtr_open(const char * pszImageName) {
     
     if (himg->png_ptr == NULL) {
         fprintf(stderr, "Failed to create PNG write struct\n");
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
 
@@ -419,12 +1746,20 @@ HIMG pngwrtr_open(const char * pszImageName) {
     if (himg->info_ptr == NULL) {
         png_destroy_write_struct(&himg->png_ptr, NULL);
         fprintf(stderr, "Failed to create PNG info struct\n");
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
 
-    png_init_io(himg->png_ptr, himg->fptr);
+    _setBuffer(himg);
+
+    png_set_write_fn(himg->png_ptr, himg, _pngWriteData, _pngFlushData);
 
-    png_set_compression_level(himg->png_ptr, 5);
+    png_set_compression_level(himg->png_ptr, _pngOptions.level);
+    png_set_compression_strategy(himg->png_ptr, _pngOptions.strategy);
+    png_set_compression_mem_level(himg->png_ptr, _pngOptions.memLevel);
+    png_set_compression_buffer_size(himg->png_ptr, _pngOptions.bufferSize);
+    png_set_filter(himg->png_ptr, PNG_FILTER_TYPE_BASE, _pngOptions.filters);
 
     himg->rowCounter = 0;
 
@@ -434,17 +1769,44 @@ HIMG pngwrtr_open(const char * pszImageName) {
 }
 
 void pngrdr_close(HIMG himg) {
-	png_read_end(himg->png_ptr, NULL);
+    /*
+    ** Only read the end of the image if we've read all the rows,
+    ** a streaming reader may stop early. A damaged end of image
+    ** doesn't matter, we have the pixels...
+    */
+    if (!pngrw_has_more_rows(himg)) {
+        if (!setjmp(himg->jmpbuf)) {
+            png_read_end(himg->png_ptr, NULL);
+        }
+    }
+
 	png_destroy_read_struct(&himg->png_ptr, &himg->info_ptr, NULL);
 
-    fclose(himg->fptr);
+    _closeFile(himg);
 }
 
 void pngwrtr_close(HIMG himg) {
-    png_write_end(himg->png_ptr, NULL);
+    if (!setjmp(himg->jmpbuf)) {
+        if (himg->pEncoder != NULL) {
+            /*
+            ** The IDAT chunks were written around libpng, so
+            ** end the image ourselves...
+            */
+            if (himg->pEncoder->isFinished || _pngwrtr_flush(himg, True) == 0) {
+                png_write_chunk(himg->png_ptr, (png_const_bytep)"IEND", NULL, 0);
+            }
+        }
+        else {
+            png_write_end(himg->png_ptr, NULL);
+        }
+    }
+
+    _destroyEncoder(himg->pEncoder);
+    himg->pEncoder = NULL;
+
     png_destroy_write_struct(&himg->png_ptr, &himg->info_ptr);
 
-    fclose(himg->fptr);
+    _closeFile(himg);
 }
 
 uint32_t pngrdr_get_row_buffer_len(HIMG himg) {
@@ -463,32 +1825,39 @@ boolean pngrw_has_more_rows(HIMG himg) {
     return ((himg->rowCounter < himg->geometry.height) ? True : False);
 }
 
-uint32_t pngrdr_read(HIMG himg, uint8_t * data, uint32_t dataLength) {
-    uint32_t        index = 0;
+int pngrdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
+    if (bufferLength < pngrdr_get_row_buffer_len(himg)) {
+        fprintf(stderr, "PNG row buffer is not long enough\n");
+        return -1;
+    }
 
-    himg->rowCounter = 0;
+    if (setjmp(himg->jmpbuf)) {
+        fprintf(stderr, "Failed to read PNG row %u\n", himg->rowCounter);
+        return -1;
+    }
 
-    while (pngrw_has_more_rows(himg)) {
-        if (pngrdr_read_row(himg, &data[index], (dataLength - index))) {
-            fprintf(stderr, "Failed to read row...\n");
-            exit(-1);
-        }
+    png_read_row(himg->png_ptr, rowBuffer, NULL);
 
-        index += pngrdr_get_row_buffer_len(himg);
-    }
+    himg->rowCounter++;
 
-    return index;
+    return 0;
 }
 
-int pngrdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
-    if (bufferLength < pngrdr_get_row_buffer_len(himg)) {
-        fprintf(stderr, "PNG row buffer is not long enough\n");
+int pngrdr_skip_rows(HIMG himg, uint32_t numRows) {
+    if (setjmp(himg->jmpbuf)) {
+        fprintf(stderr, "Failed to read PNG row %u\n", himg->rowCounter);
         return -1;
     }
 
-    png_read_row(himg->png_ptr, rowBuffer, NULL);
+    /*
+    ** libpng decodes the row but doesn't copy it anywhere...
+    */
+    while (numRows > 0 && pngrw_has_more_rows(himg)) {
+        png_read_row(himg->png_ptr, NULL, NULL);
 
-    himg->rowCounter++;
+        himg->rowCounter++;
+        numRows--;
+    }
 
     return 0;
 }
@@ -499,6 +1868,32 @@ int pngwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
         return -1;
     }
 
+    if (setjmp(himg->jmpbuf)) {
+        fprintf(stderr, "Failed to write PNG row %u\n", himg->rowCounter);
+        return -1;
+    }
+
+    if (himg->pEncoder != NULL) {
+        struct _png_encoder *   pEncoder = himg->pEncoder;
+
+        memcpy(
+            &pEncoder->raw[(1 + pEncoder->numRows) * pEncoder->rowLength], 
+            rowBuffer, 
+            pEncoder->rowLength);
+
+        pEncoder->numRows++;
+        himg->rowCounter++;
+
+        if (himg->rowCounter == (uint32_t)himg->geometry.height) {
+            return _pngwrtr_flush(himg, True);
+        }
+        else if (pEncoder->numRows == pEncoder->numSegments * pEncoder->rowsPerSegment) {
+            return _pngwrtr_flush(himg, False);
+        }
+
+        return 0;
+    }
+
     png_write_row(himg->png_ptr, rowBuffer);
 
     himg->rowCounter++;
@@ -507,6 +1902,11 @@ int pngwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
 }
 
 int pngwrtr_write_header(HIMG himg) {
+    if (setjmp(himg->jmpbuf)) {
+        fprintf(stderr, "Failed to write PNG header\n");
+        return -1;
+    }
+
     png_set_IHDR(
             himg->png_ptr, 
             himg->info_ptr, 
@@ -520,66 +1920,49 @@ int pngwrtr_write_header(HIMG himg) {
 
     png_write_info(himg->png_ptr, himg->info_ptr);
 
+    himg->pEncoder = _createEncoder(himg);
+
     return 0;
 }
 
-uint32_t pngwrtr_write(HIMG himg, uint8_t * data, uint32_t dataLength) {
-    uint32_t        index = 0;
-
-    himg->rowCounter = 0;
+HIMG bmprdr_open(const char * pszImageName) {
+    HIMG            himg;
 
-    while (pngrw_has_more_rows(himg)) {
-        if (pngwrtr_write_row(himg, &data[index], (dataLength - index))) {
-            fprintf(stderr, "Failed to write row...\n");
-            exit(-1);
-        }
+    himg = _openReader(pszImageName);
 
-        index += pngwrtr_get_row_buffer_len(himg);
+    if (himg == NULL) {
+        return NULL;
     }
 
-    return index;
+    return _bmprdr_start(himg, pszImageName);
 }
 
-HIMG bmprdr_open(const char * pszImageName) {
-    HIMG            himg;
+/*
+** Read the bitmap header from an open reader, the handle is freed if it
+** fails...
+*/
+static HIMG _bmprdr_start(HIMG himg, const char * pszImageName) {
     BMP_HEADER *    pHeader;
-    uint32_t        bytesRead;
-    uint32_t        dataLength;
 
     pHeader = (BMP_HEADER *)malloc(sizeof(BMP_HEADER));
 
     if (pHeader == NULL) {
         fprintf(stderr, "Failed to allocate memory for bitmap header\n");
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
 
-    himg = _allocateHandle();
-
-    if (himg == NULL) {
-        fprintf(stderr, "Failed to allocate memory for HIMG handle\n");
-        free(pHeader);
-        return NULL;
-    }
-
-    himg->fptr = fopen(pszImageName, "rb");
-    
-    if (himg->fptr == NULL) {
-        fprintf(stderr, "Could not open input image file %s: %s\n", pszImageName, strerror(errno));
-        free(pHeader);
-        free(himg);
-        exit(-1);
-    }
+    himg->pHeader = pHeader;
 
     /*
     ** Read the header...
     */
-    bytesRead = fread(pHeader, 1, sizeof(BMP_HEADER), himg->fptr);
-    
-    if (bytesRead < sizeof(BMP_HEADER)) {
-        fprintf(stderr, "Could not read header from image file %s: %s\n", pszImageName, strerror(errno));
-        free(pHeader);
-        free(himg);
-        exit(-1);
+    if (_readFile(himg, pHeader, sizeof(BMP_HEADER)) < sizeof(BMP_HEADER)) {
+        fprintf(stderr, "Could not read header from image file %s\n", pszImageName);
+        _closeFile(himg);
+        _freeHandle(himg);
+        return NULL;
     }
 
     /*
@@ -587,48 +1970,49 @@ HIMG bmprdr_open(const char * pszImageName) {
     */
     if (pHeader->bitsPerPixel != 24) {
         fprintf(stderr, "Only 24-bit uncompressed RGB bitmaps are supported\n");
-        fclose(himg->fptr);
-        free(pHeader);
-        free(himg);
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
     if (pHeader->compressionMethod != 0) {
         fprintf(stderr, "Only 24-bit uncompressed RGB bitmaps are supported\n");
-        fclose(himg->fptr);
-        free(pHeader);
-        free(himg);
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
     if (pHeader->numPaletteColours != 0) {
         fprintf(stderr, "Only 24-bit uncompressed RGB bitmaps are supported\n");
-        fclose(himg->fptr);
-        free(pHeader);
-        free(himg);
+        _closeFile(himg);
+        _freeHandle(himg);
         return NULL;
     }
 
-    dataLength = pHeader->width * 3;
-    dataLength += (dataLength % 4);
-    dataLength *= pHeader->height;
-
-    // printf(
-    //     "BMP data len (from header): %u, calculated: %u\n", 
-    //     pHeader->rawDataLength, 
-    //     dataLength);
+    if (pHeader->width <= 0 || pHeader->height == 0) {
+        fprintf(stderr, "Invalid bitmap dimensions %d x %d\n", pHeader->width, pHeader->height);
+        _closeFile(himg);
+        _freeHandle(himg);
+        return NULL;
+    }
 
-    // printf("BMP data offset: %u\n", pHeader->dataOffset);
-    
+    /*
+    ** A negative height is a top-down bitmap, the rows are read in the
+    ** order they are stored whichever way up the image is...
+    */
     himg->geometry.bitsPerPixel = pHeader->bitsPerPixel;
     himg->geometry.width = pHeader->width;
-    himg->geometry.height = pHeader->height;
+    himg->geometry.height = (pHeader->height < 0 ? -pHeader->height : pHeader->height);
     himg->type = img_win32bitmap;
-
-    himg->pHeader = pHeader;
+    himg->rowCounter = 0;
 
     /*
-    ** Position the file pointer at the start of the image data...
+    ** Position the reader at the start of the image data...
     */
-    fseek(himg->fptr, pHeader->dataOffset, SEEK_SET);
+    if (_seekFile(himg, pHeader->dataOffset)) {
+        fprintf(stderr, "Could not find the image data in %s\n", pszImageName);
+        _closeFile(himg);
+        _freeHandle(himg);
+        return NULL;
+    }
    
     return himg;
 }
@@ -658,9 +2042,12 @@ HIMG bmpwrtr_open(const char * pszImageName) {
     
     if (himg->fptr == NULL) {
         fprintf(stderr, "Could not open output image file %s: %s\n", pszImageName, strerror(errno));
+        _freeHandle(himg);
         return NULL;
     }
 
+    _setBuffer(himg);
+
     /*
     ** This should be the case anyhow, but start the image data
     ** immediately after the header...
@@ -672,42 +2059,261 @@ HIMG bmpwrtr_open(const char * pszImageName) {
     return himg;
 }
 
+/*
+** Clone the source file to the target, sharing its blocks where the
+** filesystem supports reflinks (btrfs, xfs) and otherwise letting the
+** kernel copy it. There is no fallback to copying in user space, the
+** caller is better off rewriting the image instead...
+*/
+static int _cloneFile(int sourceFd, int targetFd) {
+#ifdef __linux__
+    struct stat         st;
+    loff_t              sourceOffset = 0;
+    loff_t              targetOffset = 0;
+    ssize_t             bytesCopied;
+
+    if (fstat(sourceFd, &st) < 0) {
+        return -1;
+    }
+
+#ifdef FICLONE
+    if (ioctl(targetFd, FICLONE, sourceFd) == 0) {
+        return 0;
+    }
+#endif
+
+    while (sourceOffset < st.st_size) {
+        bytesCopied = copy_file_range(
+                            sourceFd, 
+                            &sourceOffset, 
+                            targetFd, 
+                            &targetOffset, 
+                            (size_t)(st.st_size - sourceOffset), 
+                            0);
+
+        if (bytesCopied <= 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+HIMG bmpwrtr_open_patch(HIMG source, const char * pszImageName, boolean isInPlace) {
+#ifndef _WIN32
+    HIMG            himg;
+    BMP_HEADER *    pHeader;
+
+    pHeader = (BMP_HEADER *)malloc(sizeof(BMP_HEADER));
+
+    if (pHeader == NULL) {
+        fprintf(stderr, "Failed to allocate memory for bitmap header\n");
+        return NULL;
+    }
+
+    himg = _allocateHandle();
+
+    if (himg == NULL) {
+        fprintf(stderr, "Failed to allocate memory for HIMG handle\n");
+        free(pHeader);
+        return NULL;
+    }
+
+    himg->pHeader = pHeader;
+
+    himg->fptr = fopen(pszImageName, (isInPlace ? "r+b" : "w+b"));
+    
+    if (himg->fptr == NULL) {
+        fprintf(stderr, "Could not open output image file %s: %s\n", pszImageName, strerror(errno));
+        _freeHandle(himg);
+        return NULL;
+    }
+
+    if (!isInPlace && _cloneFile(fileno(source->fptr), fileno(himg->fptr))) {
+        fclose(himg->fptr);
+        _freeHandle(himg);
+        return NULL;
+    }
+
+    /*
+    ** The header and everything else outside the pixel data is left
+    ** exactly as it is in the source...
+    */
+    memcpy(himg->pHeader, source->pHeader, sizeof(BMP_HEADER));
+    memcpy(&himg->geometry, &source->geometry, sizeof(IMG_GEOMETRY));
+
+    himg->type = img_win32bitmap;
+
+    return himg;
+#else
+    return NULL;
+#endif
+}
+
+int bmpwrtr_read_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length) {
+#ifndef _WIN32
+    off_t               fileOffset;
+    ssize_t             bytesRead;
+
+    fileOffset = (off_t)himg->pHeader->dataOffset + offset;
+
+    while (length > 0) {
+        bytesRead = pread(fileno(himg->fptr), data, length, fileOffset);
+
+        if (bytesRead <= 0) {
+            fprintf(stderr, "Failed to read BMP image data: %s\n", (bytesRead < 0 ? strerror(errno) : "unexpected end of file"));
+            return -1;
+        }
+
+        data += bytesRead;
+        length -= (uint32_t)bytesRead;
+        fileOffset += bytesRead;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int bmpwrtr_write_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length) {
+#ifndef _WIN32
+    off_t               fileOffset;
+    ssize_t             bytesWritten;
+
+    fileOffset = (off_t)himg->pHeader->dataOffset + offset;
+
+    while (length > 0) {
+        bytesWritten = pwrite(fileno(himg->fptr), data, length, fileOffset);
+
+        if (bytesWritten < 0) {
+            fprintf(stderr, "Failed to write BMP image data: %s\n", strerror(errno));
+            return -1;
+        }
+
+        data += bytesWritten;
+        length -= (uint32_t)bytesWritten;
+        fileOffset += bytesWritten;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 void bmprdr_close(HIMG himg) {
-    fclose(himg->fptr);
+    _closeFile(himg);
 }
 
 void bmpwrtr_close(HIMG himg) {
-    fclose(himg->fptr);
+    _closeFile(himg);
 }
 
-uint32_t bmprdr_get_data_length(HIMG himg) {
-    uint32_t            dataLength;
+/*
+** The file was mapped when it was opened, if it was large enough. A file
+** shorter than its header says isn't used, reading past the end of the
+** mapping would fault...
+*/
+uint8_t * bmprdr_map(HIMG himg) {
+    if (himg->map == NULL || (uint64_t)himg->mapLength < ((uint64_t)himg->pHeader->dataOffset + bmprdr_get_data_length(himg))) {
+        return NULL;
+    }
 
-    dataLength = himg->geometry.width * 3;
+    return &himg->map[himg->pHeader->dataOffset];
+}
+
+uint8_t * bmpwrtr_map(HIMG himg, uint32_t dataLength) {
+#ifndef _WIN32
+    void *              map;
+    size_t              fileLength;
+    int                 fd;
+
+    if (fflush(himg->fptr)) {
+        return NULL;
+    }
+
+    fd = fileno(himg->fptr);
+    fileLength = (size_t)himg->pHeader->dataOffset + dataLength;
 
     /*
-    ** Add padding up to a 4 byte boundry...
+    ** Reserve the blocks up front, so running out of space is an error
+    ** here rather than a fault while writing to the mapping...
     */
-    dataLength += (dataLength % 4);
-    dataLength *= himg->geometry.height;
+    if (ftruncate(fd, (off_t)fileLength) || posix_fallocate(fd, 0, (off_t)fileLength)) {
+        return NULL;
+    }
+
+    map = mmap(NULL, fileLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    madvise(map, fileLength, MADV_SEQUENTIAL);
+
+    himg->map = (uint8_t *)map;
+    himg->mapLength = fileLength;
+
+    return &himg->map[himg->pHeader->dataOffset];
+#else
+    return NULL;
+#endif
+}
 
-    return dataLength;
+uint32_t bmprdr_get_data_length(HIMG himg) {
+    return bmprdr_get_row_buffer_len(himg) * (uint32_t)himg->geometry.height;
+}
+
+/*
+** Rows are the stride of the image, padded up to a 4 byte boundary. The
+** padding is part of the row, frames have always been merged through
+** the pixel array as it is stored, padding included...
+*/
+uint32_t bmprdr_get_row_buffer_len(HIMG himg) {
+    return (((uint32_t)himg->geometry.width * 3U + 3U) & ~3U);
 }
 
-uint32_t bmprdr_read(HIMG himg, uint8_t * data, uint32_t bufferLength) {
-    uint32_t            dataLength;
-    uint32_t            bytesRead;
+int bmprdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
+    uint32_t            rowLength;
 
-    dataLength = bmprdr_get_data_length(himg);
+    rowLength = bmprdr_get_row_buffer_len(himg);
 
-    if (bufferLength < dataLength) {
-        fprintf(stderr, "Buffer must be at least %u bytes long", dataLength);
-        return 0;
+    if (bufferLength < rowLength) {
+        fprintf(stderr, "BMP row buffer is not long enough\n");
+        return -1;
     }
 
-    bytesRead = fread(data, 1, dataLength, himg->fptr);
+    if (_readFile(himg, rowBuffer, rowLength) < rowLength) {
+        fprintf(stderr, "Failed to read BMP row %u\n", himg->rowCounter);
+        return -1;
+    }
 
-    return bytesRead;
+    himg->rowCounter++;
+
+    return 0;
+}
+
+int bmprdr_skip_rows(HIMG himg, uint32_t numRows) {
+    uint32_t            row;
+
+    row = (uint32_t)himg->geometry.height;
+
+    if (numRows < row - himg->rowCounter) {
+        row = himg->rowCounter + numRows;
+    }
+
+    if (_seekFile(himg, (size_t)himg->pHeader->dataOffset + (size_t)row * bmprdr_get_row_buffer_len(himg))) {
+        fprintf(stderr, "Failed to seek to BMP row %u\n", row);
+        return -1;
+    }
+
+    himg->rowCounter = row;
+
+    return 0;
 }
 
 int bmpwrtr_write_header(HIMG himg) {
@@ -720,28 +2326,28 @@ int bmpwrtr_write_header(HIMG himg) {
 
     if (bytesWritten < sizeof(BMP_HEADER)) {
         fprintf(stderr, "Failed to write bitmap header\n");
-        free(himg->pHeader);
-        fclose(himg->fptr);
         return -1;
     }
 
-    free(himg->pHeader);
-
     return 0;
 }
 
-uint32_t bmpwrtr_write(HIMG himg, uint8_t * data, uint32_t bufferLength) {
-    uint32_t            dataLength;
-    uint32_t            bytesWritten;
+int bmpwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength) {
+    uint32_t            rowLength;
 
-    dataLength = bmprdr_get_data_length(himg);
+    rowLength = bmprdr_get_row_buffer_len(himg);
 
-    if (bufferLength < dataLength) {
-        fprintf(stderr, "Buffer must be at least %u bytes long", dataLength);
-        return 0;
+    if (bufferLength < rowLength) {
+        fprintf(stderr, "BMP row buffer is not long enough\n");
+        return -1;
+    }
+
+    if (fwrite(rowBuffer, 1, rowLength, himg->fptr) < rowLength) {
+        fprintf(stderr, "Failed to write BMP row %u\n", himg->rowCounter);
+        return -1;
     }
 
-    bytesWritten = fwrite(data, 1, dataLength, himg->fptr);
+    himg->rowCounter++;
 
-    return bytesWritten;
+    return 0;
 }
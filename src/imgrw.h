@@ -15,17 +15,49 @@ typedef enum _image_type        img_type;
 struct _img_handle;
 typedef struct _img_handle *    HIMG;
 
+/*
+** How PNG images are compressed, the zlib level, strategy and memLevel,
+** the set of PNG row filters and the size of the buffer for IDAT chunks...
+*/
+typedef struct {
+    int             level;
+    int             filters;
+    int             strategy;
+    int             memLevel;
+    uint32_t        bufferSize;
+}
+PNG_ENCODE_OPTIONS;
+
 HIMG        imgrdr_open(const char * pszImageName);
 HIMG        imgwrtr_open(const char * pszImageName, img_type type);
 void        imgrdr_close(HIMG himg);
 void        imgwrtr_close(HIMG himg);
 void        imgrdr_destroy_handle(HIMG himg);
 void        imgrdr_copy_header(HIMG target, HIMG source);
+void        imgrdr_set_trusted_input(boolean isTrusted);
+void        imgwrtr_set_size(HIMG himg, int32_t width, int32_t height);
+int         imgwrtr_get_png_profile(const char * pszProfile, PNG_ENCODE_OPTIONS * options);
+const char *imgwrtr_get_png_profile_name(int index);
+void        imgwrtr_set_png_options(const PNG_ENCODE_OPTIONS * options);
+void        imgwrtr_set_png_threads(int numThreads);
+void        imgwrtr_set_png_optimize(boolean isOptimize, double budgetSeconds);
+int         imgwrtr_parse_png_filters(const char * pszFilters);
+int         imgwrtr_parse_png_strategy(const char * pszStrategy);
 img_type    imgrdr_get_type(HIMG himg);
+uint32_t    imgrdr_get_width(HIMG himg);
 uint32_t    imgrdr_get_data_length(HIMG himg);
-uint32_t    imgrdr_read(HIMG himg, uint8_t * data, uint32_t bufferLength);
-uint32_t    imgwrtr_write(HIMG himg, uint8_t * data, uint32_t bufferLength);
+uint32_t    imgrdr_get_row_buffer_len(HIMG himg);
+boolean     imgrdr_has_more_rows(HIMG himg);
+int         imgrdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
+int         imgrdr_skip_rows(HIMG himg, uint32_t numRows);
+int         imgwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
 int         imgwrtr_write_header(HIMG himg);
+int         imgrdr_read_head(const char * pszImageName, uint8_t * buffer, uint32_t length);
+uint8_t *   imgrdr_map(HIMG himg);
+uint8_t *   imgwrtr_map(HIMG himg, uint32_t dataLength);
+HIMG        imgwrtr_open_patch(HIMG source, const char * pszImageName, boolean isInPlace);
+int         imgwrtr_read_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length);
+int         imgwrtr_write_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length);
 
 HIMG        pngrdr_open(const char * pszImageName);
 HIMG        pngwrtr_open(const char * pszImageName);
@@ -34,10 +66,9 @@ void        pngwrtr_close(HIMG himg);
 uint32_t    pngrdr_get_row_buffer_len(HIMG himg);
 uint32_t    pngrdr_get_data_length(HIMG himg);
 boolean     pngrw_has_more_rows(HIMG himg);
-uint32_t    pngrdr_read(HIMG himg, uint8_t * data, uint32_t dataLength);
 int         pngrdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
+int         pngrdr_skip_rows(HIMG himg, uint32_t numRows);
 int         pngwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
-uint32_t    pngwrtr_write(HIMG himg, uint8_t * data, uint32_t dataLength);
 int         pngwrtr_write_header(HIMG himg);
 
 HIMG        bmprdr_open(const char * pszImageName);
@@ -45,8 +76,15 @@ HIMG        bmpwrtr_open(const char * pszImageName);
 void        bmprdr_close(HIMG himg);
 void        bmpwrtr_close(HIMG himg);
 uint32_t    bmprdr_get_data_length(HIMG himg);
-uint32_t    bmprdr_read(HIMG himg, uint8_t * data, uint32_t bufferLength);
-uint32_t    bmpwrtr_write(HIMG himg, uint8_t * data, uint32_t bufferLength);
+uint32_t    bmprdr_get_row_buffer_len(HIMG himg);
+int         bmprdr_read_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
+int         bmprdr_skip_rows(HIMG himg, uint32_t numRows);
+int         bmpwrtr_write_row(HIMG himg, uint8_t * rowBuffer, uint32_t bufferLength);
 int         bmpwrtr_write_header(HIMG himg);
+uint8_t *   bmprdr_map(HIMG himg);
+uint8_t *   bmpwrtr_map(HIMG himg, uint32_t dataLength);
+HIMG        bmpwrtr_open_patch(HIMG source, const char * pszImageName, boolean isInPlace);
+int         bmpwrtr_read_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length);
+int         bmpwrtr_write_patch(HIMG himg, uint32_t offset, uint8_t * data, uint32_t length);
 
 #endif
@@ -28,13 +28,26 @@ SOFTWARE.
 #include "cloak.h"
 #include "cloak_types.h"
 #include "utils.h"
+#include "imgrw.h"
 #include "test.h"
+#include "bench.h"
+#include "probe.h"
 #include "version.h"
 
 #ifdef BUILD_GUI
 #include "gui.h"
 #endif
 
+/*
+** Default size of a pad pool created with --generate-otp --pad-pool...
+*/
+#define DEFAULT_PAD_POOL_SIZE			(64ULL * 1024ULL * 1024ULL)
+
+/*
+** Size of the random file encrypted and decrypted by --benchmark...
+*/
+#define DEFAULT_BENCHMARK_SIZE_MB		64
+
 const char * pszWarranty =
     "\n\nCopyright (c) 2023 Guy Wilson\n\n" \
 
@@ -86,22 +99,160 @@ static void printUsage(char * pszProgName) {
 	printf("Using %s:\n", &pszProgName[_getProgNameStartPos(pszProgName)]);
     printf("    %s --help (show this help)\n", &pszProgName[_getProgNameStartPos(pszProgName)]);
     printf("    %s [options] source-image\n", &pszProgName[_getProgNameStartPos(pszProgName)]);
+    printf("    %s [options] --parity=m source-image source-image...\n", &pszProgName[_getProgNameStartPos(pszProgName)]);
     printf("    options: -o [output file]\n");
-    printf("             -f [input file to cloak]\n");
+    printf("             -f [input file to cloak], give -f more than once to cloak\n");
+    printf("                an archive of files\n");
     printf("             -k [keystream file for one-time pad encryption]\n");
 	printf("             -s report image capacity then exit\n");
+	printf("             --list list the files in an archive\n");
+	printf("             --extract-member=name extract just the named file from an\n");
+	printf("                                   archive to the -o output file\n");
+	printf("             --parity=m with more than one source image, split the -f file\n");
+	printf("                        into shards with m of them parity (default 1), one\n");
+	printf("                        shard per image, written to the -o name numbered\n");
+	printf("                        1, 2... Any source images but m recover the file\n");
+	printf("             --range=offset:length extract just length bytes of the file\n");
+	printf("                                   starting at offset to the -o output file,\n");
+	printf("                                   leave out length to read to the end, both\n");
+	printf("                                   may have a K, M or G suffix\n");
+	printf("             --in-place merge into the source image itself rather than\n");
+	printf("                        writing a new -o image, for a BMP image only the\n");
+	printf("                        bytes carrying the file are written\n");
+	printf("             --png-profile=value how merged PNG images are compressed,\n");
+	printf("                                 value is 'fast', 'balanced' or 'small'\n");
+	printf("                                 (default balanced, or the --png-tune result)\n");
+	printf("             --png-level=n zlib level 0 to 9, overrides the profile\n");
+	printf("             --png-filters=list PNG row filters, a comma separated list of\n");
+	printf("                                'none', 'sub', 'up', 'avg', 'paeth' or 'all'\n");
+	printf("             --png-strategy=value zlib strategy, 'default', 'filtered',\n");
+	printf("                                  'huffman', 'rle' or 'fixed'\n");
+	printf("             --png-mem-level=n zlib memLevel 1 to 9\n");
+	printf("             --png-buffer=n size of the compression buffer, n may have\n");
+	printf("                            a K or M suffix\n");
+	printf("             --threads=n compress PNG images on n threads (default all cores),\n");
+	printf("                         1 leaves it to libpng on a single thread\n");
+	printf("             --optimize[=seconds] search filters and zlib strategies for the\n");
+	printf("                                  smallest PNG image, for up to seconds per\n");
+	printf("                                  image (default no limit)\n");
+	printf("             --trusted-input skip the CRC and zlib checksums when reading\n");
+	printf("                             PNG images, for images from a trusted source\n");
+	printf("             --verify check the hidden data against its CRC then exit, no\n");
+	printf("                      password or keystream is needed\n");
     printf("             --merge-quality=value where value is:\n");
 	printf("                       'high', 'medium', or 'low'\n");
     printf("             --algo=value where value is:\n");
 	printf("                    'aes' for AES-256 encryption (prompt for password),\n");
+	printf("                    'aes-gcm' for chunked AES-256-GCM encryption, uses all cores\n");
+	printf("                              (prompt for password),\n");
+	printf("                    'chacha20' for chunked ChaCha20-Poly1305 encryption, faster than\n");
+	printf("                               AES on hosts without AES instructions, uses all\n");
+	printf("                               cores (prompt for password),\n");
 	printf("                    'xor' for one-time pad encryption (-k is mandatory),\n");
 	printf("                    'none' for no encryption (hide only)\n");
+	printf("             --compress[=value] compress the file before it is encrypted,\n");
+	printf("                    value is 'zlib' (default) or 'zstd' if built with ZSTD=1,\n");
+	printf("                    files that look compressed already are stored as is\n");
 	printf("             --generate-otp save OTP key to file specified with -k\n");
+	printf("             --pad-pool use the -k keystream file as a pad pool, each merge\n");
+	printf("                        claims the next unused range of the pad\n");
+	printf("             --pool-size=n size of the pad generated by --generate-otp --pad-pool,\n");
+	printf("                           n may have a K, M or G suffix (default 64M)\n");
 	printf("             --interactive interactive mode, all other arguments ignored\n");
 #ifdef BUILD_GUI
 	printf("             --gui launch app on startup, all other arguments ignored\n");
 #endif
-    printf("             --test=n where n is between 1 and 18 to run the numbered test case\n\n");
+    printf("             --probe files... check each image (or each image in a directory)\n");
+    printf("                              for a cloak frame then exit, only the first\n");
+    printf("                              rows are read and all cores are used\n");
+    printf("             --benchmark[=n] time each password based algorithm on n MB\n");
+    printf("                             of random data (default 64) then exit\n");
+    printf("             --png-tune[=image] time each PNG profile on the image (or a\n");
+    printf("                                sample) and record the best for this host\n");
+    printf("             --test=n where n is between 1 and 41 to run the numbered test case\n\n");
+}
+
+static uint64_t parseSize(const char * pszSize) {
+	char *			pszSuffix;
+	uint64_t		size;
+
+	size = strtoull(pszSize, &pszSuffix, 10);
+
+	switch (toupper(*pszSuffix)) {
+		case 'K':
+			size *= 1024ULL;
+			break;
+
+		case 'M':
+			size *= 1024ULL * 1024ULL;
+			break;
+
+		case 'G':
+			size *= 1024ULL * 1024ULL * 1024ULL;
+			break;
+	}
+
+	return size;
+}
+
+/*
+** Every argument that isn't an option, or the value of -f, -k or -o,
+** is a source image...
+*/
+static char ** getSourceImages(int argc, char ** argv, int * numImages) {
+	char **			images;
+	int				i;
+
+	images = (char **)malloc(argc * sizeof(char *));
+
+	if (images == NULL) {
+		fprintf(stderr, "Failed to allocate memory for source images\n");
+		exit(-1);
+	}
+
+	*numImages = 0;
+
+	for (i = 1;i < argc;i++) {
+		if (argv[i][0] == '-') {
+			if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "-o") == 0) {
+				i++;
+			}
+		}
+		else {
+			images[(*numImages)++] = argv[i];
+		}
+	}
+
+	return images;
+}
+
+/*
+** Parse offset:length, an empty length means to the end of the file...
+*/
+static int parseRange(const char * pszRange, uint64_t * offset, uint64_t * length) {
+	const char *	pszLength;
+
+	pszLength = strchr(pszRange, ':');
+
+	if (pszLength == NULL || !isdigit(*pszRange)) {
+		return -1;
+	}
+
+	*offset = parseSize(pszRange);
+
+	pszLength++;
+
+	if (*pszLength == 0) {
+		*length = UINT64_MAX;
+	}
+	else if (isdigit(*pszLength)) {
+		*length = parseSize(pszLength);
+	}
+	else {
+		return -1;
+	}
+
+	return 0;
 }
 
 static char * promptStr(const char * pszPrompt, const size_t maxLength) {
@@ -154,18 +305,36 @@ int main(int argc, char ** argv) {
 	char *			pszKeystreamFilename = NULL;
 	char *			pszOutputFilename = NULL;
 	char *			pszSourceFilename = NULL;
+	char *			pszMemberName = NULL;
+	char **			secretFiles = NULL;
+	int				numSecretFiles = 0;
+	char **			sourceImages = NULL;
+	int				numSourceImages = 0;
+	int				numParityShards = 1;
 	char *			pszAlgorithm;
 	char *			pszQuality;
 	const uint32_t	keyBufferLen = 64U;
 	uint8_t *		key = NULL;
 	uint32_t		keyLength = 0;
-	uint32_t		otpLength = 0;
+	uint64_t		otpLength = 0;
+	uint64_t		poolSize = DEFAULT_PAD_POOL_SIZE;
+	uint64_t		rangeOffset = 0;
+	uint64_t		rangeLength = 0;
 	boolean			isMerge = False;
+	boolean			isPadPool = False;
 	boolean			isReportSize = False;
+	boolean			isVerify = False;
+	boolean			isList = False;
+	boolean			isRange = False;
+	boolean			isInPlace = False;
+	const char *	pszPNGProfile = NULL;
+	PNG_ENCODE_OPTIONS	pngOptions;
+	PNG_ENCODE_OPTIONS	pngOverrides = {-1, -1, -1, -1, 0};
 	boolean			generateOTP = False;
     boolean         isInteractive = False;
 	merge_quality	quality = quality_high;
 	encryption_algo	algo = none;
+	compression_algo	compression = compression_none;
 #ifdef BUILD_GUI
 	boolean			isGUI = False;
 #endif
@@ -188,6 +357,23 @@ int main(int argc, char ** argv) {
 
                     return test(testNum);
                 }
+                else if (strncmp(arg, "--probe", 7) == 0) {
+                    return probe(argc - i - 1, &argv[i + 1]);
+                }
+                else if (strncmp(arg, "--benchmark", 11) == 0) {
+                    if (arg[11] == '=') {
+                        return benchmark((uint32_t)atoi(&arg[12]));
+                    }
+
+                    return benchmark(DEFAULT_BENCHMARK_SIZE_MB);
+                }
+                else if (strncmp(arg, "--png-tune", 10) == 0) {
+                    if (arg[10] == '=') {
+                        return tunePNG(&arg[11]);
+                    }
+
+                    return tunePNG(NULL);
+                }
 #ifdef BUILD_GUI
                 else if (strncmp(arg, "--gui", 5) == 0) {
 					isGUI = True;
@@ -201,7 +387,13 @@ int main(int argc, char ** argv) {
                 else if (strncmp(arg, "--algo=", 7) == 0) {
                     pszAlgorithm = strdup(&arg[7]);
 
-					if (strncmp(pszAlgorithm, "aes", 3) == 0) {
+					if (strncmp(pszAlgorithm, "aes-gcm", 7) == 0) {
+						algo = aes256gcm;
+					}
+					else if (strncmp(pszAlgorithm, "chacha20", 8) == 0) {
+						algo = chacha20;
+					}
+					else if (strncmp(pszAlgorithm, "aes", 3) == 0) {
 						algo = aes256;
 					}
 					else if (strncmp(pszAlgorithm, "xor", 3) == 0) {
@@ -219,6 +411,19 @@ int main(int argc, char ** argv) {
 
 					free(pszAlgorithm);
                 }
+                else if (strncmp(arg, "--compress", 10) == 0) {
+					if (arg[10] == 0 || strcmp(&arg[10], "=zlib") == 0) {
+						compression = compression_zlib;
+					}
+					else if (strcmp(&arg[10], "=zstd") == 0) {
+						compression = compression_zstd;
+					}
+					else {
+						printf("Unrecognised compression algorithm '%s'\n", &arg[10]);
+                    	printUsage(argv[0]);
+						return -1;
+					}
+                }
                 else if (strncmp(arg, "--merge-quality=", 16) == 0) {
                     pszQuality = strdup(&arg[16]);
 
@@ -243,11 +448,138 @@ int main(int argc, char ** argv) {
 
 					free(pszQuality);
                 }
+                else if (strncmp(arg, "--verify", 8) == 0) {
+					isVerify = True;
+                }
                 else if (strncmp(arg, "--generate-otp", 14) == 0) {
 					generateOTP = True;
                 }
+                else if (strncmp(arg, "--pad-pool", 10) == 0) {
+					isPadPool = True;
+                }
+                else if (strncmp(arg, "--pool-size=", 12) == 0) {
+					poolSize = parseSize(&arg[12]);
+
+					if (poolSize == 0) {
+						printf("Invalid pad pool size '%s'\n", &arg[12]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--list", 6) == 0) {
+					isList = True;
+                }
+                else if (strncmp(arg, "--extract-member=", 17) == 0) {
+					pszMemberName = strdup(&arg[17]);
+                }
+                else if (strncmp(arg, "--parity=", 9) == 0) {
+					numParityShards = atoi(&arg[9]);
+
+					if (numParityShards < 1) {
+						printf("Invalid number of parity shards '%s'\n", &arg[9]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--range=", 8) == 0) {
+					if (parseRange(&arg[8], &rangeOffset, &rangeLength)) {
+						printf("Invalid range '%s', expected offset:length\n", &arg[8]);
+						return -1;
+					}
+
+					isRange = True;
+                }
+                else if (strncmp(arg, "--in-place", 10) == 0) {
+					isInPlace = True;
+                }
+                else if (strncmp(arg, "--png-profile=", 14) == 0) {
+					pszPNGProfile = &arg[14];
+                }
+                else if (strncmp(arg, "--png-level=", 12) == 0) {
+					pngOverrides.level = atoi(&arg[12]);
+
+					if (!isdigit(arg[12]) || pngOverrides.level > 9) {
+						printf("Invalid PNG compression level '%s'\n", &arg[12]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--png-filters=", 14) == 0) {
+					pngOverrides.filters = imgwrtr_parse_png_filters(&arg[14]);
+
+					if (pngOverrides.filters < 0) {
+						printf("Unrecognised PNG filters '%s'\n", &arg[14]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--png-strategy=", 15) == 0) {
+					pngOverrides.strategy = imgwrtr_parse_png_strategy(&arg[15]);
+
+					if (pngOverrides.strategy < 0) {
+						printf("Unrecognised zlib strategy '%s'\n", &arg[15]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--png-mem-level=", 16) == 0) {
+					pngOverrides.memLevel = atoi(&arg[16]);
+
+					if (pngOverrides.memLevel < 1 || pngOverrides.memLevel > 9) {
+						printf("Invalid zlib memLevel '%s'\n", &arg[16]);
+						return -1;
+					}
+                }
+                else if (strncmp(arg, "--png-buffer=", 13) == 0) {
+					uint64_t		bufferSize = parseSize(&arg[13]);
+
+					if (bufferSize < 256 || bufferSize > (64 * 1024 * 1024)) {
+						printf("Invalid PNG compression buffer size '%s'\n", &arg[13]);
+						return -1;
+					}
+
+					pngOverrides.bufferSize = (uint32_t)bufferSize;
+                }
+                else if (strncmp(arg, "--threads=", 10) == 0) {
+					if (!isdigit(arg[10]) || atoi(&arg[10]) < 1) {
+						printf("Invalid number of threads '%s'\n", &arg[10]);
+						return -1;
+					}
+
+					imgwrtr_set_png_threads(atoi(&arg[10]));
+                }
+                else if (strncmp(arg, "--optimize", 10) == 0) {
+					double			budgetSeconds = 0.0;
+
+					if (arg[10] == '=') {
+						budgetSeconds = atof(&arg[11]);
+
+						if (budgetSeconds <= 0.0) {
+							printf("Invalid optimize time budget '%s'\n", &arg[11]);
+							return -1;
+						}
+					}
+					else if (arg[10] != 0) {
+						printf("Invalid option %s - %s --help for help", arg, argv[0]);
+						return -1;
+					}
+
+					imgwrtr_set_png_optimize(True, budgetSeconds);
+                }
+                else if (strncmp(arg, "--trusted-input", 15) == 0) {
+					imgrdr_set_trusted_input(True);
+                }
                 else if (strncmp(arg, "-f", 2) == 0) {
-                    pszInputFilename = strdup(argv[i + 1]);
+                    /*
+                    ** More than one file is merged as an archive...
+                    */
+                    secretFiles = (char **)realloc(secretFiles, (numSecretFiles + 1) * sizeof(char *));
+
+                    if (secretFiles == NULL) {
+                        fprintf(stderr, "Failed to allocate memory for input files\n");
+                        return -1;
+                    }
+
+                    secretFiles[numSecretFiles++] = strdup(argv[i + 1]);
+
+                    if (pszInputFilename == NULL) {
+                        pszInputFilename = secretFiles[0];
+                    }
                 }
                 else if (strncmp(arg, "-k", 2) == 0) {
                     pszKeystreamFilename = strdup(argv[i + 1]);
@@ -266,6 +598,50 @@ int main(int argc, char ** argv) {
         }
     }
 
+	/*
+	** Options given on the command line override the profile...
+	*/
+	if (pszPNGProfile != NULL) {
+		if (imgwrtr_get_png_profile(pszPNGProfile, &pngOptions)) {
+			printf("Unrecognised PNG profile '%s'\n", pszPNGProfile);
+			return -1;
+		}
+	}
+	else {
+		/*
+		** A stale or hand edited tuned profile mustn't stop us
+		** running, warn and use the default...
+		*/
+		pszPNGProfile = getTunedPNGProfile();
+
+		if (pszPNGProfile != NULL && imgwrtr_get_png_profile(pszPNGProfile, &pngOptions)) {
+			fprintf(stderr, "Ignoring unrecognised tuned PNG profile '%s', using 'balanced'\n", pszPNGProfile);
+			pszPNGProfile = NULL;
+		}
+
+		if (pszPNGProfile == NULL) {
+			imgwrtr_get_png_profile("balanced", &pngOptions);
+		}
+	}
+
+	if (pngOverrides.level >= 0) {
+		pngOptions.level = pngOverrides.level;
+	}
+	if (pngOverrides.filters >= 0) {
+		pngOptions.filters = pngOverrides.filters;
+	}
+	if (pngOverrides.strategy >= 0) {
+		pngOptions.strategy = pngOverrides.strategy;
+	}
+	if (pngOverrides.memLevel >= 0) {
+		pngOptions.memLevel = pngOverrides.memLevel;
+	}
+	if (pngOverrides.bufferSize > 0) {
+		pngOptions.bufferSize = pngOverrides.bufferSize;
+	}
+
+	imgwrtr_set_png_options(&pngOptions);
+
 #ifdef BUILD_GUI
 	if (isGUI) {
 		printf("Starting GUI...\n");
@@ -390,17 +766,80 @@ int main(int argc, char ** argv) {
     }
     else {
         pszSourceFilename = strdup(argv[argc - 1]);
+        sourceImages = getSourceImages(argc, argv, &numSourceImages);
         
         if (pszInputFilename != NULL) {
             isMerge = True;
         }
+
+        if (numSourceImages > 1) {
+            if (numSecretFiles > 1) {
+                printf("An archive can't be split across several images\n");
+                return -1;
+            }
+
+            if (compression != compression_none) {
+                printf("Compression isn't supported when splitting a file across several images\n");
+                return -1;
+            }
+        }
+
+        /*
+        ** Merging in place just writes back to the source image...
+        */
+        if (isInPlace) {
+            if (!isMerge || numSourceImages > 1 || pszOutputFilename != NULL) {
+                printf("--in-place merges into a single source image, without -o\n");
+                return -1;
+            }
+
+            pszOutputFilename = strdup(pszSourceFilename);
+        }
     }
 
-	if (algo == xor) {
+	/*
+	** Images merged by this version describe themselves, so the quality
+	** and algorithm given (or defaulted) are only needed for older images...
+	*/
+	if (!isMerge && !isReportSize) {
+		/*
+		** Any of the images holding a shard will do...
+		*/
+		for (i = 0;i < numSourceImages && numSourceImages > 1;i++) {
+			if (detectFrame(sourceImages[i], &quality, &algo) == 0) {
+				break;
+			}
+		}
+
+		if ((numSourceImages > 1 && i < numSourceImages) || 
+			(numSourceImages <= 1 && detectFrame(pszSourceFilename, &quality, &algo) == 0))
+		{
+			printf(
+				"Found frame merged with %s quality, algorithm '%s'\n", 
+				getQualityName(quality), 
+				secrw_get_algo_name(algo));
+		}
+	}
+
+	if (algo == xor && !isVerify) {
 		if (pszKeystreamFilename != NULL) {
 			if (generateOTP) {
-				otpLength = getFileSizeByName(pszInputFilename);
-				generateKeystreamFile(pszKeystreamFilename, otpLength);
+				if (isPadPool) {
+					otpLength = poolSize;
+				}
+				else {
+					otpLength = getFileSizeByName(pszInputFilename);
+				}
+
+				if (generateKeystreamFile(pszKeystreamFilename, otpLength)) {
+					exit(-1);
+				}
+			}
+
+			if (isPadPool) {
+				if (secrw_create_pad_pool(pszKeystreamFilename)) {
+					exit(-1);
+				}
 			}
 		}
 		else {
@@ -428,7 +867,14 @@ int main(int argc, char ** argv) {
 		exit(-1);
     }
 
-	if (algo == aes256) {
+	/*
+	** Verification only checks the CRC, so no key is needed...
+	*/
+	if (isVerify) {
+		return verify(pszSourceFilename, quality, algo);
+	}
+
+	if (secrw_is_keyed_algo(algo)) {
 		key = (uint8_t *)malloc(keyBufferLen);
 
 		if (key == NULL) {
@@ -445,6 +891,32 @@ int main(int argc, char ** argv) {
             pszSourceFilename, 
             getImageCapacity(pszSourceFilename, quality));
 	}
+	else if (isMerge && numSourceImages > 1) {
+		mergeShards(
+			sourceImages, 
+			numSourceImages, 
+			numParityShards, 
+			pszInputFilename, 
+			pszKeystreamFilename, 
+			pszOutputFilename, 
+			quality, 
+			algo, 
+			key, 
+			keyLength);
+	}
+	else if (isMerge && numSecretFiles > 1) {
+		mergeArchive(
+			pszSourceFilename, 
+			secretFiles, 
+			numSecretFiles, 
+			pszKeystreamFilename, 
+			pszOutputFilename, 
+			quality, 
+			algo, 
+			compression, 
+			key, 
+			keyLength);
+	}
 	else if (isMerge) {
 		merge(
 			pszSourceFilename, 
@@ -453,9 +925,53 @@ int main(int argc, char ** argv) {
 			pszOutputFilename, 
 			quality, 
 			algo, 
+			compression, 
 			key, 
 			keyLength);
     }
+	else if (isList) {
+		listArchive(
+			pszSourceFilename, 
+			pszKeystreamFilename, 
+			quality, 
+			algo, 
+			key, 
+			keyLength);
+	}
+	else if (pszMemberName != NULL) {
+		extractMember(
+			pszSourceFilename, 
+			pszKeystreamFilename, 
+			pszMemberName, 
+			pszOutputFilename, 
+			quality, 
+			algo, 
+			key, 
+			keyLength);
+	}
+	else if (numSourceImages > 1) {
+		extractShards(
+			sourceImages, 
+			numSourceImages, 
+			pszKeystreamFilename, 
+			pszOutputFilename, 
+			quality, 
+			algo, 
+			key, 
+			keyLength);
+	}
+	else if (isRange) {
+		extractRange(
+			pszSourceFilename, 
+			pszKeystreamFilename, 
+			pszOutputFilename, 
+			quality, 
+			algo, 
+			key, 
+			keyLength, 
+			rangeOffset, 
+			rangeLength);
+	}
     else {
 		extract(
 			pszSourceFilename, 
@@ -467,10 +983,11 @@ int main(int argc, char ** argv) {
 			keyLength);
     }
 
-	if (algo == aes256) {
+	if (secrw_is_keyed_algo(algo)) {
 		secureFree(key, keyBufferLen);
 	}
 
+    free(sourceImages);
     free(pszSourceFilename);
     free(pszOutputFilename);
 
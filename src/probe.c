@@ -0,0 +1,278 @@
+/******************************************************************************
+Copyright (c) 2023 Guy Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cloak.h"
+#include "cloak_types.h"
+#include "secretrw.h"
+#include "imgrw.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "probe.h"
+
+/*
+** Enough image bytes for a frame header at the lowest quality
+** (high quality spreads each byte over 8 image bytes)...
+*/
+#define PROBE_HEAD_LENGTH               512
+
+/*
+** Files are probed in batches, so results are reported in order
+** while a large scan is still running...
+*/
+#define PROBE_BATCH_SIZE                4096
+
+typedef struct {
+    char *              pszFilename;
+    int                 rtn;
+    merge_quality       quality;
+    SECRW_FRAME_INFO    info;
+}
+PROBE_JOB;
+
+typedef struct {
+    char **             files;
+    uint32_t            numFiles;
+    uint32_t            capacity;
+}
+PROBE_FILE_LIST;
+
+static int _addFile(PROBE_FILE_LIST * list, const char * pszFilename) {
+    char **             files;
+
+    if (list->numFiles == list->capacity) {
+        list->capacity = (list->capacity == 0 ? PROBE_BATCH_SIZE : list->capacity * 2);
+
+        files = (char **)realloc(list->files, list->capacity * sizeof(char *));
+
+        if (files == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the list of files to probe\n");
+            return -1;
+        }
+
+        list->files = files;
+    }
+
+    list->files[list->numFiles] = strdup(pszFilename);
+
+    if (list->files[list->numFiles] == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the list of files to probe\n");
+        return -1;
+    }
+
+    list->numFiles++;
+
+    return 0;
+}
+
+static boolean _isImageFile(const char * pszFilename) {
+    const char *        pszExtension;
+
+    pszExtension = strrchr(pszFilename, '.');
+
+    if (pszExtension == NULL) {
+        return False;
+    }
+
+    return ((strcasecmp(pszExtension, ".png") == 0 || strcasecmp(pszExtension, ".bmp") == 0) ? True : False);
+}
+
+/*
+** Add the PNG and BMP files in a directory and its subdirectories...
+*/
+static int _addDirectory(PROBE_FILE_LIST * list, const char * pszDirectory) {
+    DIR *               dir;
+    struct dirent *     entry;
+    struct stat         st;
+    char *              pszPath;
+    int                 rtn = 0;
+
+    dir = opendir(pszDirectory);
+
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory %s\n", pszDirectory);
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL && rtn == 0) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        pszPath = (char *)malloc(strlen(pszDirectory) + strlen(entry->d_name) + 2);
+
+        if (pszPath == NULL) {
+            fprintf(stderr, "Failed to allocate memory for path\n");
+            rtn = -1;
+            break;
+        }
+
+        sprintf(pszPath, "%s/%s", pszDirectory, entry->d_name);
+
+        if (lstat(pszPath, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                rtn = _addDirectory(list, pszPath);
+            }
+            else if (S_ISREG(st.st_mode) && _isImageFile(pszPath)) {
+                rtn = _addFile(list, pszPath);
+            }
+        }
+
+        free(pszPath);
+    }
+
+    closedir(dir);
+
+    return rtn;
+}
+
+static void _probeFile(void * p) {
+    PROBE_JOB *         job = (PROBE_JOB *)p;
+    uint8_t             imageData[PROBE_HEAD_LENGTH];
+    int                 imageBytesRead;
+
+    imageBytesRead = imgrdr_read_head(job->pszFilename, imageData, PROBE_HEAD_LENGTH);
+
+    if (imageBytesRead < 0) {
+        job->rtn = -1;
+        return;
+    }
+
+    job->rtn = findFrameHeader(imageData, (uint32_t)imageBytesRead, &job->quality, &job->info);
+}
+
+/*
+** Check each image for a frame header, only the first rows of each image
+** are decoded and all qualities are checked from the one read. Arguments
+** may be image files or directories, which are searched recursively...
+*/
+int probe(int numArgs, char ** args) {
+    HTHREADPOOL         hpool;
+    PROBE_FILE_LIST     list = {NULL, 0, 0};
+    PROBE_JOB *         jobs;
+    struct stat         st;
+    uint32_t            batchStart;
+    uint32_t            batchLength;
+    uint32_t            numFound = 0;
+    uint32_t            numUnreadable = 0;
+    uint32_t            i;
+    int                 rtn = 0;
+
+    for (i = 0;i < (uint32_t)numArgs && rtn == 0;i++) {
+        if (stat(args[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            rtn = _addDirectory(&list, args[i]);
+        }
+        else {
+            rtn = _addFile(&list, args[i]);
+        }
+    }
+
+    if (list.numFiles == 0 || rtn) {
+        if (list.numFiles == 0 && rtn == 0) {
+            fprintf(stderr, "No image files to probe\n");
+        }
+
+        for (i = 0;i < list.numFiles;i++) {
+            free(list.files[i]);
+        }
+        free(list.files);
+
+        return -1;
+    }
+
+    jobs = (PROBE_JOB *)malloc(PROBE_BATCH_SIZE * sizeof(PROBE_JOB));
+
+    if (jobs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for probe jobs\n");
+
+        for (i = 0;i < list.numFiles;i++) {
+            free(list.files[i]);
+        }
+        free(list.files);
+
+        return -1;
+    }
+
+    hpool = tp_create(0);
+
+    for (batchStart = 0;batchStart < list.numFiles;batchStart += batchLength) {
+        batchLength = list.numFiles - batchStart;
+
+        if (batchLength > PROBE_BATCH_SIZE) {
+            batchLength = PROBE_BATCH_SIZE;
+        }
+
+        for (i = 0;i < batchLength;i++) {
+            jobs[i].pszFilename = list.files[batchStart + i];
+
+            if (hpool == NULL || tp_submit(hpool, _probeFile, &jobs[i])) {
+                _probeFile(&jobs[i]);
+            }
+        }
+
+        if (hpool != NULL) {
+            tp_wait(hpool);
+        }
+
+        for (i = 0;i < batchLength;i++) {
+            if (jobs[i].rtn == 0) {
+                printf(
+                    "%s: cloak frame, %s quality, algorithm '%s', %" PRIu64 " bytes%s%s\n", 
+                    jobs[i].pszFilename, 
+                    getQualityName(jobs[i].quality), 
+                    secrw_get_algo_name(jobs[i].info.algo), 
+                    jobs[i].info.fileLength, 
+                    (jobs[i].info.isCompressed ? " (compressed)" : ""), 
+                    (jobs[i].info.isShard ? " (erasure coded shard)" : ""));
+
+                numFound++;
+            }
+            else if (jobs[i].rtn < 0) {
+                numUnreadable++;
+            }
+
+            free(jobs[i].pszFilename);
+        }
+    }
+
+    if (hpool != NULL) {
+        tp_destroy(hpool);
+    }
+
+    printf(
+        "Probed %u files, %u with a cloak frame, %u not readable as PNG or BMP\n", 
+        list.numFiles, 
+        numFound, 
+        numUnreadable);
+
+    free(jobs);
+    free(list.files);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+#ifndef __INCL_PROBE
+#define __INCL_PROBE
+
+int probe(int numArgs, char ** args);
+
+#endif
@@ -22,16 +22,137 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
 
 #include <gcrypt.h>
 
 #include "cloak_types.h"
 #include "random_block.h"
 #include "utils.h"
+#include "threadpool.h"
+#include "compress.h"
+#include "erasure.h"
 #include "secretrw.h"
 
 #define MAX_FILE_SIZE					67108864			// 64Mb
+#define MAX_CIPHER_BLOCK_SIZE			32
+#define WRITER_BUFFER_SIZE				1048576
+#define DECRYPT_PIECE_SIZE				65536
+#define NUM_DECRYPT_PIECES				(WRITER_BUFFER_SIZE / DECRYPT_PIECE_SIZE)
+
+/*
+** AEAD frames are cut into fixed size chunks, each encrypted independently
+** with its own nonce (a random prefix plus the chunk index) and tag. The
+** frame header and a final chunk flag are authenticated with every chunk,
+** so reordered, truncated or tampered frames fail at the first bad chunk...
+*/
+#define AEAD_CHUNK_SIZE					65536
+#define AEAD_TAG_LENGTH					16
+#define AEAD_NONCE_PREFIX_LENGTH		8
+#define AEAD_NONCE_LENGTH				12
+#define AEAD_MAX_AAD_LENGTH				(sizeof(CLOAK_HEADER) + 1)
+#define AEAD_FRAME_CHUNK_SIZE			(AEAD_CHUNK_SIZE + AEAD_TAG_LENGTH)
+#define AEAD_CHUNKS_PER_BUFFER			(WRITER_BUFFER_SIZE / AEAD_FRAME_CHUNK_SIZE)
+#define MAX_KEY_LENGTH					64
+
+/*
+** Version 2 frame headers start with a magic number and describe the frame
+** fully (merge quality, algorithm, 64-bit lengths), so an image can be
+** checked for a frame and extracted without being told how it was made...
+*/
+#define CLOAK_HEADER_MAGIC				0x324B4C43			// "CLK2"
+#define CLOAK_HEADER_MAGIC_LENGTH		sizeof(uint32_t)
+#define CLOAK_HEADER_VERSION			2
+
+#define CLOAK_HEADER_FLAG_KEY_CHECK		0x01
+#define CLOAK_HEADER_FLAG_PAD_OFFSET	0x02
+#define CLOAK_HEADER_FLAG_COMPRESSED	0x04
+#define CLOAK_HEADER_FLAG_CRC			0x08
+#define CLOAK_HEADER_FLAG_ARCHIVE		0x10
+#define CLOAK_HEADER_FLAG_SHARD			0x20
+
+/*
+** Version 1 headers are still read. Their file length is never more than
+** MAX_FILE_SIZE, so the top bits of the field were used as flags...
+*/
+#define CLOAK_HEADER_V1_FLAG_KEY_CHECK		0x80000000
+#define CLOAK_HEADER_V1_FLAG_PAD_OFFSET		0x40000000
+#define CLOAK_HEADER_V1_FLAG_COMPRESSED		0x20000000
+#define CLOAK_HEADER_V1_FLAG_CRC			0x10000000
+#define CLOAK_HEADER_V1_LENGTH_MASK			0x0FFFFFFF
+
+/*
+** Frames end with a CRC32C of everything before it (as embedded in the
+** image), so damaged carriers are caught without needing the key...
+*/
+#define CRC_TRAILER_LENGTH				4
+
+/*
+** Set ID, data & parity shard counts, shard index, a reserved byte and
+** the original file length...
+*/
+#define SHARD_HEADER_LENGTH				(SECRW_SHARD_SET_ID_LENGTH + 4 + sizeof(uint64_t))
+
+/*
+** Compression is skipped when a sample from the start of the file looks
+** like it's already compressed (or encrypted), i.e. close to 8 bits/byte...
+*/
+#define ENTROPY_PROBE_LENGTH			4096
+#define ENTROPY_SKIP_THRESHOLD			7.5
+
+/*
+** A pad pool is one large keystream file with an index file alongside it,
+** each merge claims the next unused range of the pad and records it...
+*/
+#define PAD_POOL_INDEX_EXTENSION		".idx"
+#define PAD_POOL_MAX_LINE_LENGTH		64
+
+/*
+** The key check value is a truncated HMAC of a constant and the frame's
+** IV (or nonce), keyed with a subkey derived from the cipher key...
+*/
+#define KEY_CHECK_LENGTH				4
+#define KEY_CHECK_SUBKEY_LABEL			"cloak key check subkey"
+#define KEY_CHECK_LABEL					"cloak key check"
+
+typedef struct __attribute__((__packed__)) {
+	uint32_t		magic;
+	uint8_t			version;
+	uint8_t			quality;
+	uint8_t			algo;
+	uint8_t			flags;
+	uint64_t		fileLength;
+	uint64_t		dataFrameLength;
+	uint64_t		encryptionBufferLength;
+	uint64_t		padOffset;
+	uint8_t			keyCheck[KEY_CHECK_LENGTH];
+	uint32_t		headerCRC;
+}
+CLOAK_HEADER;
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t        fileLength;
+    uint32_t        dataFrameLength;
+	uint32_t		encryptionBufferLength;
+	uint8_t			padding[KEY_CHECK_LENGTH];
+}
+CLOAK_HEADER_V1;
+
+/*
+** A compressed payload starts with this header, it is encrypted along
+** with the compressed data...
+*/
+typedef struct __attribute__((__packed__)) {
+	uint8_t			algo;
+	uint8_t			reserved[3];
+	uint32_t		originalLength;
+}
+COMPRESSION_HEADER;
 
 struct _secret_rw_handle {
 	encryption_algo		algo;
@@ -45,519 +166,2491 @@ struct _secret_rw_handle {
 	uint32_t			numBlocks;
 	uint32_t			counter;
 
+	/*
+	** The plain frame header, built by the reader and parsed (from either
+	** header version) by the writer...
+	*/
+	CLOAK_HEADER		header;
+	uint32_t			frameHeaderLength;
+
+	/*
+	** Writer state, the frame header (and IV) is staged until complete,
+	** after which ciphertext is buffered, decrypted and written in chunks...
+	*/
+	uint8_t				headerBuffer[sizeof(CLOAK_HEADER) + MAX_CIPHER_BLOCK_SIZE];
+	uint32_t			headerLength;
+	uint32_t			ivLength;
+	uint8_t				iv[MAX_CIPHER_BLOCK_SIZE];
+	uint8_t *			cipherBuffer;
+	uint32_t			cipherBufferLength;
+	uint32_t			cipherBufferCapacity;
+	uint32_t			chunkCounter;
+	uint8_t				key[MAX_KEY_LENGTH];
+	uint32_t			keyLength;
+	uint32_t			cipherBlockLength;
+	uint32_t			cipherLength;
+	uint32_t			bytesWritten;
+	uint8_t *			keystream;
+	size_t				keystreamLength;
+	size_t				keystreamOffset;
+
+	char *				pszFilename;
 	FILE *				fptrSecret;
-	FILE *				fptrKey;
+
+	/*
+	** An archive's table of contents is written to memory, not a file...
+	*/
+	boolean				isArchiveTOC;
+	boolean				isShard;
+	char *				memoryBuffer;
+	size_t				memoryLength;
+
+	/*
+	** A range writer only receives the cipher units (bytes, blocks or
+	** chunks) covering the byte range, and trims the plaintext to it...
+	*/
+	boolean				isRange;
+	uint64_t			rangeOffset;
+	uint64_t			rangeLength;
+	uint32_t			rangeCipherStart;
+	uint32_t			rangeCipherEnd;
+
+	/*
+	** A compressed payload is built in memory by the reader, the writer
+	** stages the compression header then streams through a decompressor...
+	*/
+	boolean				isCompressed;
+	uint8_t *			payload;
+	uint32_t			payloadOffset;
+	uint8_t				compressionHeader[sizeof(COMPRESSION_HEADER)];
+	uint32_t			compressionHeaderLength;
+	uint32_t			originalLength;
+	HDECOMPRESS			hdcmp;
+
+	/*
+	** The reader seals the frame with its CRC trailer once it has been
+	** encrypted, the writer checks it as the frame is received...
+	*/
+	boolean				isSealed;
+	boolean				isVerifyOnly;
+	uint32_t			crc;
+	uint32_t			trailerLength;
+	uint8_t				trailer[CRC_TRAILER_LENGTH];
 
 	gcry_cipher_hd_t	cipherHandle;
+
+	/*
+	** CBC decryption is parallel, each piece of a chunk is decrypted
+	** on its own cipher handle using the preceding ciphertext block as IV...
+	*/
+	HTHREADPOOL			hpool;
+	gcry_cipher_hd_t	pieceHandles[NUM_DECRYPT_PIECES];
 };
 
-typedef struct __attribute__((__packed__)) {
-    uint32_t        fileLength;
-    uint32_t        dataFrameLength;
-	uint32_t		encryptionBufferLength;
-	uint8_t			padding[4];
+typedef struct {
+	gcry_cipher_hd_t	handle;
+	uint8_t *			out;
+	uint8_t *			in;
+	uint32_t			length;
+	uint8_t *			iv;
+	uint32_t			ivLength;
+	int					err;
 }
-CLOAK_HEADER;
+DECRYPT_PIECE;
 
+typedef struct {
+	encryption_algo		algo;
+	uint8_t *			key;
+	uint32_t			keyLength;
+	uint8_t *			noncePrefix;
+	uint8_t *			header;
+	uint32_t			headerLength;
+	uint32_t			chunkIndex;
+	boolean				isFinal;
+	uint8_t *			out;
+	uint8_t *			in;
+	uint32_t			length;
+	uint8_t *			tag;
+	boolean				isEncrypt;
+	gcry_error_t		err;
+}
+AEAD_CHUNK;
 
-HSECRW rdr_open(const char * pszFilename, encryption_algo a) {
-	HSECRW			hsec;
-	CLOAK_HEADER	header;
-	int				index = 0;
-	uint32_t		bytesRead;
+boolean secrw_is_aead_algo(encryption_algo a) {
+	return (a == aes256gcm || a == chacha20) ? True : False;
+}
 
-	hsec = (HSECRW)dbg_malloc(0x0002, sizeof(struct _secret_rw_handle), __FILE__, __LINE__);
+boolean secrw_is_keyed_algo(encryption_algo a) {
+	return (a == aes256 || secrw_is_aead_algo(a)) ? True : False;
+}
 
-	if (hsec == NULL) {
-		fprintf(stderr, "Failed to allocate memory for cloak handle\n");
-		return NULL;
+static uint32_t _aeadNumChunks(uint32_t fileLength) {
+	/*
+	** An empty file still has one (empty) authenticated chunk...
+	*/
+	if (fileLength == 0) {
+		return 1;
 	}
 
-	hsec->blockSize = SECRETRW_BLOCK_SIZE;
-	hsec->algo = a;
-	hsec->counter = 0;
-	hsec->blockCounter = 0;
+	return (fileLength + AEAD_CHUNK_SIZE - 1) / AEAD_CHUNK_SIZE;
+}
 
-	hsec->fptrKey = NULL;
+static void _aeadProcessChunk(void * p) {
+	AEAD_CHUNK *		chunk = (AEAD_CHUNK *)p;
+	gcry_cipher_hd_t	handle;
+	uint8_t				nonce[AEAD_NONCE_LENGTH];
+	uint8_t				aad[AEAD_MAX_AAD_LENGTH];
+	int					cipher = GCRY_CIPHER_AES256;
+	int					mode = GCRY_CIPHER_MODE_GCM;
 
-	hsec->fptrSecret = fopen(pszFilename, "rb");
+	/*
+	** ChaCha20-Poly1305 shares the chunk framing with GCM, the nonce
+	** and tag lengths are the same (96-bit nonce, 128-bit tag)...
+	*/
+	if (chunk->algo == chacha20) {
+		cipher = GCRY_CIPHER_CHACHA20;
+		mode = GCRY_CIPHER_MODE_POLY1305;
+	}
 
-	if (hsec->fptrSecret == NULL) {
-		fprintf(stderr, "Failed to open file reader with file %s: %s\n", pszFilename, strerror(errno));
-		return NULL;
+	memcpy(nonce, chunk->noncePrefix, AEAD_NONCE_PREFIX_LENGTH);
+	nonce[8] = (uint8_t)(chunk->chunkIndex >> 24);
+	nonce[9] = (uint8_t)(chunk->chunkIndex >> 16);
+	nonce[10] = (uint8_t)(chunk->chunkIndex >> 8);
+	nonce[11] = (uint8_t)chunk->chunkIndex;
+
+	memcpy(aad, chunk->header, chunk->headerLength);
+	aad[chunk->headerLength] = (chunk->isFinal ? 0x01 : 0x00);
+
+	chunk->err = gcry_cipher_open(&handle, cipher, mode, 0);
+
+	if (chunk->err) {
+		return;
 	}
 
-	hsec->fileLength = getFileSize(hsec->fptrSecret);
+	chunk->err = gcry_cipher_setkey(handle, chunk->key, chunk->keyLength);
 
-	if (hsec->fileLength > MAX_FILE_SIZE) {
-		fprintf(stderr, "File length %u is over the maximum allowed\n", hsec->fileLength);
-		fclose(hsec->fptrSecret);
-		return NULL;
+	if (!chunk->err) {
+		chunk->err = gcry_cipher_setiv(handle, nonce, AEAD_NONCE_LENGTH);
 	}
 
-	/*
-	** The AES-256 data frame consists of:
-	**
-	** 1. 16-byte header with filelength & datalength
-	** 2. IV block, typically 128-bit, 16 bytes
-	** 3. Encryted data n blocks long
-	*/
-	if (hsec->algo == aes256) {
-		int				err;
-		uint32_t		blklen;
-		uint8_t *		iv;
+	if (!chunk->err) {
+		chunk->err = gcry_cipher_authenticate(handle, aad, chunk->headerLength + 1);
+	}
 
-		err = gcry_cipher_open(
-							&hsec->cipherHandle,
-							GCRY_CIPHER_RIJNDAEL256,
-							GCRY_CIPHER_MODE_CBC,
-							0);
+	if (!chunk->err) {
+		if (chunk->isEncrypt) {
+			chunk->err = gcry_cipher_final(handle);
 
-		if (err) {
-			fprintf(stderr, "Failed to open cipher with gcrypt\n");
-			fclose(hsec->fptrSecret);
-			dbg_free(0x0002, hsec, __FILE__, __LINE__);
-			return NULL;
+			if (!chunk->err) {
+				chunk->err = gcry_cipher_encrypt(handle, chunk->out, chunk->length, chunk->in, chunk->length);
+			}
+			if (!chunk->err) {
+				chunk->err = gcry_cipher_gettag(handle, chunk->tag, AEAD_TAG_LENGTH);
+			}
 		}
+		else {
+			chunk->err = gcry_cipher_final(handle);
 
-		blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+			if (!chunk->err) {
+				chunk->err = gcry_cipher_decrypt(handle, chunk->out, chunk->length, chunk->in, chunk->length);
+			}
+			if (!chunk->err) {
+				chunk->err = gcry_cipher_checktag(handle, chunk->tag, AEAD_TAG_LENGTH);
+			}
+		}
+	}
 
-		iv = (uint8_t *)dbg_malloc(0x0003, blklen, __FILE__, __LINE__);
+	gcry_cipher_close(handle);
+}
 
-		if (iv == NULL) {
-			fprintf(stderr, "Failed to allocate memory for IV of size %u\n", blklen);
-			fclose(hsec->fptrSecret);
-			dbg_free(0x0002, hsec, __FILE__, __LINE__);
-			return NULL;
-		}
+/*
+** Run the chunks on a thread pool, returns the index of the first
+** chunk that failed, or -1 if all chunks succeeded...
+*/
+static int _aeadProcessChunks(HTHREADPOOL hpool, AEAD_CHUNK * chunks, uint32_t numChunks) {
+	uint32_t			i;
 
-		gcry_randomize(iv, blklen, GCRY_STRONG_RANDOM);
+	if (numChunks == 1 || hpool == NULL) {
+		for (i = 0;i < numChunks;i++) {
+			_aeadProcessChunk(&chunks[i]);
+		}
+	}
+	else {
+		for (i = 0;i < numChunks;i++) {
+			if (tp_submit(hpool, _aeadProcessChunk, &chunks[i])) {
+				_aeadProcessChunk(&chunks[i]);
+			}
+		}
 
-		err = gcry_cipher_setiv(
-							hsec->cipherHandle,
-							iv,
-							blklen);
+		tp_wait(hpool);
+	}
 
-		if (err) {
-			fprintf(stderr, "Failed to set IV with gcrypt\n");
-			dbg_free(0x0003, iv, __FILE__, __LINE__);
-			fclose(hsec->fptrSecret);
-			dbg_free(0x0002, hsec, __FILE__, __LINE__);
-			return NULL;
+	for (i = 0;i < numChunks;i++) {
+		if (chunks[i].err) {
+			return (int)i;
 		}
+	}
 
-		hsec->encryptionBufferLength = hsec->fileLength + (blklen - (hsec->fileLength % blklen)) + blklen;
-		hsec->dataFrameLength = hsec->encryptionBufferLength + sizeof(CLOAK_HEADER);
+	return -1;
+}
 
-		hsec->data = (uint8_t *)dbg_malloc(0x0004, hsec->dataFrameLength, __FILE__, __LINE__);
 
-		if (hsec->data == NULL) {
-			fprintf(stderr, "Failed to allocate memory for data of size %u\n", hsec->dataFrameLength);
-			dbg_free(0x0003, iv, __FILE__, __LINE__);
-			fclose(hsec->fptrSecret);
-			dbg_free(0x0002, hsec, __FILE__, __LINE__);
-			return NULL;
-		}
+static int _hmacSHA256(uint8_t * key, uint32_t keyLength, const void * data1, size_t data1Length, const void * data2, size_t data2Length, uint8_t * mac) {
+	gcry_mac_hd_t		handle;
+	size_t				macLength = 32;
+	gcry_error_t		err;
 
-		header.fileLength = hsec->fileLength;
-		header.dataFrameLength = hsec->dataFrameLength;
-		header.encryptionBufferLength = hsec->encryptionBufferLength;
+	err = gcry_mac_open(&handle, GCRY_MAC_HMAC_SHA256, 0, NULL);
 
-		/*
-		** XOR the header with random data...
-		*/
-		memcpy(&hsec->data[index], &header, sizeof(CLOAK_HEADER));
-		xorBuffer(&hsec->data[index], &random_block[2048], sizeof(CLOAK_HEADER));
+	if (err) {
+		fprintf(stderr, "Failed to open HMAC with gcrypt: %s\n", gcry_strerror(err));
+		return -1;
+	}
 
-		index += sizeof(CLOAK_HEADER);
+	err = gcry_mac_setkey(handle, key, keyLength);
 
-		memcpy(&hsec->data[index], iv, blklen);
-		index += blklen;
+	if (!err) {
+		err = gcry_mac_write(handle, data1, data1Length);
+	}
+	if (!err && data2 != NULL) {
+		err = gcry_mac_write(handle, data2, data2Length);
+	}
+	if (!err) {
+		err = gcry_mac_read(handle, mac, &macLength);
+	}
 
-		dbg_free(0x0003, iv, __FILE__, __LINE__);
+	gcry_mac_close(handle);
 
-		bytesRead = fread(&hsec->data[index], 1, hsec->fileLength, hsec->fptrSecret);
+	if (err) {
+		fprintf(stderr, "Failed to calculate HMAC with gcrypt: %s\n", gcry_strerror(err));
+		return -1;
+	}
 
-		if (bytesRead < hsec->fileLength) {
-			fprintf(stderr, "Failed to read file %s, expected %u bytes, got %u bytes\n", pszFilename, hsec->fileLength, bytesRead);
-			fclose(hsec->fptrSecret);
-			dbg_free(0x0004, hsec->data, __FILE__, __LINE__);
-			dbg_free(0x0002, hsec, __FILE__, __LINE__);
-			return NULL;
-		}
+	return 0;
+}
 
-		fclose(hsec->fptrSecret);
-		hsec->fptrSecret = NULL;
+static int _getKeyCheckValue(uint8_t * key, uint32_t keyLength, uint8_t * salt, uint32_t saltLength, uint8_t * keyCheck) {
+	uint8_t				subkey[32];
+	uint8_t				mac[32];
 
-		/*
-		** Fill any remaining bytes with random data...
-		*/
-		memcpy(
-			&hsec->data[index + hsec->fileLength], 
-			random_block, 
-			(hsec->dataFrameLength - hsec->fileLength - index));
+	if (_hmacSHA256(key, keyLength, KEY_CHECK_SUBKEY_LABEL, strlen(KEY_CHECK_SUBKEY_LABEL), NULL, 0, subkey)) {
+		return -1;
 	}
-	else if (hsec->algo == xor || hsec->algo == none) {
-		hsec->encryptionBufferLength = hsec->fileLength + sizeof(CLOAK_HEADER);
-		hsec->dataFrameLength = hsec->encryptionBufferLength;
-		
-		hsec->data = (uint8_t *)malloc(hsec->dataFrameLength);
 
-		if (hsec->data == NULL) {
-			fprintf(stderr, "Failed to allocate memory for data of size %u\n", hsec->dataFrameLength);
-			fclose(hsec->fptrSecret);
-			free(hsec);
-			return NULL;
+	if (_hmacSHA256(subkey, sizeof(subkey), KEY_CHECK_LABEL, strlen(KEY_CHECK_LABEL), salt, saltLength, mac)) {
+		wipeBuffer(subkey, sizeof(subkey));
+		return -1;
+	}
+
+	memcpy(keyCheck, mac, KEY_CHECK_LENGTH);
+
+	wipeBuffer(subkey, sizeof(subkey));
+	wipeBuffer(mac, sizeof(mac));
+
+	return 0;
+}
+
+static uint32_t _getHeaderCRC(CLOAK_HEADER * header) {
+	return crc32c(0, (uint8_t *)header, offsetof(CLOAK_HEADER, headerCRC));
+}
+
+/*
+** Write the header to the start of the frame (XOR'd with random data),
+** the plain header is kept in the handle as it is authenticated by
+** AEAD algorithms...
+*/
+static void _rdr_write_header(HSECRW hsec) {
+	hsec->header.headerCRC = _getHeaderCRC(&hsec->header);
+
+	memcpy(hsec->headerBuffer, &hsec->header, sizeof(CLOAK_HEADER));
+
+	memcpy(hsec->data, &hsec->header, sizeof(CLOAK_HEADER));
+	xorBuffer(hsec->data, &random_block[2048], sizeof(CLOAK_HEADER));
+}
+
+static int _rdr_set_key_check(HSECRW hsec, uint8_t * key, uint32_t keyLength, uint8_t * salt, uint32_t saltLength) {
+	if (_getKeyCheckValue(key, keyLength, salt, saltLength, hsec->header.keyCheck)) {
+		return -1;
+	}
+
+	hsec->header.flags |= CLOAK_HEADER_FLAG_KEY_CHECK;
+
+	_rdr_write_header(hsec);
+
+	return 0;
+}
+
+const char * secrw_get_algo_name(encryption_algo a) {
+	switch (a) {
+		case xor:
+			return "xor";
+
+		case aes256:
+			return "aes";
+
+		case none:
+			return "none";
+
+		case aes256gcm:
+			return "aes-gcm";
+
+		case chacha20:
+			return "chacha20";
+	}
+
+	return "unknown";
+}
+
+uint32_t secrw_get_header_length(void) {
+	return sizeof(CLOAK_HEADER);
+}
+
+/*
+** Returns 0 and fills in info if frame starts with a valid version 2
+** header, 1 if it doesn't (e.g. wrong quality, or an old frame)...
+*/
+int secrw_read_frame_info(const uint8_t * frame, uint32_t frameLength, SECRW_FRAME_INFO * info) {
+	CLOAK_HEADER		header;
+
+	if (frameLength < sizeof(CLOAK_HEADER)) {
+		return 1;
+	}
+
+	memcpy(&header, frame, sizeof(CLOAK_HEADER));
+	xorBuffer((uint8_t *)&header, &random_block[2048], sizeof(CLOAK_HEADER));
+
+	if (header.magic != CLOAK_HEADER_MAGIC || header.headerCRC != _getHeaderCRC(&header)) {
+		return 1;
+	}
+
+	info->version = header.version;
+	info->quality = header.quality;
+	info->algo = (encryption_algo)header.algo;
+	info->fileLength = header.fileLength;
+	info->dataFrameLength = header.dataFrameLength;
+	info->isCompressed = ((header.flags & CLOAK_HEADER_FLAG_COMPRESSED) ? True : False);
+	info->isArchive = ((header.flags & CLOAK_HEADER_FLAG_ARCHIVE) ? True : False);
+	info->isShard = ((header.flags & CLOAK_HEADER_FLAG_SHARD) ? True : False);
+
+	return 0;
+}
+
+static char * _getPadPoolIndexName(const char * pszPadFilename) {
+	char *			pszIndexFilename;
+
+	pszIndexFilename = (char *)malloc(strlen(pszPadFilename) + strlen(PAD_POOL_INDEX_EXTENSION) + 1);
+
+	if (pszIndexFilename != NULL) {
+		strcpy(pszIndexFilename, pszPadFilename);
+		strcat(pszIndexFilename, PAD_POOL_INDEX_EXTENSION);
+	}
+
+	return pszIndexFilename;
+}
+
+/*
+** Atomically claim the next unused range of a pad pool. The index file
+** holds one 'offset length' line per claim and is locked for the whole
+** read-modify-write. Returns 1 if the keystream file isn't a pad pool...
+*/
+static int _claimPadRange(const char * pszPadFilename, size_t padLength, uint32_t length, uint64_t * offset) {
+	char *			pszIndexFilename;
+	char			szLine[PAD_POOL_MAX_LINE_LENGTH];
+	FILE *			fptrIndex;
+	uint64_t		claimOffset;
+	uint64_t		nextOffset = 0;
+	uint32_t		claimLength;
+	int				fd;
+
+	pszIndexFilename = _getPadPoolIndexName(pszPadFilename);
+
+	if (pszIndexFilename == NULL) {
+		fprintf(stderr, "Failed to allocate memory for pad pool index name\n");
+		return -1;
+	}
+
+	fd = open(pszIndexFilename, O_RDWR);
+
+	if (fd < 0) {
+		free(pszIndexFilename);
+		return (errno == ENOENT ? 1 : -1);
+	}
+
+	if (flock(fd, LOCK_EX)) {
+		fprintf(stderr, "Failed to lock pad pool index %s: %s\n", pszIndexFilename, strerror(errno));
+		close(fd);
+		free(pszIndexFilename);
+		return -1;
+	}
+
+	fptrIndex = fdopen(fd, "r+");
+
+	if (fptrIndex == NULL) {
+		fprintf(stderr, "Failed to open pad pool index %s: %s\n", pszIndexFilename, strerror(errno));
+		close(fd);
+		free(pszIndexFilename);
+		return -1;
+	}
+
+	while (fgets(szLine, PAD_POOL_MAX_LINE_LENGTH, fptrIndex) != NULL) {
+		if (sscanf(szLine, "%" SCNu64 " %" SCNu32, &claimOffset, &claimLength) == 2) {
+			if ((claimOffset + claimLength) > nextOffset) {
+				nextOffset = claimOffset + claimLength;
+			}
 		}
+	}
 
-		header.fileLength = hsec->fileLength;
-		header.dataFrameLength = hsec->dataFrameLength;
-		header.encryptionBufferLength = hsec->encryptionBufferLength;
+	if ((nextOffset + length) > padLength) {
+		fprintf(
+			stderr, 
+			"Pad pool %s is exhausted, %u bytes needed but only %" PRIu64 " bytes remain\n", 
+			pszPadFilename, 
+			length, 
+			(nextOffset < padLength ? (uint64_t)padLength - nextOffset : 0));
 
-		/*
-		** XOR the header with random data...
-		*/
-		memcpy(&hsec->data[index], &header, sizeof(CLOAK_HEADER));
-		xorBuffer(&hsec->data[index], &random_block[2048], sizeof(CLOAK_HEADER));
+		fclose(fptrIndex);
+		free(pszIndexFilename);
+		return -1;
+	}
 
-		index += sizeof(CLOAK_HEADER);
+	fseek(fptrIndex, 0L, SEEK_END);
+	fprintf(fptrIndex, "%" PRIu64 " %" PRIu32 "\n", nextOffset, length);
+	fflush(fptrIndex);
+	fsync(fd);
+
+	/*
+	** Closing the file releases the lock...
+	*/
+	fclose(fptrIndex);
+	free(pszIndexFilename);
+
+	*offset = nextOffset;
+
+	return 0;
+}
+
+int secrw_create_pad_pool(const char * pszPadFilename) {
+	char *			pszIndexFilename;
+	int				fd;
+
+	pszIndexFilename = _getPadPoolIndexName(pszPadFilename);
+
+	if (pszIndexFilename == NULL) {
+		fprintf(stderr, "Failed to allocate memory for pad pool index name\n");
+		return -1;
+	}
+
+	fd = open(pszIndexFilename, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create pad pool index %s: %s\n", pszIndexFilename, strerror(errno));
+		free(pszIndexFilename);
+		return -1;
+	}
+
+	close(fd);
+	free(pszIndexFilename);
+
+	return 0;
+}
+
+boolean secrw_is_pad_pool(const char * pszPadFilename) {
+	char *			pszIndexFilename;
+	boolean			isPadPool;
+
+	pszIndexFilename = _getPadPoolIndexName(pszPadFilename);
+
+	if (pszIndexFilename == NULL) {
+		return False;
+	}
+
+	isPadPool = (access(pszIndexFilename, F_OK) == 0 ? True : False);
+
+	free(pszIndexFilename);
+
+	return isPadPool;
+}
+
+/*
+** Compress the whole file into the payload buffer, unless the entropy
+** probe says it won't compress or the result is no smaller...
+*/
+static int _rdr_compress(HSECRW hsec, const char * pszFilename, compression_algo c) {
+	COMPRESSION_HEADER	compressionHeader;
+	uint8_t *			input;
+	uint8_t *			payload;
+	size_t				inputLength;
+	uint32_t			payloadLength;
+	double				entropy;
+
+	if (!cmp_is_available(c)) {
+		fprintf(stderr, "Compression algorithm '%s' is not available in this build\n", cmp_get_name(c));
+		return -1;
+	}
+
+	if (hsec->fileLength == 0) {
+		return 0;
+	}
+
+	input = mapFile(pszFilename, &inputLength);
+
+	if (input == NULL) {
+		fprintf(stderr, "Failed to map file %s\n", pszFilename);
+		return -1;
+	}
+
+	entropy = cmp_get_entropy(
+					input, 
+					(hsec->fileLength < ENTROPY_PROBE_LENGTH ? hsec->fileLength : ENTROPY_PROBE_LENGTH));
+
+	if (entropy > ENTROPY_SKIP_THRESHOLD) {
+		printf("File %s looks compressed already (%.2f bits/byte), skipping compression\n", pszFilename, entropy);
+		unmapFile(input, inputLength);
+		return 0;
+	}
+
+	if (cmp_compress(c, input, hsec->fileLength, sizeof(COMPRESSION_HEADER), &payload, &payloadLength)) {
+		unmapFile(input, inputLength);
+		return -1;
+	}
+
+	unmapFile(input, inputLength);
+
+	if (payloadLength >= hsec->fileLength) {
+		printf("File %s does not compress, storing it uncompressed\n", pszFilename);
+		free(payload);
+		return 0;
+	}
+
+	compressionHeader.algo = (uint8_t)c;
+	memset(compressionHeader.reserved, 0, sizeof(compressionHeader.reserved));
+	compressionHeader.originalLength = hsec->fileLength;
+
+	memcpy(payload, &compressionHeader, sizeof(COMPRESSION_HEADER));
+
+	printf(
+		"Compressed %s with %s from %u to %u bytes\n", 
+		pszFilename, 
+		cmp_get_name(c), 
+		hsec->fileLength, 
+		payloadLength);
+
+	hsec->payload = payload;
+	hsec->fileLength = payloadLength;
+	hsec->isCompressed = True;
+
+	return 0;
+}
+
+/*
+** Read the next length bytes of the payload, from the compressed
+** payload buffer if we have one, otherwise straight from the file...
+*/
+static uint32_t _rdr_read_payload(HSECRW hsec, uint8_t * buffer, uint32_t length) {
+	if (hsec->payload != NULL) {
+		memcpy(buffer, &hsec->payload[hsec->payloadOffset], length);
+		hsec->payloadOffset += length;
+
+		return length;
+	}
+
+	return fread(buffer, 1, length, hsec->fptrSecret);
+}
+
+static void _rdr_seal_frame(HSECRW hsec) {
+	uint32_t			crc;
+
+	crc = crc32c(0, hsec->data, hsec->dataFrameLength - CRC_TRAILER_LENGTH);
+	memcpy(&hsec->data[hsec->dataFrameLength - CRC_TRAILER_LENGTH], &crc, CRC_TRAILER_LENGTH);
+
+	hsec->isSealed = True;
+}
+
+static void _rdr_close_secret(HSECRW hsec) {
+	if (hsec->fptrSecret != NULL) {
+		fclose(hsec->fptrSecret);
+		hsec->fptrSecret = NULL;
+	}
+}
+
+static HSECRW _rdr_create(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = (HSECRW)dbg_malloc(0x0002, sizeof(struct _secret_rw_handle), __FILE__, __LINE__);
+
+	if (hsec == NULL) {
+		fprintf(stderr, "Failed to allocate memory for cloak handle\n");
+		return NULL;
+	}
+
+	hsec->blockSize = SECRETRW_BLOCK_SIZE;
+	hsec->algo = a;
+	hsec->counter = 0;
+	hsec->blockCounter = 0;
+	hsec->isCompressed = False;
+	hsec->payload = NULL;
+	hsec->payloadOffset = 0;
+	hsec->isSealed = False;
+	hsec->fptrSecret = NULL;
+	hsec->cipherHandle = NULL;
+
+	return hsec;
+}
+
+/*
+** Build the data frame around the payload, either read from the open
+** secret file or from the payload buffer...
+*/
+static HSECRW _rdr_build_frame(HSECRW hsec, const char * pszFilename, uint8_t quality, uint8_t flags) {
+	int				index = 0;
+	uint32_t		bytesRead;
+
+	memset(&hsec->header, 0, sizeof(CLOAK_HEADER));
+
+	hsec->header.magic = CLOAK_HEADER_MAGIC;
+	hsec->header.version = CLOAK_HEADER_VERSION;
+	hsec->header.quality = quality;
+	hsec->header.algo = (uint8_t)hsec->algo;
+	hsec->header.flags = flags | CLOAK_HEADER_FLAG_CRC | (hsec->isCompressed ? CLOAK_HEADER_FLAG_COMPRESSED : 0);
+	hsec->header.fileLength = hsec->fileLength;
+
+	/*
+	** The AES-256 data frame consists of:
+	**
+	** 1. 48-byte header with magic, version, quality, algo & lengths
+	** 2. IV block, typically 128-bit, 16 bytes
+	** 3. Encryted data n blocks long
+	*/
+	if (hsec->algo == aes256) {
+		int				err;
+		uint32_t		blklen;
+		uint8_t *		iv;
+
+		err = gcry_cipher_open(
+							&hsec->cipherHandle,
+							GCRY_CIPHER_RIJNDAEL256,
+							GCRY_CIPHER_MODE_CBC,
+							0);
+
+		if (err) {
+			fprintf(stderr, "Failed to open cipher with gcrypt\n");
+			_rdr_close_secret(hsec);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+
+		blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+
+		iv = (uint8_t *)dbg_malloc(0x0003, blklen, __FILE__, __LINE__);
+
+		if (iv == NULL) {
+			fprintf(stderr, "Failed to allocate memory for IV of size %u\n", blklen);
+			_rdr_close_secret(hsec);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+
+		gcry_randomize(iv, blklen, GCRY_STRONG_RANDOM);
+
+		err = gcry_cipher_setiv(
+							hsec->cipherHandle,
+							iv,
+							blklen);
+
+		if (err) {
+			fprintf(stderr, "Failed to set IV with gcrypt\n");
+			dbg_free(0x0003, iv, __FILE__, __LINE__);
+			_rdr_close_secret(hsec);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+
+		hsec->encryptionBufferLength = hsec->fileLength + (blklen - (hsec->fileLength % blklen)) + blklen;
+		hsec->dataFrameLength = hsec->encryptionBufferLength + sizeof(CLOAK_HEADER) + CRC_TRAILER_LENGTH;
+
+		hsec->data = (uint8_t *)dbg_malloc(0x0004, hsec->dataFrameLength, __FILE__, __LINE__);
+
+		if (hsec->data == NULL) {
+			fprintf(stderr, "Failed to allocate memory for data of size %u\n", hsec->dataFrameLength);
+			dbg_free(0x0003, iv, __FILE__, __LINE__);
+			_rdr_close_secret(hsec);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+
+		hsec->header.dataFrameLength = hsec->dataFrameLength;
+		hsec->header.encryptionBufferLength = hsec->encryptionBufferLength;
+
+		_rdr_write_header(hsec);
+
+		index += sizeof(CLOAK_HEADER);
+
+		memcpy(&hsec->data[index], iv, blklen);
+		index += blklen;
+
+		dbg_free(0x0003, iv, __FILE__, __LINE__);
+
+		bytesRead = _rdr_read_payload(hsec, &hsec->data[index], hsec->fileLength);
+
+		if (bytesRead < hsec->fileLength) {
+			fprintf(stderr, "Failed to read file %s, expected %u bytes, got %u bytes\n", pszFilename, hsec->fileLength, bytesRead);
+			_rdr_close_secret(hsec);
+			dbg_free(0x0004, hsec->data, __FILE__, __LINE__);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+
+		_rdr_close_secret(hsec);
+
+		/*
+		** Fill any remaining bytes with random data...
+		*/
+		memcpy(
+			&hsec->data[index + hsec->fileLength], 
+			random_block, 
+			(hsec->dataFrameLength - hsec->fileLength - index));
+	}
+	/*
+	** The AEAD data frame consists of:
+	**
+	** 1. 48-byte header with magic, version, quality, algo & lengths
+	** 2. 8-byte random nonce prefix
+	** 3. The file in chunks of AEAD_CHUNK_SIZE bytes, each followed
+	**    by its authentication tag
+	*/
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		uint32_t		numChunks;
+		uint32_t		chunkLength;
+		uint32_t		i;
+
+		numChunks = _aeadNumChunks(hsec->fileLength);
+
+		hsec->encryptionBufferLength = 
+						AEAD_NONCE_PREFIX_LENGTH + 
+						hsec->fileLength + 
+						(numChunks * AEAD_TAG_LENGTH);
+		hsec->dataFrameLength = hsec->encryptionBufferLength + sizeof(CLOAK_HEADER) + CRC_TRAILER_LENGTH;
+
+		hsec->data = (uint8_t *)malloc(hsec->dataFrameLength);
+
+		if (hsec->data == NULL) {
+			fprintf(stderr, "Failed to allocate memory for data of size %u\n", hsec->dataFrameLength);
+			_rdr_close_secret(hsec);
+			free(hsec);
+			return NULL;
+		}
+
+		hsec->header.dataFrameLength = hsec->dataFrameLength;
+		hsec->header.encryptionBufferLength = hsec->encryptionBufferLength;
+
+		_rdr_write_header(hsec);
+
+		index += sizeof(CLOAK_HEADER);
+
+		gcry_create_nonce(hsec->iv, AEAD_NONCE_PREFIX_LENGTH);
+		memcpy(&hsec->data[index], hsec->iv, AEAD_NONCE_PREFIX_LENGTH);
+
+		index += AEAD_NONCE_PREFIX_LENGTH;
+
+		for (i = 0;i < numChunks;i++) {
+			chunkLength = hsec->fileLength - (i * AEAD_CHUNK_SIZE);
+
+			if (chunkLength > AEAD_CHUNK_SIZE) {
+				chunkLength = AEAD_CHUNK_SIZE;
+			}
+
+			bytesRead = _rdr_read_payload(hsec, &hsec->data[index], chunkLength);
+
+			if (bytesRead < chunkLength) {
+				fprintf(stderr, "Failed to read file %s, expected %u bytes, got %u bytes\n", pszFilename, chunkLength, bytesRead);
+				_rdr_close_secret(hsec);
+				free(hsec->data);
+				free(hsec);
+				return NULL;
+			}
+
+			/*
+			** Leave room for the tag...
+			*/
+			index += chunkLength + AEAD_TAG_LENGTH;
+		}
+
+		_rdr_close_secret(hsec);
+	}
+	else if (hsec->algo == xor || hsec->algo == none) {
+		hsec->encryptionBufferLength = hsec->fileLength + sizeof(CLOAK_HEADER);
+		hsec->dataFrameLength = hsec->encryptionBufferLength + CRC_TRAILER_LENGTH;
+		
+		hsec->data = (uint8_t *)malloc(hsec->dataFrameLength);
+
+		if (hsec->data == NULL) {
+			fprintf(stderr, "Failed to allocate memory for data of size %u\n", hsec->dataFrameLength);
+			_rdr_close_secret(hsec);
+			free(hsec);
+			return NULL;
+		}
+
+		hsec->header.dataFrameLength = hsec->dataFrameLength;
+		hsec->header.encryptionBufferLength = hsec->encryptionBufferLength;
+
+		_rdr_write_header(hsec);
+
+		index += sizeof(CLOAK_HEADER);
+
+		bytesRead = _rdr_read_payload(hsec, &hsec->data[index], hsec->fileLength);
+
+		if (bytesRead < hsec->fileLength) {
+			fprintf(stderr, "Failed to read file %s, expected %u bytes, got %u bytes\n", pszFilename, hsec->fileLength, bytesRead);
+			_rdr_close_secret(hsec);
+			free(hsec->data);
+			free(hsec);
+			return NULL;
+		}
+
+		_rdr_close_secret(hsec);
+	}
+
+	return hsec;
+}
+
+/*
+** The archive table of contents is the payload of the first frame, a
+** member count followed by each member's name, length and where its own
+** frame sits, relative to the end of the table of contents frame...
+*/
+static uint8_t * _encodeArchiveTOC(SECRW_ARCHIVE_MEMBER * members, uint32_t numMembers, uint32_t * tocLength) {
+	uint8_t *			toc;
+	uint32_t			length = sizeof(uint32_t);
+	uint32_t			index = 0;
+	uint32_t			i;
+	uint16_t			nameLength;
+
+	for (i = 0;i < numMembers;i++) {
+		length += sizeof(uint16_t) + strlen(members[i].szName) + (3 * sizeof(uint64_t));
+	}
+
+	toc = (uint8_t *)malloc(length);
+
+	if (toc == NULL) {
+		fprintf(stderr, "Failed to allocate memory for the archive table of contents\n");
+		return NULL;
+	}
+
+	memcpy(&toc[index], &numMembers, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+
+	for (i = 0;i < numMembers;i++) {
+		nameLength = (uint16_t)strlen(members[i].szName);
+
+		memcpy(&toc[index], &nameLength, sizeof(uint16_t));
+		index += sizeof(uint16_t);
+		memcpy(&toc[index], members[i].szName, nameLength);
+		index += nameLength;
+		memcpy(&toc[index], &members[i].fileLength, sizeof(uint64_t));
+		index += sizeof(uint64_t);
+		memcpy(&toc[index], &members[i].frameOffset, sizeof(uint64_t));
+		index += sizeof(uint64_t);
+		memcpy(&toc[index], &members[i].frameLength, sizeof(uint64_t));
+		index += sizeof(uint64_t);
+	}
+
+	*tocLength = length;
+
+	return toc;
+}
+
+static SECRW_ARCHIVE_MEMBER * _decodeArchiveTOC(const uint8_t * toc, size_t tocLength, uint32_t * numMembers) {
+	SECRW_ARCHIVE_MEMBER *	members;
+	uint32_t				count;
+	size_t					index = 0;
+	uint32_t				i;
+	uint16_t				nameLength;
+
+	if (tocLength < sizeof(uint32_t)) {
+		fprintf(stderr, "Archive table of contents is truncated\n");
+		return NULL;
+	}
+
+	memcpy(&count, toc, sizeof(uint32_t));
+	index += sizeof(uint32_t);
+
+	if (count > SECRW_MAX_ARCHIVE_MEMBERS) {
+		fprintf(stderr, "Archive table of contents has too many members (%u)\n", count);
+		return NULL;
+	}
+
+	members = (SECRW_ARCHIVE_MEMBER *)calloc(count > 0 ? count : 1, sizeof(SECRW_ARCHIVE_MEMBER));
+
+	if (members == NULL) {
+		fprintf(stderr, "Failed to allocate memory for the archive table of contents\n");
+		return NULL;
+	}
+
+	for (i = 0;i < count;i++) {
+		if ((tocLength - index) < sizeof(uint16_t)) {
+			break;
+		}
+
+		memcpy(&nameLength, &toc[index], sizeof(uint16_t));
+		index += sizeof(uint16_t);
+
+		if (nameLength > SECRW_MAX_MEMBER_NAME_LENGTH || (tocLength - index) < (nameLength + (3 * sizeof(uint64_t)))) {
+			break;
+		}
+
+		memcpy(members[i].szName, &toc[index], nameLength);
+		members[i].szName[nameLength] = 0;
+		index += nameLength;
+		memcpy(&members[i].fileLength, &toc[index], sizeof(uint64_t));
+		index += sizeof(uint64_t);
+		memcpy(&members[i].frameOffset, &toc[index], sizeof(uint64_t));
+		index += sizeof(uint64_t);
+		memcpy(&members[i].frameLength, &toc[index], sizeof(uint64_t));
+		index += sizeof(uint64_t);
+	}
+
+	if (i < count) {
+		fprintf(stderr, "Archive table of contents is truncated\n");
+		free(members);
+		return NULL;
+	}
+
+	*numMembers = count;
+
+	return members;
+}
+
+/*
+** A shard frame's payload is the set it belongs to, its place in the set
+** and the original file length, followed by the shard itself...
+*/
+static uint8_t * _encodeShard(const SECRW_SHARD * shard, const uint8_t * shardData, uint32_t * payloadLength) {
+	uint8_t *			payload;
+	uint32_t			index = 0;
+
+	payload = (uint8_t *)malloc(SHARD_HEADER_LENGTH + shard->shardLength);
+
+	if (payload == NULL) {
+		fprintf(stderr, "Failed to allocate memory for shard\n");
+		return NULL;
+	}
+
+	memcpy(&payload[index], shard->setID, SECRW_SHARD_SET_ID_LENGTH);
+	index += SECRW_SHARD_SET_ID_LENGTH;
+	payload[index++] = shard->numDataShards;
+	payload[index++] = shard->numParityShards;
+	payload[index++] = shard->index;
+	payload[index++] = 0;
+	memcpy(&payload[index], &shard->fileLength, sizeof(uint64_t));
+	index += sizeof(uint64_t);
+	memcpy(&payload[index], shardData, shard->shardLength);
+
+	*payloadLength = SHARD_HEADER_LENGTH + shard->shardLength;
+
+	return payload;
+}
+
+static int _decodeShard(const uint8_t * payload, size_t payloadLength, SECRW_SHARD * shard) {
+	uint32_t			index = 0;
+
+	if (payloadLength < SHARD_HEADER_LENGTH) {
+		fprintf(stderr, "Shard is truncated\n");
+		return -1;
+	}
+
+	memcpy(shard->setID, &payload[index], SECRW_SHARD_SET_ID_LENGTH);
+	index += SECRW_SHARD_SET_ID_LENGTH;
+	shard->numDataShards = payload[index++];
+	shard->numParityShards = payload[index++];
+	shard->index = payload[index++];
+	index++;
+	memcpy(&shard->fileLength, &payload[index], sizeof(uint64_t));
+
+	shard->shardLength = (uint32_t)(payloadLength - SHARD_HEADER_LENGTH);
+
+	/*
+	** The counts are read from the image, a set can't be bigger than
+	** the shard tables the index is used with...
+	*/
+	if (shard->numDataShards == 0 || 
+		(shard->numDataShards + shard->numParityShards) > EC_MAX_SHARDS || 
+		shard->index >= (shard->numDataShards + shard->numParityShards))
+	{
+		fprintf(stderr, "Shard header is invalid\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+HSECRW rdr_open(const char * pszFilename, encryption_algo a, compression_algo c, uint8_t quality) {
+	HSECRW			hsec;
+
+	hsec = _rdr_create(a);
+
+	if (hsec == NULL) {
+		return NULL;
+	}
+
+	hsec->fptrSecret = fopen(pszFilename, "rb");
+
+	if (hsec->fptrSecret == NULL) {
+		fprintf(stderr, "Failed to open file reader with file %s: %s\n", pszFilename, strerror(errno));
+		return NULL;
+	}
+
+	hsec->fileLength = getFileSize(hsec->fptrSecret);
+
+	if (hsec->fileLength > MAX_FILE_SIZE) {
+		fprintf(stderr, "File length %u is over the maximum allowed\n", hsec->fileLength);
+		fclose(hsec->fptrSecret);
+		return NULL;
+	}
+
+	if (c != compression_none) {
+		if (_rdr_compress(hsec, pszFilename, c)) {
+			fclose(hsec->fptrSecret);
+			dbg_free(0x0002, hsec, __FILE__, __LINE__);
+			return NULL;
+		}
+	}
+
+	return _rdr_build_frame(hsec, pszFilename, quality, 0);
+}
+
+/*
+** Open a reader on an archive's table of contents, the member frames
+** are opened separately with rdr_open()...
+*/
+HSECRW rdr_open_archive_toc(SECRW_ARCHIVE_MEMBER * members, uint32_t numMembers, encryption_algo a, uint8_t quality) {
+	HSECRW			hsec;
+	uint8_t *		toc;
+	uint32_t		tocLength;
+
+	if (numMembers > SECRW_MAX_ARCHIVE_MEMBERS) {
+		fprintf(stderr, "An archive can have at most %u members\n", SECRW_MAX_ARCHIVE_MEMBERS);
+		return NULL;
+	}
+
+	toc = _encodeArchiveTOC(members, numMembers, &tocLength);
+
+	if (toc == NULL) {
+		return NULL;
+	}
+
+	hsec = _rdr_create(a);
+
+	if (hsec == NULL) {
+		free(toc);
+		return NULL;
+	}
+
+	hsec->payload = toc;
+	hsec->fileLength = tocLength;
+
+	return _rdr_build_frame(hsec, "archive table of contents", quality, CLOAK_HEADER_FLAG_ARCHIVE);
+}
+
+/*
+** Open a reader on one shard of an erasure coded set, each shard is
+** merged into its own image...
+*/
+HSECRW rdr_open_shard(const SECRW_SHARD * shard, const uint8_t * shardData, encryption_algo a, uint8_t quality) {
+	HSECRW			hsec;
+	uint8_t *		payload;
+	uint32_t		payloadLength;
+
+	if (shard->shardLength > (MAX_FILE_SIZE - SHARD_HEADER_LENGTH)) {
+		fprintf(stderr, "Shard length %u is over the maximum allowed\n", shard->shardLength);
+		return NULL;
+	}
+
+	payload = _encodeShard(shard, shardData, &payloadLength);
+
+	if (payload == NULL) {
+		return NULL;
+	}
+
+	hsec = _rdr_create(a);
+
+	if (hsec == NULL) {
+		free(payload);
+		return NULL;
+	}
+
+	hsec->payload = payload;
+	hsec->fileLength = payloadLength;
+
+	return _rdr_build_frame(hsec, "shard", quality, CLOAK_HEADER_FLAG_SHARD);
+}
+
+int rdr_encrypt_aes256(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
+	int			err;
+	uint32_t	blklen;
+
+	blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+
+	if (_rdr_set_key_check(hsec, key, keyLength, &hsec->data[sizeof(CLOAK_HEADER)], blklen)) {
+		return -1;
+	}
+
+	err = gcry_cipher_setkey(
+						hsec->cipherHandle,
+						(const void *)key,
+						keyLength);
+
+	if (err) {
+		fprintf(stderr, "Failed to set key with gcrypt: %s/%s\n", gcry_strerror(err), gcry_strsource(err));
+		return -1;
+	}
+
+	err = gcry_cipher_encrypt(
+				hsec->cipherHandle, 
+				&hsec->data[sizeof(CLOAK_HEADER) + blklen], 
+				(hsec->encryptionBufferLength - blklen), 
+				NULL, 
+				0);
+
+	if (err) {
+		fprintf(stderr, "Failed to encrypt with gcrypt: %s\n", gcry_strerror(err));
+		return -1;
+	}
+
+	gcry_cipher_close(hsec->cipherHandle);
+	hsec->cipherHandle = NULL;
+	
+	return 0;
+}
+
+int rdr_encrypt_xor(HSECRW hsec, const char * pszKeystreamFilename) {
+	uint8_t *		keystream;
+	size_t			keyLength;
+	uint64_t		offset = 0;
+	int				rtn;
+
+	keystream = mapFile(pszKeystreamFilename, &keyLength);
+
+	if (keystream == NULL) {
+		fprintf(stderr, "Failed to open keystream file %s: %s\n", pszKeystreamFilename, strerror(errno));
+		return -1;
+	}
+
+	rtn = _claimPadRange(pszKeystreamFilename, keyLength, hsec->fileLength, &offset);
+
+	if (rtn < 0) {
+		unmapFile(keystream, keyLength);
+		return -1;
+	}
+	else if (rtn == 0) {
+		/*
+		** Record where in the pad pool our range starts...
+		*/
+		hsec->header.padOffset = offset;
+		hsec->header.flags |= CLOAK_HEADER_FLAG_PAD_OFFSET;
+
+		_rdr_write_header(hsec);
+	}
+
+	if ((keyLength - offset) < hsec->fileLength) {
+		fprintf(stderr, "Keystream file must be at least %u bytes long\n", hsec->fileLength);
+		unmapFile(keystream, keyLength);
+		return -1;
+	}
+
+	xorBuffer(&hsec->data[sizeof(CLOAK_HEADER)], &keystream[offset], hsec->fileLength);
+
+	unmapFile(keystream, keyLength);
+
+	return 0;
+}
+
+int rdr_encrypt_aead(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
+	HTHREADPOOL			hpool;
+	AEAD_CHUNK *		chunks;
+	uint32_t			numChunks;
+	uint32_t			index;
+	uint32_t			i;
+	int					failedChunk;
+
+	if (_rdr_set_key_check(hsec, key, keyLength, hsec->iv, AEAD_NONCE_PREFIX_LENGTH)) {
+		return -1;
+	}
+
+	numChunks = _aeadNumChunks(hsec->fileLength);
+
+	chunks = (AEAD_CHUNK *)malloc(numChunks * sizeof(AEAD_CHUNK));
+
+	if (chunks == NULL) {
+		fprintf(stderr, "Failed to allocate memory for %u chunks\n", numChunks);
+		return -1;
+	}
+
+	index = sizeof(CLOAK_HEADER) + AEAD_NONCE_PREFIX_LENGTH;
+
+	for (i = 0;i < numChunks;i++) {
+		chunks[i].algo = hsec->algo;
+		chunks[i].key = key;
+		chunks[i].keyLength = keyLength;
+		chunks[i].noncePrefix = hsec->iv;
+		chunks[i].header = hsec->headerBuffer;
+		chunks[i].headerLength = sizeof(CLOAK_HEADER);
+		chunks[i].chunkIndex = i;
+		chunks[i].isFinal = (i == (numChunks - 1) ? True : False);
+		chunks[i].length = hsec->fileLength - (i * AEAD_CHUNK_SIZE);
+
+		if (chunks[i].length > AEAD_CHUNK_SIZE) {
+			chunks[i].length = AEAD_CHUNK_SIZE;
+		}
+
+		chunks[i].in = &hsec->data[index];
+		chunks[i].out = &hsec->data[index];
+		chunks[i].tag = &hsec->data[index + chunks[i].length];
+		chunks[i].isEncrypt = True;
+		chunks[i].err = 0;
+
+		index += chunks[i].length + AEAD_TAG_LENGTH;
+	}
+
+	hpool = (numChunks > 1 ? tp_create(0) : NULL);
+
+	failedChunk = _aeadProcessChunks(hpool, chunks, numChunks);
+
+	if (hpool != NULL) {
+		tp_destroy(hpool);
+	}
+
+	if (failedChunk >= 0) {
+		fprintf(stderr, "Failed to encrypt with gcrypt: %s\n", gcry_strerror(chunks[failedChunk].err));
+		free(chunks);
+		return -1;
+	}
+
+	free(chunks);
+
+	return 0;
+}
+
+void rdr_close(HSECRW hsec) {
+	if (hsec->fptrSecret != NULL) {
+		fclose(hsec->fptrSecret);
+	}
+
+	if (hsec->cipherHandle != NULL) {
+		gcry_cipher_close(hsec->cipherHandle);
+	}
+
+	if (hsec->payload != NULL) {
+		free(hsec->payload);
+	}
+
+	dbg_free(0x0004, hsec->data, __FILE__, __LINE__);
+	dbg_free(0x0002, hsec, __FILE__, __LINE__);
+}
+
+uint32_t rdr_get_block_size(HSECRW hsec) {
+	return hsec->blockSize;
+}
+
+uint32_t rdr_get_data_length(HSECRW hsec) {
+	return hsec->dataFrameLength;
+}
+
+uint32_t rdr_get_file_length(HSECRW hsec) {
+	return hsec->fileLength;
+}
+
+boolean rdr_has_more_blocks(HSECRW hsec) {
+	return ((hsec->counter < hsec->dataFrameLength) ? True : False);
+}
+
+uint32_t rdr_read_encrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength) {
+	uint8_t *			span;
+	uint32_t			bytesRead;
+
+	if (bufferLength < hsec->blockSize) {
+		fprintf(stderr, "Buffer length must be as least as big as the block size: %u\n", hsec->blockSize);
+		return 0;
+	}
+
+	bytesRead = rdr_read_encrypted_span(hsec, &span, hsec->blockSize);
+	memcpy(buffer, span, bytesRead);
+
+	/*
+	** Only the final partial block needs padding with random data...
+	*/
+	if (bytesRead < hsec->blockSize) {
+		memcpy(&buffer[bytesRead], random_block, hsec->blockSize - bytesRead);
+	}
+
+	return bytesRead;
+}
+
+/*
+** Return a view of up to maxLength bytes of the encrypted data frame,
+** starting at the current read position. The span points directly into
+** the frame buffer and remains valid until rdr_close() is called.
+*/
+uint32_t rdr_read_encrypted_span(HSECRW hsec, uint8_t ** span, uint32_t maxLength) {
+	uint32_t			spanLength;
+
+	if (!hsec->isSealed) {
+		_rdr_seal_frame(hsec);
+	}
+
+	spanLength = hsec->dataFrameLength - hsec->counter;
+
+	if (spanLength > maxLength) {
+		spanLength = maxLength;
+	}
+
+	*span = &hsec->data[hsec->counter];
+
+	hsec->blockCounter++;
+	hsec->counter += spanLength;
+
+	return spanLength;
+}
+
+static HSECRW _wrtr_create(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = (HSECRW)malloc(sizeof(struct _secret_rw_handle));
+
+	if (hsec == NULL) {
+		fprintf(stderr, "Failed to allocate memory for cloak handle\n");
+		return NULL;
+	}
+
+	hsec->blockSize = SECRETRW_BLOCK_SIZE;
+	hsec->algo = a;
+	hsec->counter = 0;
+	hsec->blockCounter = 0;
+
+	hsec->data = NULL;
+	hsec->keystream = NULL;
+	hsec->cipherBuffer = NULL;
+	hsec->cipherBufferLength = 0;
+	hsec->cipherBufferCapacity = WRITER_BUFFER_SIZE;
+	hsec->chunkCounter = 0;
+	hsec->keyLength = 0;
+	hsec->headerLength = CLOAK_HEADER_MAGIC_LENGTH;
+	hsec->frameHeaderLength = 0;
+	hsec->ivLength = 0;
+	hsec->keystreamOffset = 0;
+	hsec->cipherBlockLength = 1;
+	hsec->cipherLength = 0;
+	hsec->bytesWritten = 0;
+	hsec->cipherHandle = NULL;
+	hsec->hpool = NULL;
+	hsec->isCompressed = False;
+	hsec->payload = NULL;
+	hsec->compressionHeaderLength = 0;
+	hsec->hdcmp = NULL;
+	hsec->isVerifyOnly = False;
+	hsec->crc = 0;
+	hsec->trailerLength = 0;
+	hsec->fptrSecret = NULL;
+	hsec->pszFilename = NULL;
+	hsec->isArchiveTOC = False;
+	hsec->isShard = False;
+	hsec->memoryBuffer = NULL;
+	hsec->memoryLength = 0;
+	hsec->isRange = False;
+	hsec->rangeOffset = 0;
+	hsec->rangeLength = 0;
+	hsec->rangeCipherStart = 0;
+	hsec->rangeCipherEnd = 0;
+
+	memset(hsec->pieceHandles, 0, sizeof(hsec->pieceHandles));
+
+	if (hsec->algo == aes256) {
+		hsec->cipherBlockLength = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+		hsec->ivLength = hsec->cipherBlockLength;
+	}
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		hsec->ivLength = AEAD_NONCE_PREFIX_LENGTH;
+		hsec->cipherBufferCapacity = AEAD_CHUNKS_PER_BUFFER * AEAD_FRAME_CHUNK_SIZE;
+	}
+
+	return hsec;
+}
+
+HSECRW wrtr_open(const char * pszFilename, encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = _wrtr_create(a);
+
+	if (hsec == NULL) {
+		return NULL;
+	}
+
+	hsec->fptrSecret = fopen(pszFilename, "wb");
+
+	if (hsec->fptrSecret == NULL) {
+		fprintf(stderr, "Failed to open file writer with file %s: %s\n", pszFilename, strerror(errno));
+		free(hsec);
+		return NULL;
+	}
+
+	hsec->pszFilename = strdup(pszFilename);
+
+	return hsec;
+}
+
+/*
+** Open a writer that only checks the frame's CRC, nothing is
+** decrypted or written so no key is needed...
+*/
+HSECRW wrtr_open_verify(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = _wrtr_create(a);
+
+	if (hsec == NULL) {
+		return NULL;
+	}
+
+	hsec->isVerifyOnly = True;
+
+	return hsec;
+}
+
+/*
+** Returns True if the frame had a CRC trailer and it matched...
+*/
+boolean wrtr_is_verified(HSECRW hsec) {
+	uint32_t			crc;
+
+	if (hsec->trailerLength == 0 || wrtr_has_more_blocks(hsec)) {
+		return False;
+	}
+
+	memcpy(&crc, hsec->trailer, CRC_TRAILER_LENGTH);
+
+	return (crc == hsec->crc) ? True : False;
+}
+
+void wrtr_close(HSECRW hsec) {
+	int				i;
+
+	if (hsec->fptrSecret != NULL) {
+		fclose(hsec->fptrSecret);
+	}
+
+	if (hsec->memoryBuffer != NULL) {
+		secureFree(hsec->memoryBuffer, hsec->memoryLength);
+	}
+
+	if (hsec->cipherHandle != NULL) {
+		gcry_cipher_close(hsec->cipherHandle);
+	}
+
+	for (i = 0;i < NUM_DECRYPT_PIECES;i++) {
+		if (hsec->pieceHandles[i] != NULL) {
+			gcry_cipher_close(hsec->pieceHandles[i]);
+		}
+	}
+
+	if (hsec->hpool != NULL) {
+		tp_destroy(hsec->hpool);
+	}
+
+	if (hsec->hdcmp != NULL) {
+		dcmp_close(hsec->hdcmp);
+	}
+
+	if (hsec->data != NULL) {
+		secureFree(hsec->data, WRITER_BUFFER_SIZE);
+	}
+
+	if (hsec->cipherBuffer != NULL) {
+		secureFree(hsec->cipherBuffer, WRITER_BUFFER_SIZE);
+	}
+
+	wipeBuffer(hsec->key, MAX_KEY_LENGTH);
+
+	if (hsec->keystream != NULL) {
+		unmapFile(hsec->keystream, hsec->keystreamLength);
+	}
+
+	free(hsec->pszFilename);
+	free(hsec);
+}
+
+static HSECRW _wrtr_open_memory(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = _wrtr_create(a);
+
+	if (hsec == NULL) {
+		return NULL;
+	}
+
+	hsec->fptrSecret = open_memstream(&hsec->memoryBuffer, &hsec->memoryLength);
+
+	if (hsec->fptrSecret == NULL) {
+		fprintf(stderr, "Failed to open memory stream: %s\n", strerror(errno));
+		free(hsec);
+		return NULL;
+	}
+
+	return hsec;
+}
+
+/*
+** Open a writer for an archive's table of contents, which is decrypted
+** into memory and read back with wrtr_get_archive_members()...
+*/
+HSECRW wrtr_open_archive_toc(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = _wrtr_open_memory(a);
+
+	if (hsec != NULL) {
+		hsec->isArchiveTOC = True;
+	}
+
+	return hsec;
+}
+
+/*
+** Open a writer for one shard of an erasure coded set, the shard is
+** decrypted into memory and read back with wrtr_get_shard()...
+*/
+HSECRW wrtr_open_shard(encryption_algo a) {
+	HSECRW			hsec;
+
+	hsec = _wrtr_open_memory(a);
+
+	if (hsec != NULL) {
+		hsec->isShard = True;
+	}
+
+	return hsec;
+}
+
+/*
+** Once the whole table of contents frame has been written, return the
+** members it lists. The caller frees the returned array...
+*/
+SECRW_ARCHIVE_MEMBER * wrtr_get_archive_members(HSECRW hsec, uint32_t * numMembers) {
+	if (!hsec->isArchiveTOC || wrtr_has_more_blocks(hsec)) {
+		fprintf(stderr, "The archive table of contents has not been read\n");
+		return NULL;
+	}
+
+	fflush(hsec->fptrSecret);
+
+	return _decodeArchiveTOC((uint8_t *)hsec->memoryBuffer, hsec->memoryLength, numMembers);
+}
+
+/*
+** Once the whole shard frame has been written, fill in the shard's place
+** in its set and return a copy of the shard data, which the caller frees...
+*/
+uint8_t * wrtr_get_shard(HSECRW hsec, SECRW_SHARD * shard) {
+	uint8_t *			shardData;
+
+	if (!hsec->isShard || wrtr_has_more_blocks(hsec)) {
+		fprintf(stderr, "The shard has not been read\n");
+		return NULL;
+	}
+
+	fflush(hsec->fptrSecret);
+
+	if (_decodeShard((uint8_t *)hsec->memoryBuffer, hsec->memoryLength, shard)) {
+		return NULL;
+	}
+
+	shardData = (uint8_t *)malloc(shard->shardLength + 1);
+
+	if (shardData == NULL) {
+		fprintf(stderr, "Failed to allocate memory for shard\n");
+		return NULL;
+	}
+
+	memcpy(shardData, &hsec->memoryBuffer[SHARD_HEADER_LENGTH], shard->shardLength);
+
+	return shardData;
+}
+
+uint32_t wrtr_get_data_length(HSECRW hsec) {
+	return hsec->dataFrameLength;
+}
+
+/*
+** Close the writer and remove the partially written output, used when
+** extraction is aborted so no unauthenticated data is left behind...
+*/
+void wrtr_discard(HSECRW hsec) {
+	char *			pszFilename;
+
+	pszFilename = (hsec->pszFilename != NULL ? strdup(hsec->pszFilename) : NULL);
+
+	wrtr_close(hsec);
+
+	if (pszFilename != NULL) {
+		unlink(pszFilename);
+		free(pszFilename);
+	}
+}
+
+uint32_t wrtr_get_block_size(HSECRW hsec) {
+	return hsec->blockSize;
+}
+
+/*
+** Where the ciphertext we need ends, the end of the range's last cipher
+** unit for a range writer once the header has been read...
+*/
+static uint32_t _wrtr_get_cipher_end(HSECRW hsec) {
+	if (hsec->isRange && hsec->data != NULL) {
+		return hsec->rangeCipherEnd;
+	}
+
+	return hsec->cipherLength;
+}
+
+boolean wrtr_has_more_blocks(HSECRW hsec) {
+	if (hsec->isRange && hsec->data != NULL) {
+		return (hsec->counter < (hsec->headerLength + hsec->rangeCipherEnd)) ? True : False;
+	}
+
+	return (hsec->counter < (hsec->headerLength + hsec->cipherLength + hsec->trailerLength)) ? True : False;
+}
+
+/*
+** Only write length bytes of the file starting at offset, a length of
+** UINT64_MAX means to the end of the file. Must be called before any of
+** the frame is written...
+*/
+int wrtr_set_range(HSECRW hsec, uint64_t offset, uint64_t length) {
+	if (hsec->counter > 0) {
+		fprintf(stderr, "The range must be set before the frame is written\n");
+		return -1;
+	}
+
+	hsec->isRange = True;
+	hsec->rangeOffset = offset;
+	hsec->rangeLength = length;
+
+	return 0;
+}
+
+/*
+** How many more frame bytes the writer will throw away, the caller may
+** skip them with wrtr_skip() rather than extracting them...
+*/
+uint32_t wrtr_get_skip_length(HSECRW hsec) {
+	uint32_t			skipEnd;
+
+	if (!hsec->isRange || hsec->data == NULL) {
+		return 0;
+	}
+
+	skipEnd = hsec->headerLength + hsec->rangeCipherStart;
+
+	/*
+	** CBC needs the cipher block before the range as its IV...
+	*/
+	if (hsec->algo == aes256 && hsec->rangeCipherStart > 0) {
+		skipEnd -= hsec->cipherBlockLength;
+	}
+
+	return (hsec->counter < skipEnd ? skipEnd - hsec->counter : 0);
+}
+
+int wrtr_skip(HSECRW hsec, uint32_t length) {
+	if (length > wrtr_get_skip_length(hsec)) {
+		fprintf(stderr, "Cannot skip %u bytes of the frame\n", length);
+		return -1;
+	}
+
+	hsec->counter += length;
+
+	return 0;
+}
+
+int wrtr_set_keystream_file(HSECRW hsec, const char * pszFilename) {
+	hsec->keystream = mapFile(pszFilename, &hsec->keystreamLength);
+
+	if (hsec->keystream == NULL) {
+		fprintf(stderr, "Failed to open keystream file %s: %s\n", pszFilename, strerror(errno));
+		return -1;
+	}
+
+	hsec->keystreamOffset = 0;
+
+	return 0;
+}
+
+int wrtr_set_key_aes(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
+	if (hsec->algo == aes256) {
+		int			err;
+		int			i;
+
+		err = gcry_cipher_open(
+							&hsec->cipherHandle,
+							GCRY_CIPHER_RIJNDAEL256,
+							GCRY_CIPHER_MODE_CBC,
+							0);
+
+		if (err) {
+			fprintf(stderr, "Failed to open cipher with gcrypt\n");
+			hsec->cipherHandle = NULL;
+			return -1;
+		}
+
+		err = gcry_cipher_setkey(
+							hsec->cipherHandle,
+							(const void *)key,
+							keyLength);
+
+		if (err) {
+			fprintf(stderr, "Failed to set key with gcrypt: %s\n", gcry_strerror(err));
+			return -1;
+		}
+
+		if (keyLength > MAX_KEY_LENGTH) {
+			fprintf(stderr, "Key length %u is over the maximum allowed\n", keyLength);
+			return -1;
+		}
+
+		memcpy(hsec->key, key, keyLength);
+		hsec->keyLength = keyLength;
+
+		for (i = 0;i < NUM_DECRYPT_PIECES;i++) {
+			err = gcry_cipher_open(
+								&hsec->pieceHandles[i],
+								GCRY_CIPHER_RIJNDAEL256,
+								GCRY_CIPHER_MODE_CBC,
+								0);
+
+			if (err) {
+				fprintf(stderr, "Failed to open cipher with gcrypt\n");
+				hsec->pieceHandles[i] = NULL;
+				return -1;
+			}
+
+			err = gcry_cipher_setkey(
+								hsec->pieceHandles[i],
+								(const void *)key,
+								keyLength);
+
+			if (err) {
+				fprintf(stderr, "Failed to set key with gcrypt: %s\n", gcry_strerror(err));
+				return -1;
+			}
+		}
+
+		hsec->hpool = tp_create(0);
+
+		if (hsec->hpool == NULL) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int wrtr_set_key_aead(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
+	if (keyLength > MAX_KEY_LENGTH) {
+		fprintf(stderr, "Key length %u is over the maximum allowed\n", keyLength);
+		return -1;
+	}
+
+	memcpy(hsec->key, key, keyLength);
+	hsec->keyLength = keyLength;
+
+	hsec->hpool = tp_create(0);
+
+	if (hsec->hpool == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _wrtr_check_key(HSECRW hsec) {
+	uint8_t				keyCheck[KEY_CHECK_LENGTH];
+	uint8_t *			salt = &hsec->headerBuffer[hsec->frameHeaderLength];
+
+	if (_getKeyCheckValue(hsec->key, hsec->keyLength, salt, hsec->ivLength, keyCheck)) {
+		return -1;
+	}
+
+	if (memcmp(keyCheck, hsec->header.keyCheck, KEY_CHECK_LENGTH) != 0) {
+		fprintf(stderr, "Incorrect password, the key does not match the key check value in the image\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Called once the first few bytes of the frame have arrived, a version 2
+** header starts with the magic number, anything else is a version 1 header...
+*/
+static void _wrtr_detect_header_version(HSECRW hsec) {
+	uint8_t				magic[CLOAK_HEADER_MAGIC_LENGTH];
+	uint32_t			value;
+
+	memcpy(magic, hsec->headerBuffer, CLOAK_HEADER_MAGIC_LENGTH);
+	xorBuffer(magic, &random_block[2048], CLOAK_HEADER_MAGIC_LENGTH);
+	memcpy(&value, magic, sizeof(uint32_t));
+
+	if (value == CLOAK_HEADER_MAGIC) {
+		hsec->frameHeaderLength = sizeof(CLOAK_HEADER);
+	}
+	else {
+		hsec->frameHeaderLength = sizeof(CLOAK_HEADER_V1);
+	}
+
+	hsec->headerLength = hsec->frameHeaderLength + hsec->ivLength;
+}
+
+static int _wrtr_parse_header_v2(HSECRW hsec) {
+	CLOAK_HEADER *		header = &hsec->header;
+
+	memcpy(header, hsec->headerBuffer, sizeof(CLOAK_HEADER));
+
+	if (header->headerCRC != _getHeaderCRC(header)) {
+		fprintf(stderr, "Frame header CRC check failed, the image is damaged\n");
+		return -1;
+	}
+
+	if (header->version != CLOAK_HEADER_VERSION) {
+		fprintf(stderr, "Unsupported frame header version %u\n", (unsigned int)header->version);
+		return -1;
+	}
+
+	if (header->algo != (uint8_t)hsec->algo) {
+		fprintf(stderr, "The image was merged with a different algorithm (%u)\n", (unsigned int)header->algo);
+		return -1;
+	}
+
+	if (header->fileLength > MAX_FILE_SIZE ||
+		header->dataFrameLength > UINT32_MAX ||
+		header->encryptionBufferLength > UINT32_MAX)
+	{
+		fprintf(stderr, "Invalid data frame header, lengths are out of range\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+** Version 1 headers hold 32-bit lengths, with the flags in the top bits
+** of the file length and the key check (or pad offset) in the padding...
+*/
+static void _wrtr_parse_header_v1(HSECRW hsec) {
+	CLOAK_HEADER_V1		v1;
+	uint32_t			offset;
+
+	memcpy(&v1, hsec->headerBuffer, sizeof(CLOAK_HEADER_V1));
+
+	memset(&hsec->header, 0, sizeof(CLOAK_HEADER));
+
+	hsec->header.version = 1;
+	hsec->header.algo = (uint8_t)hsec->algo;
+	hsec->header.fileLength = v1.fileLength & CLOAK_HEADER_V1_LENGTH_MASK;
+	hsec->header.dataFrameLength = v1.dataFrameLength;
+	hsec->header.encryptionBufferLength = v1.encryptionBufferLength;
+
+	if (v1.fileLength & CLOAK_HEADER_V1_FLAG_KEY_CHECK) {
+		hsec->header.flags |= CLOAK_HEADER_FLAG_KEY_CHECK;
+		memcpy(hsec->header.keyCheck, v1.padding, KEY_CHECK_LENGTH);
+	}
+	if (v1.fileLength & CLOAK_HEADER_V1_FLAG_PAD_OFFSET) {
+		hsec->header.flags |= CLOAK_HEADER_FLAG_PAD_OFFSET;
+		memcpy(&offset, v1.padding, sizeof(uint32_t));
+		hsec->header.padOffset = offset;
+	}
+	if (v1.fileLength & CLOAK_HEADER_V1_FLAG_COMPRESSED) {
+		hsec->header.flags |= CLOAK_HEADER_FLAG_COMPRESSED;
+	}
+	if (v1.fileLength & CLOAK_HEADER_V1_FLAG_CRC) {
+		hsec->header.flags |= CLOAK_HEADER_FLAG_CRC;
+	}
+}
+
+/*
+** Work out which cipher units cover the range, and position the cipher
+** state (chunk index, keystream offset) at the first of them...
+*/
+static int _wrtr_set_range_window(HSECRW hsec) {
+	uint64_t			rangeEnd;
+	uint32_t			firstChunk;
+	uint32_t			lastChunk;
+
+	if (hsec->isCompressed) {
+		fprintf(stderr, "A byte range can't be extracted from a compressed file\n");
+		return -1;
+	}
+
+	if (hsec->rangeOffset > hsec->fileLength) {
+		fprintf(stderr, "Range offset %" PRIu64 " is past the end of the file (%u bytes)\n", hsec->rangeOffset, hsec->fileLength);
+		return -1;
+	}
+
+	if (hsec->rangeLength > (hsec->fileLength - hsec->rangeOffset)) {
+		hsec->rangeLength = hsec->fileLength - hsec->rangeOffset;
+	}
+
+	rangeEnd = hsec->rangeOffset + hsec->rangeLength;
+
+	if (hsec->algo == aes256) {
+		hsec->rangeCipherStart = (uint32_t)(hsec->rangeOffset - (hsec->rangeOffset % hsec->cipherBlockLength));
+		hsec->rangeCipherEnd = (uint32_t)(((rangeEnd + hsec->cipherBlockLength - 1) / hsec->cipherBlockLength) * hsec->cipherBlockLength);
+
+		if (hsec->rangeCipherEnd == hsec->rangeCipherStart) {
+			hsec->rangeCipherEnd += hsec->cipherBlockLength;
+		}
+
+		hsec->bytesWritten = hsec->rangeCipherStart;
+	}
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		firstChunk = (uint32_t)(hsec->rangeOffset / AEAD_CHUNK_SIZE);
+		lastChunk = (rangeEnd > 0 ? (uint32_t)((rangeEnd - 1) / AEAD_CHUNK_SIZE) : 0);
+
+		if (lastChunk < firstChunk) {
+			lastChunk = firstChunk;
+		}
+
+		hsec->rangeCipherStart = firstChunk * AEAD_FRAME_CHUNK_SIZE;
+		hsec->rangeCipherEnd = (lastChunk + 1) * AEAD_FRAME_CHUNK_SIZE;
+
+		if (hsec->rangeCipherEnd > hsec->cipherLength) {
+			hsec->rangeCipherEnd = hsec->cipherLength;
+		}
+
+		hsec->chunkCounter = firstChunk;
+		hsec->bytesWritten = firstChunk * AEAD_CHUNK_SIZE;
+	}
+	else {
+		hsec->rangeCipherStart = (uint32_t)hsec->rangeOffset;
+		hsec->rangeCipherEnd = (uint32_t)rangeEnd;
+		hsec->bytesWritten = hsec->rangeCipherStart;
+
+		if (hsec->algo == xor) {
+			hsec->keystreamOffset += hsec->rangeCipherStart;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Frame bytes before the range are dropped, apart from the cipher block
+** just before it which CBC needs as the IV...
+*/
+static void _wrtr_discard_before_range(HSECRW hsec, const uint8_t * buffer, uint32_t length) {
+	uint32_t			position;
+	uint32_t			ivStart;
+	uint32_t			skip;
+
+	if (hsec->algo != aes256 || hsec->rangeCipherStart == 0) {
+		return;
+	}
+
+	position = hsec->counter - hsec->headerLength;
+	ivStart = hsec->rangeCipherStart - hsec->cipherBlockLength;
+
+	if ((position + length) <= ivStart) {
+		return;
+	}
+
+	skip = (position < ivStart ? ivStart - position : 0);
+
+	memcpy(&hsec->iv[position + skip - ivStart], &buffer[skip], length - skip);
+}
 
-		bytesRead = fread(&hsec->data[index], 1, hsec->fileLength, hsec->fptrSecret);
+static int _wrtr_read_header(HSECRW hsec) {
+	/*
+	** XOR the header with random data...
+	*/
+	xorBuffer(hsec->headerBuffer, &random_block[2048], hsec->frameHeaderLength);
 
-		if (bytesRead < hsec->fileLength) {
-			fprintf(stderr, "Failed to read file %s, expected %u bytes, got %u bytes\n", pszFilename, hsec->fileLength, bytesRead);
-			fclose(hsec->fptrSecret);
-			free(hsec->data);
-			free(hsec);
-			return NULL;
+	if (hsec->frameHeaderLength == sizeof(CLOAK_HEADER)) {
+		if (_wrtr_parse_header_v2(hsec)) {
+			return -1;
 		}
-
-		fclose(hsec->fptrSecret);
-		hsec->fptrSecret = NULL;
+	}
+	else {
+		_wrtr_parse_header_v1(hsec);
 	}
 
-	return hsec;
-}
+	/*
+	** Frames written before the key check was added don't have the
+	** flag set, so they are extracted without it...
+	*/
+	if ((hsec->header.flags & CLOAK_HEADER_FLAG_KEY_CHECK) && secrw_is_keyed_algo(hsec->algo) && !hsec->isVerifyOnly) {
+		if (_wrtr_check_key(hsec)) {
+			return -1;
+		}
+	}
 
-int rdr_encrypt_aes256(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
-	int			err;
-	uint32_t	blklen;
+	/*
+	** Keystreams from a pad pool start at the offset recorded in the header...
+	*/
+	if ((hsec->header.flags & CLOAK_HEADER_FLAG_PAD_OFFSET) && hsec->algo == xor) {
+		hsec->keystreamOffset = hsec->header.padOffset;
+	}
 
-	blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+	if (hsec->header.flags & CLOAK_HEADER_FLAG_COMPRESSED) {
+		hsec->isCompressed = True;
+	}
 
-	err = gcry_cipher_setkey(
-						hsec->cipherHandle,
-						(const void *)key,
-						keyLength);
+	if (hsec->header.flags & CLOAK_HEADER_FLAG_CRC) {
+		hsec->trailerLength = CRC_TRAILER_LENGTH;
+	}
 
-	if (err) {
-		fprintf(stderr, "Failed to set key with gcrypt: %s/%s\n", gcry_strerror(err), gcry_strsource(err));
-		fclose(hsec->fptrSecret);
-		dbg_free(0x0002, hsec, __FILE__, __LINE__);
+	if ((hsec->header.flags & CLOAK_HEADER_FLAG_ARCHIVE) && !hsec->isArchiveTOC && !hsec->isVerifyOnly) {
+		fprintf(stderr, "The image holds an archive, use --list or --extract-member\n");
+		return -1;
+	}
+	else if (!(hsec->header.flags & CLOAK_HEADER_FLAG_ARCHIVE) && hsec->isArchiveTOC) {
+		fprintf(stderr, "The image does not hold an archive\n");
 		return -1;
 	}
 
-	err = gcry_cipher_encrypt(
-				hsec->cipherHandle, 
-				&hsec->data[sizeof(CLOAK_HEADER) + blklen], 
-				(hsec->encryptionBufferLength - blklen), 
-				NULL, 
-				0);
-
-	if (err) {
-		fprintf(stderr, "Failed to encrypt with gcrypt: %s\n", gcry_strerror(err));
-		fclose(hsec->fptrSecret);
-		dbg_free(0x0002, hsec, __FILE__, __LINE__);
+	if ((hsec->header.flags & CLOAK_HEADER_FLAG_SHARD) && !hsec->isShard && !hsec->isVerifyOnly) {
+		fprintf(stderr, "The image holds one shard of an erasure coded set, give the other images too\n");
+		return -1;
+	}
+	else if (!(hsec->header.flags & CLOAK_HEADER_FLAG_SHARD) && hsec->isShard) {
+		fprintf(stderr, "The image does not hold a shard\n");
 		return -1;
 	}
 
-	gcry_cipher_close(hsec->cipherHandle);
-	
-	return 0;
-}
+	hsec->fileLength = (uint32_t)hsec->header.fileLength;
+	hsec->encryptionBufferLength = (uint32_t)hsec->header.encryptionBufferLength;
+	hsec->dataFrameLength  = (uint32_t)hsec->header.dataFrameLength;
 
-int rdr_encrypt_xor(HSECRW hsec, const char * pszKeystreamFilename) {
-	uint32_t		keyLength;
-	uint32_t		i;
-	int				ch;
+	if (hsec->algo == aes256) {
+		hsec->cipherLength = hsec->encryptionBufferLength - hsec->cipherBlockLength;
+	}
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		hsec->cipherLength = hsec->encryptionBufferLength - AEAD_NONCE_PREFIX_LENGTH;
 
-	hsec->fptrKey = fopen(pszKeystreamFilename, "rb");
+		if (hsec->fileLength > MAX_FILE_SIZE ||
+			hsec->cipherLength != hsec->fileLength + (_aeadNumChunks(hsec->fileLength) * AEAD_TAG_LENGTH))
+		{
+			fprintf(stderr, "Invalid data frame header, check the merge quality and algorithm\n");
+			return -1;
+		}
+	}
+	else {
+		hsec->cipherLength = hsec->encryptionBufferLength - hsec->frameHeaderLength;
+	}
 
-	if (hsec->fptrKey == NULL) {
-		fprintf(stderr, "Failed to open keystream file %s: %s\n", pszKeystreamFilename, strerror(errno));
+	if (hsec->encryptionBufferLength > hsec->dataFrameLength ||
+		hsec->fileLength > hsec->cipherLength ||
+		hsec->cipherLength > MAX_FILE_SIZE + MAX_CIPHER_BLOCK_SIZE ||
+		(hsec->cipherLength % hsec->cipherBlockLength) != 0 ||
+		(hsec->trailerLength > 0 && 
+			hsec->dataFrameLength != (hsec->headerLength + hsec->cipherLength + hsec->trailerLength)))
+	{
+		fprintf(stderr, "Invalid data frame header, check the merge quality and algorithm\n");
 		return -1;
 	}
 
-	keyLength = getFileSize(hsec->fptrKey);
+	hsec->data = (uint8_t *)malloc(WRITER_BUFFER_SIZE);
+	hsec->cipherBuffer = (uint8_t *)malloc(WRITER_BUFFER_SIZE);
 
-	if (keyLength < hsec->fileLength) {
-		fprintf(stderr, "Keystream file must be at least %u bytes long\n", hsec->fileLength);
-		fclose(hsec->fptrKey);
+	if (hsec->data == NULL || hsec->cipherBuffer == NULL) {
+		fprintf(stderr, "Failed to allocate %u bytes for data buffer\n", WRITER_BUFFER_SIZE);
 		return -1;
 	}
 
-	for (i = sizeof(CLOAK_HEADER);i < hsec->encryptionBufferLength;i++) {
-		ch = fgetc(hsec->fptrKey);
-
-		if (ch == EOF) {
-			fprintf(stderr, "Got EOF from keystream file %s\n", pszKeystreamFilename);
-			fclose(hsec->fptrKey);
+	if (hsec->algo == aes256) {
+		memcpy(hsec->iv, &hsec->headerBuffer[hsec->frameHeaderLength], hsec->cipherBlockLength);
+	}
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		memcpy(hsec->iv, &hsec->headerBuffer[hsec->frameHeaderLength], AEAD_NONCE_PREFIX_LENGTH);
+	}
+	else if (hsec->algo == xor && !hsec->isVerifyOnly) {
+		if (hsec->keystream == NULL || hsec->keystreamLength < (hsec->keystreamOffset + hsec->fileLength)) {
+			fprintf(stderr, "Keystream file must be at least %zu bytes long\n", hsec->keystreamOffset + hsec->fileLength);
 			return -1;
 		}
-
-		hsec->data[i] = (hsec->data[i] ^ (uint8_t)ch);
 	}
 
-	fclose(hsec->fptrKey);
+	if (hsec->isRange) {
+		return _wrtr_set_range_window(hsec);
+	}
 
 	return 0;
 }
 
-void rdr_close(HSECRW hsec) {
-	if (hsec->fptrSecret != NULL) {
-		fclose(hsec->fptrSecret);
-	}
+static void _decryptPiece(void * p) {
+	DECRYPT_PIECE *		piece = (DECRYPT_PIECE *)p;
 
-	dbg_free(0x0004, hsec->data, __FILE__, __LINE__);
-	dbg_free(0x0002, hsec, __FILE__, __LINE__);
-}
+	piece->err = gcry_cipher_setiv(piece->handle, piece->iv, piece->ivLength);
 
-uint32_t rdr_get_block_size(HSECRW hsec) {
-	return hsec->blockSize;
+	if (!piece->err) {
+		piece->err = gcry_cipher_decrypt(
+								piece->handle,
+								piece->out,
+								piece->length,
+								piece->in,
+								piece->length);
+	}
 }
 
-uint32_t rdr_get_data_length(HSECRW hsec) {
-	return hsec->dataFrameLength;
-}
+/*
+** CBC decrypt a chunk of whole cipher blocks, splitting it into pieces
+** decrypted concurrently on the thread pool. The IV for each piece is the
+** last ciphertext block of the piece before it, so the output is identical
+** to decrypting the chunk in one pass...
+*/
+static int _wrtr_decrypt_cbc(HSECRW hsec, uint8_t * cipherText, uint32_t length) {
+	DECRYPT_PIECE		pieces[NUM_DECRYPT_PIECES];
+	uint32_t			offset;
+	int					numPieces = 0;
+	int					i;
 
-uint32_t rdr_get_file_length(HSECRW hsec) {
-	return hsec->fileLength;
-}
+	for (offset = 0;offset < length;offset += DECRYPT_PIECE_SIZE) {
+		DECRYPT_PIECE *		piece = &pieces[numPieces];
 
-boolean rdr_has_more_blocks(HSECRW hsec) {
-	return ((hsec->counter < hsec->dataFrameLength) ? True : False);
-}
+		piece->handle = hsec->pieceHandles[numPieces];
+		piece->out = &hsec->data[offset];
+		piece->in = &cipherText[offset];
+		piece->length = ((length - offset) < DECRYPT_PIECE_SIZE ? (length - offset) : DECRYPT_PIECE_SIZE);
+		piece->iv = (offset == 0 ? hsec->iv : &cipherText[offset - hsec->cipherBlockLength]);
+		piece->ivLength = hsec->cipherBlockLength;
+		piece->err = 0;
 
-uint32_t rdr_read_encrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength) {
-	uint32_t			bytesRead;
+		numPieces++;
+	}
 
-	if (bufferLength < hsec->blockSize) {
-		fprintf(stderr, "Buffer length must be as least as big as the block size: %u\n", hsec->blockSize);
-		return 0;
+	if (numPieces == 1) {
+		_decryptPiece(&pieces[0]);
 	}
+	else {
+		for (i = 0;i < numPieces;i++) {
+			if (tp_submit(hsec->hpool, _decryptPiece, &pieces[i])) {
+				_decryptPiece(&pieces[i]);
+			}
+		}
 
-	memcpy(buffer, random_block, hsec->blockSize);
+		tp_wait(hsec->hpool);
+	}
 
-	bytesRead = ((hsec->dataFrameLength - hsec->counter) >= hsec->blockSize ? hsec->blockSize : (hsec->dataFrameLength - hsec->counter));
-	memcpy(buffer, &hsec->data[hsec->counter], bytesRead);
+	for (i = 0;i < numPieces;i++) {
+		if (pieces[i].err) {
+			fprintf(stderr, "Failed to decrypt buffer: %s\n", gcry_strerror(pieces[i].err));
+			return -1;
+		}
+	}
 
-	hsec->blockCounter++;
-	hsec->counter += bytesRead;
+	memcpy(hsec->iv, &cipherText[length - hsec->cipherBlockLength], hsec->cipherBlockLength);
 
-	return bytesRead;
+	return 0;
 }
 
-HSECRW wrtr_open(const char * pszFilename, encryption_algo a) {
-	HSECRW			hsec;
-
-	hsec = (HSECRW)malloc(sizeof(struct _secret_rw_handle));
-
-	if (hsec == NULL) {
-		fprintf(stderr, "Failed to allocate memory for cloak handle\n");
-		return NULL;
+/*
+** Decrypt and authenticate a run of whole AEAD chunks into the data buffer,
+** returns the length of the plaintext...
+*/
+static int _wrtr_decrypt_aead(HSECRW hsec, uint8_t * cipherText, uint32_t length, uint32_t * plainTextLength) {
+	AEAD_CHUNK			chunks[AEAD_CHUNKS_PER_BUFFER];
+	uint32_t			offset = 0;
+	uint32_t			numChunks = 0;
+	int					failedChunk;
+
+	*plainTextLength = 0;
+
+	while (offset < length) {
+		AEAD_CHUNK *		chunk = &chunks[numChunks];
+
+		chunk->algo = hsec->algo;
+		chunk->key = hsec->key;
+		chunk->keyLength = hsec->keyLength;
+		chunk->noncePrefix = hsec->iv;
+		chunk->header = hsec->headerBuffer;
+		chunk->headerLength = hsec->frameHeaderLength;
+		chunk->chunkIndex = hsec->chunkCounter + numChunks;
+		chunk->isFinal = (chunk->chunkIndex == (_aeadNumChunks(hsec->fileLength) - 1) ? True : False);
+		chunk->length = ((length - offset) < AEAD_FRAME_CHUNK_SIZE ? (length - offset) : AEAD_FRAME_CHUNK_SIZE) - AEAD_TAG_LENGTH;
+		chunk->in = &cipherText[offset];
+		chunk->out = &hsec->data[numChunks * AEAD_CHUNK_SIZE];
+		chunk->tag = &cipherText[offset + chunk->length];
+		chunk->isEncrypt = False;
+		chunk->err = 0;
+
+		*plainTextLength += chunk->length;
+		offset += chunk->length + AEAD_TAG_LENGTH;
+		numChunks++;
 	}
 
-	hsec->blockSize = SECRETRW_BLOCK_SIZE;
-	hsec->algo = a;
-	hsec->counter = 0;
-	hsec->blockCounter = 0;
-
-	hsec->fptrKey = NULL;
+	failedChunk = _aeadProcessChunks(hsec->hpool, chunks, numChunks);
 
-	hsec->fptrSecret = fopen(pszFilename, "wb");
+	/*
+	** Nothing from this run is written if any chunk fails...
+	*/
+	if (failedChunk >= 0) {
+		if (gcry_err_code(chunks[failedChunk].err) == GPG_ERR_CHECKSUM) {
+			fprintf(
+				stderr, 
+				"Authentication failed for chunk %u, the password is wrong or the image is damaged\n", 
+				chunks[failedChunk].chunkIndex);
+		}
+		else {
+			fprintf(
+				stderr, 
+				"Failed to decrypt chunk %u: %s\n", 
+				chunks[failedChunk].chunkIndex, 
+				gcry_strerror(chunks[failedChunk].err));
+		}
 
-	if (hsec->fptrSecret == NULL) {
-		fprintf(stderr, "Failed to open file writer with file %s: %s\n", pszFilename, strerror(errno));
-		return NULL;
+		return -1;
 	}
 
-	return hsec;
-}
-
-void wrtr_close(HSECRW hsec) {
-	if (hsec->fptrSecret != NULL) {
-		fclose(hsec->fptrSecret);
-	}
+	hsec->chunkCounter += numChunks;
 
-	free(hsec);
+	return 0;
 }
 
-uint32_t wrtr_get_block_size(HSECRW hsec) {
-	return hsec->blockSize;
-}
+/*
+** Stage the compression header from the start of the plaintext, then
+** stream the rest through the decompressor to the secret file...
+*/
+static int _wrtr_write_decompressed(HSECRW hsec, uint8_t * plainText, uint32_t length) {
+	COMPRESSION_HEADER	compressionHeader;
+	uint32_t			headerBytes;
 
-boolean wrtr_has_more_blocks(HSECRW hsec) {
-	return (hsec->counter < hsec->encryptionBufferLength) ? True : False;
-}
+	if (hsec->compressionHeaderLength < sizeof(COMPRESSION_HEADER)) {
+		headerBytes = sizeof(COMPRESSION_HEADER) - hsec->compressionHeaderLength;
 
-int wrtr_set_keystream_file(HSECRW hsec, const char * pszFilename) {
-	hsec->fptrKey = fopen(pszFilename, "rb");
+		if (headerBytes > length) {
+			headerBytes = length;
+		}
 
-	if (hsec->fptrKey == NULL) {
-		fprintf(stderr, "Failed to open keystream file %s: %s\n", pszFilename, strerror(errno));
-		return -1;
-	}
+		memcpy(&hsec->compressionHeader[hsec->compressionHeaderLength], plainText, headerBytes);
+		hsec->compressionHeaderLength += headerBytes;
 
-	return 0;
-}
+		plainText += headerBytes;
+		length -= headerBytes;
 
-int wrtr_set_key_aes(HSECRW hsec, uint8_t * key, uint32_t keyLength) {
-	if (hsec->algo == aes256) {
-		int			err;
+		if (hsec->compressionHeaderLength < sizeof(COMPRESSION_HEADER)) {
+			return 0;
+		}
 
-		err = gcry_cipher_open(
-							&hsec->cipherHandle,
-							GCRY_CIPHER_RIJNDAEL256,
-							GCRY_CIPHER_MODE_CBC,
-							0);
+		memcpy(&compressionHeader, hsec->compressionHeader, sizeof(COMPRESSION_HEADER));
 
-		if (err) {
-			fprintf(stderr, "Failed to open cipher with gcrypt\n");
-			fclose(hsec->fptrSecret);
-			free(hsec);
+		if (compressionHeader.algo == compression_none || !cmp_is_available((compression_algo)compressionHeader.algo)) {
+			fprintf(stderr, "Unsupported compression algorithm %u in image\n", compressionHeader.algo);
 			return -1;
 		}
 
-		err = gcry_cipher_setkey(
-							hsec->cipherHandle,
-							(const void *)key,
-							keyLength);
+		hsec->originalLength = compressionHeader.originalLength;
 
-		if (err) {
-			fprintf(stderr, "Failed to set key with gcrypt: %s\n", gcry_strerror(err));
-			fclose(hsec->fptrSecret);
-			free(hsec);
+		hsec->hdcmp = dcmp_open(
+							(compression_algo)compressionHeader.algo, 
+							hsec->fptrSecret, 
+							hsec->originalLength);
+
+		if (hsec->hdcmp == NULL) {
 			return -1;
 		}
 	}
 
+	if (length > 0) {
+		return dcmp_write(hsec->hdcmp, plainText, length);
+	}
+
 	return 0;
 }
 
-int wrtr_write_decrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength) {
-	CLOAK_HEADER		header;
-	int					i;
-	int					err;
-	uint32_t			blklen;
+/*
+** Decrypt a whole number of cipher blocks into the data buffer
+** and write out the plaintext, stopping at the original file length...
+*/
+static int _wrtr_decrypt_and_write(HSECRW hsec, uint8_t * cipherText, uint32_t length) {
+	uint8_t *			plainText;
+	uint32_t			bytesToWrite;
+	uint32_t			writeLimit;
+	uint32_t			skipLength;
+
+	if (hsec->isVerifyOnly) {
+		return 0;
+	}
 
-	if (bufferLength < hsec->blockSize) {
-		fprintf(stderr, "Buffer must be at least 1 block long: %u bytes", hsec->blockSize);
-		return -1;
+	if (hsec->algo == aes256) {
+		if (_wrtr_decrypt_cbc(hsec, cipherText, length)) {
+			return -1;
+		}
+	}
+	else if (secrw_is_aead_algo(hsec->algo)) {
+		if (_wrtr_decrypt_aead(hsec, cipherText, length, &length)) {
+			return -1;
+		}
+	}
+	else if (hsec->algo == xor) {
+		if ((hsec->keystreamOffset + length) > hsec->keystreamLength) {
+			fprintf(stderr, "Got EOF from keystream file\n");
+			return -1;
+		}
+
+		xorBuffers(hsec->data, cipherText, &hsec->keystream[hsec->keystreamOffset], length);
+		hsec->keystreamOffset += length;
+	}
+	else {
+		memcpy(hsec->data, cipherText, length);
 	}
 
-	if (hsec->blockCounter == 0) {
-		int bufferIndex = 0;
+	plainText = hsec->data;
+	writeLimit = hsec->fileLength;
 
-		/*
-		** XOR the header with random data...
-		*/
-		xorBuffer(buffer, &random_block[2048], sizeof(CLOAK_HEADER));
-		memcpy(&header, buffer, sizeof(CLOAK_HEADER));
+	/*
+	** The first cipher unit of a range may start before it...
+	*/
+	if (hsec->isRange) {
+		if (hsec->bytesWritten < hsec->rangeOffset) {
+			skipLength = (uint32_t)(hsec->rangeOffset - hsec->bytesWritten);
+
+			if (skipLength > length) {
+				skipLength = length;
+			}
 
-		bufferIndex = sizeof(CLOAK_HEADER);
+			plainText += skipLength;
+			length -= skipLength;
+			hsec->bytesWritten += skipLength;
+		}
 
-		hsec->fileLength = header.fileLength;
-		hsec->encryptionBufferLength = header.encryptionBufferLength;
-		hsec->dataFrameLength  = header.dataFrameLength;
+		writeLimit = (uint32_t)(hsec->rangeOffset + hsec->rangeLength);
+	}
 
-		hsec->numBlocks = hsec->encryptionBufferLength / hsec->blockSize;
+	bytesToWrite = (hsec->bytesWritten < writeLimit ? writeLimit - hsec->bytesWritten : 0);
 
-		hsec->data = (uint8_t *)malloc(hsec->dataFrameLength);
+	if (bytesToWrite > length) {
+		bytesToWrite = length;
+	}
 
-		if (hsec->data == NULL) {
-			fprintf(stderr, "Failed to allocate %u bytes for data buffer\n", hsec->dataFrameLength);
+	if (hsec->isCompressed) {
+		if (_wrtr_write_decompressed(hsec, plainText, bytesToWrite)) {
 			return -1;
 		}
+	}
+	else if (fwrite(plainText, 1, bytesToWrite, hsec->fptrSecret) < bytesToWrite) {
+		fprintf(stderr, "Failed to write secret file: %s\n", strerror(errno));
+		return -1;
+	}
 
-		if (hsec->algo == aes256) {
-			uint8_t *		iv;
+	hsec->bytesWritten += bytesToWrite;
 
-			blklen = gcry_cipher_get_algo_blklen(GCRY_CIPHER_RIJNDAEL256);
+	if (hsec->isCompressed && hsec->bytesWritten == hsec->fileLength) {
+		if (hsec->hdcmp == NULL || dcmp_finish(hsec->hdcmp)) {
+			return -1;
+		}
 
-			iv = (uint8_t *)malloc(blklen);
+		if (dcmp_get_output_length(hsec->hdcmp) != hsec->originalLength) {
+			fprintf(
+				stderr, 
+				"Decompressed %" PRIu64 " bytes, expected %u, the image is damaged\n", 
+				dcmp_get_output_length(hsec->hdcmp), 
+				hsec->originalLength);
+			return -1;
+		}
+	}
 
-			if (iv == NULL) {
-				fprintf(stderr, "Failed to allocate memory for IV block\n");
-				free(hsec->data);
-				return -1;
-			}
+	return 0;
+}
 
-			memcpy(iv, &buffer[bufferIndex], blklen);
-			bufferIndex += blklen;
+int wrtr_write_decrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength) {
+	uint32_t			length;
 
-			err = gcry_cipher_setiv(
-								hsec->cipherHandle,
-								iv,
-								blklen);
+	while (bufferLength > 0 && wrtr_has_more_blocks(hsec)) {
+		if (hsec->counter < hsec->headerLength) {
+			length = hsec->headerLength - hsec->counter;
 
-			if (err) {
-				fprintf(stderr, "Failed to set IV with gcrypt\n");
-				free(iv);
-				free(hsec->data);
-				fclose(hsec->fptrSecret);
-				free(hsec);
-				return -1;
+			if (length > bufferLength) {
+				length = bufferLength;
 			}
 
-			free(iv);
+			memcpy(&hsec->headerBuffer[hsec->counter], buffer, length);
+			hsec->crc = crc32c(hsec->crc, buffer, length);
 		}
+		else if (hsec->isRange && hsec->counter < (hsec->headerLength + hsec->rangeCipherStart)) {
+			length = (hsec->headerLength + hsec->rangeCipherStart) - hsec->counter;
 
-		memcpy(hsec->data, &buffer[bufferIndex], (hsec->blockSize - bufferIndex));
-			
-		hsec->counter += (hsec->blockSize - bufferIndex);
-	}
-	else if (hsec->blockCounter < hsec->numBlocks) {
-		memcpy(&hsec->data[hsec->counter], buffer, bufferLength);
-		hsec->counter += hsec->blockSize;
-	}
-	else if (hsec->blockCounter == hsec->numBlocks) {
-		memcpy(&hsec->data[hsec->counter], buffer, (hsec->encryptionBufferLength - hsec->counter));
+			if (length > bufferLength) {
+				length = bufferLength;
+			}
 
-		if (hsec->algo == aes256) {
-			err = gcry_cipher_decrypt(
-									hsec->cipherHandle,
-									hsec->data,
-									hsec->encryptionBufferLength,
-									NULL,
-									0);
+			_wrtr_discard_before_range(hsec, buffer, length);
+		}
+		else if (hsec->counter >= (hsec->headerLength + hsec->cipherLength)) {
+			length = (hsec->headerLength + hsec->cipherLength + hsec->trailerLength) - hsec->counter;
 
-			if (err) {
-				fprintf(stderr, "Failed to decrypt buffer: %s", gcry_strerror(err));
-				free(hsec);
-				return -1;
+			if (length > bufferLength) {
+				length = bufferLength;
 			}
 
-			gcry_cipher_close(hsec->cipherHandle);
+			memcpy(
+				&hsec->trailer[hsec->counter - (hsec->headerLength + hsec->cipherLength)], 
+				buffer, 
+				length);
 		}
-		else if (hsec->algo == xor) {
-			for (i = 0;i < hsec->encryptionBufferLength;i++) {
-				hsec->data[i] = hsec->data[i] ^ (uint8_t)fgetc(hsec->fptrKey);
+		else {
+			length = (hsec->headerLength + _wrtr_get_cipher_end(hsec)) - hsec->counter;
+
+			if (length > bufferLength) {
+				length = bufferLength;
+			}
+
+			if (length > (hsec->cipherBufferCapacity - hsec->cipherBufferLength)) {
+				length = hsec->cipherBufferCapacity - hsec->cipherBufferLength;
 			}
 
-			fclose(hsec->fptrKey);
+			memcpy(&hsec->cipherBuffer[hsec->cipherBufferLength], buffer, length);
+			hsec->cipherBufferLength += length;
+			hsec->crc = crc32c(hsec->crc, buffer, length);
 		}
 
-		fwrite(hsec->data, 1, hsec->fileLength, hsec->fptrSecret);
+		hsec->counter += length;
+		buffer += length;
+		bufferLength -= length;
 
-		free(hsec->data);
+		/*
+		** The header length isn't known until its version has been seen...
+		*/
+		if (hsec->counter == hsec->headerLength && hsec->frameHeaderLength == 0) {
+			_wrtr_detect_header_version(hsec);
+		}
+		else if (hsec->counter == hsec->headerLength && hsec->data == NULL) {
+			if (_wrtr_read_header(hsec)) {
+				return -1;
+			}
+		}
 
-		return 1;
-	}
-	else {
-		return 1;
+		/*
+		** The buffer size is a multiple of the cipher block (or AEAD chunk) size
+		** and the ciphertext ends on a boundary, so we always decrypt whole blocks...
+		*/
+		if (hsec->cipherBufferLength == hsec->cipherBufferCapacity || 
+			(hsec->data != NULL && 
+				hsec->counter >= (hsec->headerLength + _wrtr_get_cipher_end(hsec)) && 
+				hsec->cipherBufferLength > 0))
+		{
+			if (_wrtr_decrypt_and_write(hsec, hsec->cipherBuffer, hsec->cipherBufferLength)) {
+				return -1;
+			}
+
+			hsec->cipherBufferLength = 0;
+		}
+
+		if (hsec->data != NULL && hsec->trailerLength > 0 && !hsec->isRange && !wrtr_has_more_blocks(hsec)) {
+			if (!wrtr_is_verified(hsec)) {
+				fprintf(stderr, "CRC check failed, the image is damaged\n");
+				return -1;
+			}
+		}
 	}
-		
+
 	hsec->blockCounter++;
 
-	return 0;
+	return (wrtr_has_more_blocks(hsec) ? 0 : 1);
 }
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include "cloak_types.h"
+#include "compress.h"
 
 #ifndef __INCL_READER
 #define __INCL_READER
@@ -12,26 +13,107 @@ typedef struct _secret_rw_handle * HSECRW;
 typedef enum {
 	xor,
 	aes256,
-	none
+	none,
+	aes256gcm,
+	chacha20
 }
 encryption_algo;
 
-HSECRW      rdr_open(const char * pszFilename, encryption_algo a);
+/*
+** What a version 2 frame header says about the frame, read from the
+** (still obfuscated) first secrw_get_header_length() bytes of a frame...
+*/
+typedef struct {
+	uint8_t				version;
+	uint8_t				quality;
+	encryption_algo		algo;
+	uint64_t			fileLength;
+	uint64_t			dataFrameLength;
+	boolean				isCompressed;
+	boolean				isArchive;
+	boolean				isShard;
+}
+SECRW_FRAME_INFO;
+
+#define SECRW_MAX_MEMBER_NAME_LENGTH	255
+#define SECRW_MAX_ARCHIVE_MEMBERS		65536
+
+/*
+** An archive member is a frame of its own, following the table of
+** contents frame. The offset is from the end of the table of contents...
+*/
+typedef struct {
+	char				szName[SECRW_MAX_MEMBER_NAME_LENGTH + 1];
+	uint64_t			fileLength;
+	uint64_t			frameOffset;
+	uint64_t			frameLength;
+}
+SECRW_ARCHIVE_MEMBER;
+
+#define SECRW_SHARD_SET_ID_LENGTH		8
+
+/*
+** One shard of an erasure coded set, the set ID ties together shards
+** merged at the same time. The shard data is shardLength bytes long...
+*/
+typedef struct {
+	uint8_t				setID[SECRW_SHARD_SET_ID_LENGTH];
+	uint8_t				numDataShards;
+	uint8_t				numParityShards;
+	uint8_t				index;
+	uint64_t			fileLength;
+	uint32_t			shardLength;
+}
+SECRW_SHARD;
+
+boolean		secrw_is_keyed_algo(encryption_algo a);
+boolean		secrw_is_aead_algo(encryption_algo a);
+const char *	secrw_get_algo_name(encryption_algo a);
+int			secrw_create_pad_pool(const char * pszPadFilename);
+boolean		secrw_is_pad_pool(const char * pszPadFilename);
+uint32_t	secrw_get_header_length(void);
+int			secrw_read_frame_info(const uint8_t * frame, uint32_t frameLength, SECRW_FRAME_INFO * info);
+
+HSECRW      rdr_open(const char * pszFilename, encryption_algo a, compression_algo c, uint8_t quality);
+HSECRW		rdr_open_archive_toc(
+					SECRW_ARCHIVE_MEMBER * members, 
+					uint32_t numMembers, 
+					encryption_algo a, 
+					uint8_t quality);
+HSECRW		rdr_open_shard(
+					const SECRW_SHARD * shard, 
+					const uint8_t * shardData, 
+					encryption_algo a, 
+					uint8_t quality);
 int 		rdr_encrypt_aes256(HSECRW hsec, uint8_t * key, uint32_t keyLength);
 int         rdr_encrypt_xor(HSECRW hsec, const char * pszKeystreamFilename);
+int 		rdr_encrypt_aead(HSECRW hsec, uint8_t * key, uint32_t keyLength);
 void        rdr_close(HSECRW hsec);
 uint32_t    rdr_get_block_size(HSECRW hsec);
 uint32_t    rdr_get_data_length(HSECRW hsec);
 uint32_t    rdr_get_file_length(HSECRW hsec);
 boolean     rdr_has_more_blocks(HSECRW hsec);
 uint32_t 	rdr_read_encrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength);
+uint32_t 	rdr_read_encrypted_span(HSECRW hsec, uint8_t ** span, uint32_t maxLength);
 
 HSECRW 		wrtr_open(const char * pszFilename, encryption_algo a);
 void 		wrtr_close(HSECRW hsec);
+void 		wrtr_discard(HSECRW hsec);
+HSECRW 		wrtr_open_verify(encryption_algo a);
+HSECRW 		wrtr_open_archive_toc(encryption_algo a);
+SECRW_ARCHIVE_MEMBER *	wrtr_get_archive_members(HSECRW hsec, uint32_t * numMembers);
+HSECRW 		wrtr_open_shard(encryption_algo a);
+uint8_t *	wrtr_get_shard(HSECRW hsec, SECRW_SHARD * shard);
+uint32_t 	wrtr_get_data_length(HSECRW hsec);
+int 		wrtr_set_range(HSECRW hsec, uint64_t offset, uint64_t length);
+uint32_t 	wrtr_get_skip_length(HSECRW hsec);
+int 		wrtr_skip(HSECRW hsec, uint32_t length);
+boolean 	wrtr_is_verified(HSECRW hsec);
 uint32_t 	wrtr_get_block_size(HSECRW hsec);
 boolean 	wrtr_has_more_blocks(HSECRW hsec);
 int 		wrtr_set_keystream_file(HSECRW hsec, const char * pszFilename);
 int 		wrtr_set_key_aes(HSECRW hsec, uint8_t * key, uint32_t keyLength);
+int 		wrtr_set_key_aead(HSECRW hsec, uint8_t * key, uint32_t keyLength);
 int 		wrtr_write_decrypted_block(HSECRW hsec, uint8_t * buffer, uint32_t bufferLength);
 
 #endif
@@ -27,6 +27,7 @@ SOFTWARE.
 #include "cloak.h"
 #include "cloak_types.h"
 #include "utils.h"
+#include "imgrw.h"
 #include "test.h"
 
 
@@ -69,6 +70,57 @@ static int fcompare(const char * pszFile1, const char * pszFile2) {
     return 0;
 }
 
+/*
+** Compare length bytes of pszFile1 starting at offset with the whole of
+** pszRangeFile...
+*/
+static int fcompareRange(const char * pszFile1, uint64_t offset, uint32_t length, const char * pszRangeFile) {
+    FILE *          fp1;
+    FILE *          fp2;
+    uint8_t         buf1[64];
+    uint8_t         buf2[64];
+    uint32_t        bytesToRead;
+    uint32_t        bytesRead1;
+    uint32_t        bytesRead2;
+    int             rtn = 0;
+
+    fp1 = fopen(pszFile1, "rb");
+    fp2 = fopen(pszRangeFile, "rb");
+
+    fseek(fp1, (long)offset, SEEK_SET);
+
+    while (length > 0) {
+        bytesToRead = (length < 64 ? length : 64);
+
+        bytesRead1 = fread(buf1, 1, bytesToRead, fp1);
+        bytesRead2 = fread(buf2, 1, bytesToRead, fp2);
+
+        if (bytesRead1 != bytesRead2) {
+            rtn = -1;
+            break;
+        }
+
+        if (memcmp(buf1, buf2, bytesRead1) != 0) {
+            rtn = 1;
+            break;
+        }
+
+        length -= bytesRead1;
+    }
+
+    /*
+    ** The range file should have nothing after the range...
+    */
+    if (rtn == 0 && fread(buf2, 1, 1, fp2) != 0) {
+        rtn = -1;
+    }
+
+    fclose(fp1);
+    fclose(fp2);
+
+    return rtn;
+}
+
 int test(int testCase) {
     const char *        pszPNGInputFile = "./test/flowers.png";
     const char *        pszPNGOutputFile = "./test/flowers_out.png";
@@ -77,8 +129,12 @@ int test(int testCase) {
     const char *        pszSecretInputFile = "./test/README.md";
     const char *        pszSecretOutputFile = "./test/README.out";
     const char *        pszKeystream = "./test/rand.bin";
+    char *              archiveFiles[2] = {"./test/rand.bin", "./test/README.md"};
+    char *              carrierFiles[3] = {"./test/flowers.png", "./test/album.bmp", "./test/flowers.png"};
+    char *              shardFiles[2] = {"./test/shard_out.3.png", "./test/shard_out.2.bmp"};
     encryption_algo     algo;
     merge_quality       quality;
+    PNG_ENCODE_OPTIONS  pngOptions;
     uint32_t            keyLength = 64U;
     uint8_t             key[keyLength];
     int                 failureCode = 0;
@@ -99,6 +155,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -139,6 +196,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -179,6 +237,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -217,6 +276,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -255,6 +315,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -293,6 +354,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -331,6 +393,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -369,6 +432,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -407,6 +471,7 @@ int test(int testCase) {
                 pszPNGOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -447,6 +512,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -487,6 +553,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -527,6 +594,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 key, 
                 keyLength);
 
@@ -565,6 +633,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -603,6 +672,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -641,6 +711,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -679,6 +750,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -717,6 +789,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -755,6 +828,7 @@ int test(int testCase) {
                 pszBMPOutputFile, 
                 quality, 
                 algo, 
+                compression_none, 
                 NULL, 
                 0U);
 
@@ -769,6 +843,1012 @@ int test(int testCase) {
 
             failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
 
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_HIGH:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: High\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = aes256gcm;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_MED:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: Medium\n");
+            
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = aes256gcm;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_LOW:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: Low\n");
+            
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_low;
+            algo = aes256gcm;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_GCM_HIGH:
+            printf("Running test - File type: BMP; Encryption: AES-GCM; Quality: High\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = aes256gcm;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_GCM_MED:
+            printf("Running test - File type: BMP; Encryption: AES-GCM; Quality: Medium\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = aes256gcm;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_GCM_LOW:
+            printf("Running test - File type: BMP; Encryption: AES-GCM; Quality: Low\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_low;
+            algo = aes256gcm;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_HIGH:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: High\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = chacha20;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_MED:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: Medium\n");
+            
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = chacha20;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_LOW:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: Low\n");
+            
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_low;
+            algo = chacha20;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_CHACHA_HIGH:
+            printf("Running test - File type: BMP; Encryption: ChaCha20-Poly1305; Quality: High\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = chacha20;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_CHACHA_MED:
+            printf("Running test - File type: BMP; Encryption: ChaCha20-Poly1305; Quality: Medium\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = chacha20;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_CHACHA_LOW:
+            printf("Running test - File type: BMP; Encryption: ChaCha20-Poly1305; Quality: Low\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_low;
+            algo = chacha20;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_ZLIB:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: High; Compression: zlib\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = aes256gcm;
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_zlib, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_XOR_ZLIB:
+            printf("Running test - File type: BMP; Encryption: XOR; Quality: Medium; Compression: zlib\n");
+            
+            quality = quality_medium;
+            algo = xor;
+
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                pszKeystream, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_zlib, 
+                NULL, 
+                0U);
+
+            extract(
+                pszBMPOutputFile,
+                pszKeystream,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                NULL,
+                0U);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_DETECT:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: Low; Detected from the frame header\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality_low, 
+                chacha20, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            quality = quality_high;
+            algo = none;
+
+            if (detectFrame(pszPNGOutputFile, &quality, &algo) || quality != quality_low || algo != chacha20) {
+                printf("Test failed! Frame header not detected\n");
+                failureCode = 1;
+                break;
+            }
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_ARCHIVE:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: Medium; Archive member\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = aes256gcm;
+
+            mergeArchive(
+                pszPNGInputFile, 
+                archiveFiles, 
+                2, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extractMember(
+                pszPNGOutputFile,
+                NULL,
+                "README.md",
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_AES_RANGE:
+            printf("Running test - File type: BMP; Encryption: AES; Quality: Medium; Byte range\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = aes256;
+
+            merge(
+                pszBMPInputFile, 
+                pszKeystream, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            /*
+            ** Starts and ends part way through a cipher block...
+            */
+            extractRange(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength,
+                70001U,
+                65541U);
+
+            failureCode = fcompareRange(pszKeystream, 70001U, 65541U, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_BMP_GCM_SHARDS:
+            printf("Running test - File type: PNG & BMP; Encryption: AES-GCM; Quality: High; Erasure coded shards\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = aes256gcm;
+
+            mergeShards(
+                carrierFiles, 
+                3, 
+                1, 
+                pszSecretInputFile, 
+                NULL, 
+                "./test/shard_out.png", 
+                quality, 
+                algo, 
+                key, 
+                keyLength);
+
+            /*
+            ** Without the first data shard...
+            */
+            extractShards(
+                shardFiles,
+                2,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_BMP_CHACHA_IN_PLACE:
+            printf("Running test - File type: BMP; Encryption: ChaCha20; Quality: High; In place\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = chacha20;
+
+            /*
+            ** Make a copy of the image to patch, then merge into it in place...
+            */
+            merge(
+                pszBMPInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                none, 
+                compression_none, 
+                NULL, 
+                0);
+
+            merge(
+                pszBMPOutputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszBMPOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszBMPOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_FAST_PROFILE:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: High; Fast PNG profile\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = chacha20;
+
+            imgwrtr_get_png_profile("fast", &pngOptions);
+            imgwrtr_set_png_options(&pngOptions);
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            imgwrtr_get_png_profile("balanced", &pngOptions);
+            imgwrtr_set_png_options(&pngOptions);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_GCM_THREADS:
+            printf("Running test - File type: PNG; Encryption: AES-GCM; Quality: Medium; PNG compressed on 3 threads\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_medium;
+            algo = aes256gcm;
+
+            /*
+            ** Force the threaded encoder, even on a single core...
+            */
+            imgwrtr_set_png_threads(3);
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            imgwrtr_set_png_threads(0);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_OPTIMIZE:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: Low; Optimized PNG\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_low;
+            algo = chacha20;
+
+            imgwrtr_set_png_optimize(True, 0.0);
+
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            imgwrtr_set_png_optimize(False, 0.0);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
+            if (failureCode > 0) {
+                printf("Test failed! Files are different\n");
+            }
+            else if (failureCode < 0) {
+                printf("Test failed! Files are different sizes\n");
+            }
+            else {
+                printf("Test passed!\n");
+            }
+            break;
+
+        case TEST_PNG_CHACHA_ONTO_SOURCE:
+            printf("Running test - File type: PNG; Encryption: ChaCha20-Poly1305; Quality: High; Onto the source\n");
+
+            keyLength = getKey(key, 64U, "password");
+
+            quality = quality_high;
+            algo = chacha20;
+
+            /*
+            ** Make a copy of the image, then merge into it naming it by
+            ** another path, the rows are streamed from the image being
+            ** replaced...
+            */
+            merge(
+                pszPNGInputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                pszPNGOutputFile, 
+                quality, 
+                none, 
+                compression_none, 
+                NULL, 
+                0);
+
+            merge(
+                pszPNGOutputFile, 
+                pszSecretInputFile, 
+                NULL, 
+                "./test/../test/flowers_out.png", 
+                quality, 
+                algo, 
+                compression_none, 
+                key, 
+                keyLength);
+
+            extract(
+                pszPNGOutputFile,
+                NULL,
+                pszSecretOutputFile,
+                quality,
+                algo,
+                key,
+                keyLength);
+
+            failureCode = fcompare(pszSecretInputFile, pszSecretOutputFile);
+
             if (failureCode > 0) {
                 printf("Test failed! Files are different\n");
             }
@@ -19,6 +19,29 @@
 #define TEST_BMP_NONE_HIGH                       16
 #define TEST_BMP_NONE_MED                        17
 #define TEST_BMP_NONE_LOW                        18
+#define TEST_PNG_GCM_HIGH                        19
+#define TEST_PNG_GCM_MED                         20
+#define TEST_PNG_GCM_LOW                         21
+#define TEST_BMP_GCM_HIGH                        22
+#define TEST_BMP_GCM_MED                         23
+#define TEST_BMP_GCM_LOW                         24
+#define TEST_PNG_CHACHA_HIGH                     25
+#define TEST_PNG_CHACHA_MED                      26
+#define TEST_PNG_CHACHA_LOW                      27
+#define TEST_BMP_CHACHA_HIGH                     28
+#define TEST_BMP_CHACHA_MED                      29
+#define TEST_BMP_CHACHA_LOW                      30
+#define TEST_PNG_GCM_ZLIB                        31
+#define TEST_BMP_XOR_ZLIB                        32
+#define TEST_PNG_CHACHA_DETECT                   33
+#define TEST_PNG_GCM_ARCHIVE                     34
+#define TEST_BMP_AES_RANGE                       35
+#define TEST_PNG_BMP_GCM_SHARDS                  36
+#define TEST_BMP_CHACHA_IN_PLACE                 37
+#define TEST_PNG_CHACHA_FAST_PROFILE             38
+#define TEST_PNG_GCM_THREADS                     39
+#define TEST_PNG_CHACHA_OPTIMIZE                 40
+#define TEST_PNG_CHACHA_ONTO_SOURCE              41
 
 int test(int testCase);
 
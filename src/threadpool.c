@@ -0,0 +1,221 @@
+/******************************************************************************
+Copyright (c) 2023 Guy Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+typedef struct _tp_task {
+    tp_job              job;
+    void *              arg;
+
+    struct _tp_task *   next;
+}
+TP_TASK;
+
+struct _thread_pool {
+    pthread_t           threads[THREADPOOL_MAX_THREADS];
+    int                 numThreads;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      taskAvailable;
+    pthread_cond_t      allDone;
+
+    TP_TASK *           head;
+    TP_TASK *           tail;
+
+    int                 numPending;
+    int                 isShutdown;
+};
+
+static void * _worker(void * p) {
+    HTHREADPOOL         hpool = (HTHREADPOOL)p;
+    TP_TASK *           task;
+
+    while (1) {
+        pthread_mutex_lock(&hpool->lock);
+
+        while (hpool->head == NULL && !hpool->isShutdown) {
+            pthread_cond_wait(&hpool->taskAvailable, &hpool->lock);
+        }
+
+        if (hpool->head == NULL) {
+            pthread_mutex_unlock(&hpool->lock);
+            break;
+        }
+
+        task = hpool->head;
+        hpool->head = task->next;
+
+        if (hpool->head == NULL) {
+            hpool->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&hpool->lock);
+
+        task->job(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&hpool->lock);
+
+        hpool->numPending--;
+
+        if (hpool->numPending == 0) {
+            pthread_cond_broadcast(&hpool->allDone);
+        }
+
+        pthread_mutex_unlock(&hpool->lock);
+    }
+
+    return NULL;
+}
+
+int tp_get_num_cores(void) {
+    long            numCores;
+
+    numCores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (numCores < 1) {
+        numCores = 1;
+    }
+    else if (numCores > THREADPOOL_MAX_THREADS) {
+        numCores = THREADPOOL_MAX_THREADS;
+    }
+
+    return (int)numCores;
+}
+
+HTHREADPOOL tp_create(int numThreads) {
+    HTHREADPOOL         hpool;
+    int                 i;
+
+    if (numThreads < 1) {
+        numThreads = tp_get_num_cores();
+    }
+    else if (numThreads > THREADPOOL_MAX_THREADS) {
+        numThreads = THREADPOOL_MAX_THREADS;
+    }
+
+    hpool = (HTHREADPOOL)malloc(sizeof(struct _thread_pool));
+
+    if (hpool == NULL) {
+        fprintf(stderr, "Failed to allocate memory for thread pool\n");
+        return NULL;
+    }
+
+    hpool->head = NULL;
+    hpool->tail = NULL;
+    hpool->numPending = 0;
+    hpool->isShutdown = 0;
+    hpool->numThreads = 0;
+
+    pthread_mutex_init(&hpool->lock, NULL);
+    pthread_cond_init(&hpool->taskAvailable, NULL);
+    pthread_cond_init(&hpool->allDone, NULL);
+
+    for (i = 0;i < numThreads;i++) {
+        if (pthread_create(&hpool->threads[i], NULL, _worker, hpool)) {
+            fprintf(stderr, "Failed to create worker thread %d\n", i);
+            break;
+        }
+
+        hpool->numThreads++;
+    }
+
+    if (hpool->numThreads == 0) {
+        tp_destroy(hpool);
+        return NULL;
+    }
+
+    return hpool;
+}
+
+void tp_destroy(HTHREADPOOL hpool) {
+    int                 i;
+
+    pthread_mutex_lock(&hpool->lock);
+    hpool->isShutdown = 1;
+    pthread_cond_broadcast(&hpool->taskAvailable);
+    pthread_mutex_unlock(&hpool->lock);
+
+    for (i = 0;i < hpool->numThreads;i++) {
+        pthread_join(hpool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&hpool->allDone);
+    pthread_cond_destroy(&hpool->taskAvailable);
+    pthread_mutex_destroy(&hpool->lock);
+
+    free(hpool);
+}
+
+int tp_get_num_threads(HTHREADPOOL hpool) {
+    return hpool->numThreads;
+}
+
+int tp_submit(HTHREADPOOL hpool, tp_job job, void * arg) {
+    TP_TASK *           task;
+
+    task = (TP_TASK *)malloc(sizeof(TP_TASK));
+
+    if (task == NULL) {
+        fprintf(stderr, "Failed to allocate memory for thread pool task\n");
+        return -1;
+    }
+
+    task->job = job;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&hpool->lock);
+
+    if (hpool->tail == NULL) {
+        hpool->head = task;
+    }
+    else {
+        hpool->tail->next = task;
+    }
+
+    hpool->tail = task;
+    hpool->numPending++;
+
+    pthread_cond_signal(&hpool->taskAvailable);
+    pthread_mutex_unlock(&hpool->lock);
+
+    return 0;
+}
+
+/*
+** Block until every task submitted so far has completed...
+*/
+void tp_wait(HTHREADPOOL hpool) {
+    pthread_mutex_lock(&hpool->lock);
+
+    while (hpool->numPending > 0) {
+        pthread_cond_wait(&hpool->allDone, &hpool->lock);
+    }
+
+    pthread_mutex_unlock(&hpool->lock);
+}
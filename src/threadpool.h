@@ -0,0 +1,18 @@
+#ifndef __INCL_THREADPOOL
+#define __INCL_THREADPOOL
+
+#define THREADPOOL_MAX_THREADS                  64
+
+typedef void (* tp_job)(void * arg);
+
+struct _thread_pool;
+typedef struct _thread_pool *   HTHREADPOOL;
+
+int             tp_get_num_cores(void);
+HTHREADPOOL     tp_create(int numThreads);
+void            tp_destroy(HTHREADPOOL hpool);
+int             tp_get_num_threads(HTHREADPOOL hpool);
+int             tp_submit(HTHREADPOOL hpool, tp_job job, void * arg);
+void            tp_wait(HTHREADPOOL hpool);
+
+#endif
@@ -29,8 +29,28 @@ SOFTWARE.
 #include <conio.h>
 #else
 #include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+
 #include "random_block.h"
 #include "utils.h"
 
@@ -55,12 +75,20 @@ static HMEM _handlePool[HMEM_POOL_SIZE];
 static int  _currentHandle = 0;
 #endif
 
-int generateKeystreamFile(const char * pszKeystreamFile, uint32_t numBytes) {
-    uint32_t    byteCounter;
+/*
+** Pads can be large (a pad pool is typically many MB), so read the
+** random device in big blocks rather than a byte at a time...
+*/
+#define KEYSTREAM_BLOCK_SIZE            65536
+
+int generateKeystreamFile(const char * pszKeystreamFile, uint64_t numBytes) {
+    uint8_t     buffer[KEYSTREAM_BLOCK_SIZE];
+    uint64_t    byteCounter;
+    size_t      blockLength;
     FILE *      fptrRand;
     FILE *      fptrOutput;
 
-    fptrRand = fopen("/dev/random", "rb");
+    fptrRand = fopen("/dev/urandom", "rb");
 
     if (fptrRand == NULL) {
         fprintf(stderr, "FATAL: Failed to open random device\n\n");
@@ -71,16 +99,33 @@ int generateKeystreamFile(const char * pszKeystreamFile, uint32_t numBytes) {
 
     if (fptrOutput == NULL) {
         fprintf(stderr, "FATAL: Failed to open output file '%s'\n\n", pszKeystreamFile);
+        fclose(fptrRand);
         return(-1);
     }
 
     byteCounter = 0;
 
     while (byteCounter < numBytes) {
-        fputc(fgetc(fptrRand), fptrOutput);
-        byteCounter++;
+        blockLength = KEYSTREAM_BLOCK_SIZE;
+
+        if ((numBytes - byteCounter) < blockLength) {
+            blockLength = (size_t)(numBytes - byteCounter);
+        }
+
+        if (fread(buffer, 1, blockLength, fptrRand) != blockLength || 
+            fwrite(buffer, 1, blockLength, fptrOutput) != blockLength)
+        {
+            fprintf(stderr, "FATAL: Failed to write keystream file '%s'\n\n", pszKeystreamFile);
+            fclose(fptrRand);
+            fclose(fptrOutput);
+            return(-1);
+        }
+
+        byteCounter += blockLength;
     }
 
+    memset(buffer, 0, sizeof(buffer));
+
     fclose(fptrRand);
     fclose(fptrOutput);
 
@@ -120,6 +165,99 @@ uint32_t getFileSizeByName(const char * pszFilename) {
 	return size;
 }
 
+/*
+** Do the two names refer to the same file, through a different path,
+** a symlink or a hard link? False if either doesn't exist...
+*/
+boolean isSameFile(const char * pszFilename1, const char * pszFilename2) {
+#ifndef _WIN32
+    struct stat     st1;
+    struct stat     st2;
+
+    if (stat(pszFilename1, &st1) || stat(pszFilename2, &st2)) {
+        return False;
+    }
+
+    return ((st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) ? True : False);
+#else
+    return (strcmp(pszFilename1, pszFilename2) == 0 ? True : False);
+#endif
+}
+
+double getTimeSeconds(void) {
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1.0e9);
+}
+
+/*
+** Deflate a block as raw deflate with a 32K window, primed with the
+** dictionary if there is one. A block that isn't the last is sync
+** flushed, so blocks compressed apart join up into one stream. Returns
+** 0 or a zlib error, a block that didn't fit the output is an error...
+*/
+int deflateWithDictionary(
+            const uint8_t * in, 
+            uint32_t inLength, 
+            const uint8_t * dict, 
+            uint32_t dictLength, 
+            uint8_t * out, 
+            uint32_t outLength, 
+            int level, 
+            int memLevel, 
+            int strategy, 
+            boolean isFinal, 
+            uint32_t * bytesWritten)
+{
+    z_stream        zstrm;
+    int             rtn;
+
+    memset(&zstrm, 0, sizeof(z_stream));
+
+    rtn = deflateInit2(&zstrm, level, Z_DEFLATED, -15, memLevel, strategy);
+
+    if (rtn != Z_OK) {
+        return rtn;
+    }
+
+    if (dictLength > 0) {
+        rtn = deflateSetDictionary(&zstrm, dict, dictLength);
+
+        if (rtn != Z_OK) {
+            deflateEnd(&zstrm);
+            return rtn;
+        }
+    }
+
+    zstrm.next_in = (uint8_t *)in;
+    zstrm.avail_in = inLength;
+    zstrm.next_out = out;
+    zstrm.avail_out = outLength;
+
+    rtn = deflate(&zstrm, isFinal ? Z_FINISH : Z_SYNC_FLUSH);
+
+    /*
+    ** A sync flush that filled the output may have more to write,
+    ** the output is sized so that never happens...
+    */
+    if ((isFinal && rtn != Z_STREAM_END) || 
+        (!isFinal && (rtn != Z_OK || zstrm.avail_out == 0)) || 
+        zstrm.avail_in != 0)
+    {
+        rtn = Z_BUF_ERROR;
+    }
+    else {
+        *bytesWritten = (uint32_t)zstrm.total_out;
+        rtn = 0;
+    }
+
+    deflateEnd(&zstrm);
+
+    return rtn;
+}
+
 char * getFileExtension(char * pszFilename) {
 	char *			pszExt = NULL;
 	int				i;
@@ -289,10 +427,264 @@ void dbg_free(uint16_t id, void * buffer, const char * pszFile, const int line)
     free(buffer);
 }
 
+/*
+** XOR two sources into the target 64 bytes at a time using SSE2 or NEON
+** where available, with a 64-bit word loop for anything else and the tail.
+** The target may be the same buffer as either source...
+*/
+void xorBuffers(uint8_t * target, const uint8_t * source1, const uint8_t * source2, size_t length) {
+    size_t          i = 0;
+    uint64_t        w1;
+    uint64_t        w2;
+
+#if defined(__SSE2__)
+    for (;(i + 64) <= length;i += 64) {
+        __m128i     a0 = _mm_loadu_si128((const __m128i *)&source1[i]);
+        __m128i     a1 = _mm_loadu_si128((const __m128i *)&source1[i + 16]);
+        __m128i     a2 = _mm_loadu_si128((const __m128i *)&source1[i + 32]);
+        __m128i     a3 = _mm_loadu_si128((const __m128i *)&source1[i + 48]);
+        __m128i     b0 = _mm_loadu_si128((const __m128i *)&source2[i]);
+        __m128i     b1 = _mm_loadu_si128((const __m128i *)&source2[i + 16]);
+        __m128i     b2 = _mm_loadu_si128((const __m128i *)&source2[i + 32]);
+        __m128i     b3 = _mm_loadu_si128((const __m128i *)&source2[i + 48]);
+
+        _mm_storeu_si128((__m128i *)&target[i], _mm_xor_si128(a0, b0));
+        _mm_storeu_si128((__m128i *)&target[i + 16], _mm_xor_si128(a1, b1));
+        _mm_storeu_si128((__m128i *)&target[i + 32], _mm_xor_si128(a2, b2));
+        _mm_storeu_si128((__m128i *)&target[i + 48], _mm_xor_si128(a3, b3));
+    }
+#elif defined(__ARM_NEON)
+    for (;(i + 64) <= length;i += 64) {
+        uint8x16_t  a0 = vld1q_u8(&source1[i]);
+        uint8x16_t  a1 = vld1q_u8(&source1[i + 16]);
+        uint8x16_t  a2 = vld1q_u8(&source1[i + 32]);
+        uint8x16_t  a3 = vld1q_u8(&source1[i + 48]);
+
+        vst1q_u8(&target[i], veorq_u8(a0, vld1q_u8(&source2[i])));
+        vst1q_u8(&target[i + 16], veorq_u8(a1, vld1q_u8(&source2[i + 16])));
+        vst1q_u8(&target[i + 32], veorq_u8(a2, vld1q_u8(&source2[i + 32])));
+        vst1q_u8(&target[i + 48], veorq_u8(a3, vld1q_u8(&source2[i + 48])));
+    }
+#endif
+
+    for (;(i + sizeof(uint64_t)) <= length;i += sizeof(uint64_t)) {
+        memcpy(&w1, &source1[i], sizeof(uint64_t));
+        memcpy(&w2, &source2[i], sizeof(uint64_t));
+
+        w1 ^= w2;
+
+        memcpy(&target[i], &w1, sizeof(uint64_t));
+    }
+
+    for (;i < length;i++) {
+        target[i] = source1[i] ^ source2[i];
+    }
+}
+
 void xorBuffer(uint8_t * target, uint8_t * source, size_t length) {
-    uint32_t        i;
+    xorBuffers(target, target, source, length);
+}
+
+/*
+** CRC32C (Castagnoli), reflected polynomial...
+*/
+#define CRC32C_POLYNOMIAL               0x82F63B78
+
+static uint32_t         _crc32cTable[8][256];
+static pthread_once_t   _crc32cOnce = PTHREAD_ONCE_INIT;
+
+static void _crc32cInitTable(void) {
+    uint32_t        crc;
+    int             i;
+    int             j;
+
+    for (i = 0;i < 256;i++) {
+        crc = (uint32_t)i;
 
-    for (i = 0;i < length;i++) {
-        target[i] = target[i] ^ source[i];
+        for (j = 0;j < 8;j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+        }
+
+        _crc32cTable[0][i] = crc;
     }
+
+    for (i = 0;i < 256;i++) {
+        for (j = 1;j < 8;j++) {
+            _crc32cTable[j][i] = 
+                (_crc32cTable[j - 1][i] >> 8) ^ _crc32cTable[0][_crc32cTable[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+/*
+** Slice-by-8 for CPUs without a CRC32C instruction...
+*/
+static uint32_t _crc32cSoftware(uint32_t crc, const uint8_t * data, size_t length) {
+    uint64_t        w;
+
+    pthread_once(&_crc32cOnce, _crc32cInitTable);
+
+    while (length >= sizeof(uint64_t)) {
+        memcpy(&w, data, sizeof(uint64_t));
+
+        /*
+        ** The tables assume little endian word order...
+        */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        w ^= crc;
+
+        crc = 
+            _crc32cTable[7][w & 0xFF] ^ 
+            _crc32cTable[6][(w >> 8) & 0xFF] ^ 
+            _crc32cTable[5][(w >> 16) & 0xFF] ^ 
+            _crc32cTable[4][(w >> 24) & 0xFF] ^ 
+            _crc32cTable[3][(w >> 32) & 0xFF] ^ 
+            _crc32cTable[2][(w >> 40) & 0xFF] ^ 
+            _crc32cTable[1][(w >> 48) & 0xFF] ^ 
+            _crc32cTable[0][w >> 56];
+
+        data += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+
+    while (length > 0) {
+        crc = (crc >> 8) ^ _crc32cTable[0][(crc ^ *data++) & 0xFF];
+        length--;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+** SSE4.2 has a CRC32C instruction, one 64-bit word per instruction keeps
+** up with memory bandwidth. Compiled for SSE4.2 whatever the build flags,
+** it is only called if the CPU supports it...
+*/
+__attribute__((target("sse4.2")))
+static uint32_t _crc32cHardware(uint32_t crc, const uint8_t * data, size_t length) {
+    uint64_t        crc64 = crc;
+    uint64_t        w;
+
+    while (length >= sizeof(uint64_t)) {
+        memcpy(&w, data, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, w);
+
+        data += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+
+    crc = (uint32_t)crc64;
+
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t _crc32cHardware(uint32_t crc, const uint8_t * data, size_t length) {
+    uint64_t        w;
+
+    while (length >= sizeof(uint64_t)) {
+        memcpy(&w, data, sizeof(uint64_t));
+        crc = __crc32cd(crc, w);
+
+        data += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+
+    while (length > 0) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+
+    return crc;
+}
+#endif
+
+/*
+** Update a running CRC32C, start with crc = 0...
+*/
+uint32_t crc32c(uint32_t crc, const uint8_t * data, size_t length) {
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~_crc32cHardware(crc, data, length);
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    return ~_crc32cHardware(crc, data, length);
+#endif
+
+    return ~_crc32cSoftware(crc, data, length);
+}
+
+/*
+** Map a whole file read-only, falling back to reading it into
+** memory where mmap isn't available...
+*/
+uint8_t * mapFile(const char * pszFilename, size_t * length) {
+    uint8_t *       map;
+
+#ifndef _WIN32
+    struct stat     st;
+    int             fd;
+
+    fd = open(pszFilename, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    map = (uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    *length = (size_t)st.st_size;
+#else
+    FILE *          fptr;
+
+    fptr = fopen(pszFilename, "rb");
+
+    if (fptr == NULL) {
+        return NULL;
+    }
+
+    *length = getFileSize(fptr);
+
+    map = (uint8_t *)malloc(*length);
+
+    if (map == NULL || fread(map, 1, *length, fptr) < *length) {
+        free(map);
+        fclose(fptr);
+        return NULL;
+    }
+
+    fclose(fptr);
+#endif
+
+    return map;
+}
+
+void unmapFile(uint8_t * map, size_t length) {
+#ifndef _WIN32
+    munmap(map, length);
+#else
+    free(map);
+#endif
 }
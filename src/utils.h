@@ -1,12 +1,27 @@
 #include <stdio.h>
 #include <stdint.h>
+#include "cloak_types.h"
 
 #ifndef __INCL_UTILS
 #define __INCL_UTILS
 
-int         generateKeystreamFile(const char * pszKeystreamFile, uint32_t numBytes);
+int         generateKeystreamFile(const char * pszKeystreamFile, uint64_t numBytes);
 uint32_t    getFileSize(FILE * fptr);
 uint32_t    getFileSizeByName(const char * pszFilename);
+boolean     isSameFile(const char * pszFilename1, const char * pszFilename2);
+double      getTimeSeconds(void);
+int         deflateWithDictionary(
+                    const uint8_t * in, 
+                    uint32_t inLength, 
+                    const uint8_t * dict, 
+                    uint32_t dictLength, 
+                    uint8_t * out, 
+                    uint32_t outLength, 
+                    int level, 
+                    int memLevel, 
+                    int strategy, 
+                    boolean isFinal, 
+                    uint32_t * bytesWritten);
 char *      getFileExtension(char * pszFilename);
 void        wipeBuffer(void * b, uint32_t bufferLen);
 void        secureFree(void * b, uint32_t len);
@@ -15,5 +30,9 @@ void        dbg_free(uint16_t id, void * buffer, const char * pszFile, const int
 int         __getch(void);
 void        hexDump(void * buffer, uint32_t bufferLen);
 void        xorBuffer(uint8_t * target, uint8_t * source, size_t length);
+void        xorBuffers(uint8_t * target, const uint8_t * source1, const uint8_t * source2, size_t length);
+uint32_t    crc32c(uint32_t crc, const uint8_t * data, size_t length);
+uint8_t *   mapFile(const char * pszFilename, size_t * length);
+void        unmapFile(uint8_t * map, size_t length);
 
 #endif